@@ -38,7 +38,12 @@
  */
 
 #include <stdio.h>
+#include <string.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <vector>
 #include <string>
@@ -50,7 +55,33 @@
 #include <memory>
 #include <unordered_map>
 #include <utility>
+#include <tuple>
 #include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <future>
+#include <functional>
+#include <deque>
+
+// When this header provides stb_image's implementation, its allocations go
+// through the decode arena below (see decode_arena_t). Define
+// GL_ATLAS_NO_DECODE_ARENA, or your own STBI_MALLOC, to opt out.
+#if defined(STB_IMAGE_IMPLEMENTATION) && !defined(STBI_MALLOC) \
+	&& !defined(GL_ATLAS_NO_DECODE_ARENA)
+	#define GL_ATLAS_DECODE_ARENA_HOOKS
+
+	namespace gla {
+		static void* decode_arena_malloc(size_t size);
+		static void* decode_arena_realloc(void* p, size_t old_size, size_t new_size);
+		static void decode_arena_free(void* p);
+	}
+
+	#define STBI_MALLOC(sz) ::gla::decode_arena_malloc(sz)
+	#define STBI_REALLOC_SIZED(p, oldsz, newsz) \
+		::gla::decode_arena_realloc((p), (oldsz), (newsz))
+	#define STBI_FREE(p) ::gla::decode_arena_free(p)
+#endif
 
 #include "stb_image.h"
 
@@ -61,24 +92,50 @@
 	#include <GLFW/glfw3.h>
 	#define GL_ATLAS_INTERNAL_TEX_FORMAT GL_RGBA8
 #elif defined(GL_ATLAS_EGL)
-	#include <GLES2/gl2.h>
+	// Define GL_ATLAS_GLES3 too for GLES 3 contexts, which have texture
+	// arrays.
+	#ifdef GL_ATLAS_GLES3
+		#include <GLES3/gl3.h>
+	#else
+		#include <GLES2/gl2.h>
+	#endif
 	#include <GLES2/gl2ext.h>
 	#include <EGL/egl.h>
 	#define GL_ATLAS_INTERNAL_TEX_FORMAT GL_RGBA
+#elif defined(GL_ATLAS_NO_GL)
+	// Packing and baking only, into a null_backend_t or cpu_backend_t, for
+	// machines without GL: no GL headers are included and no GL is called.
+	// The few GL types the rest of the header uses are all that's left.
+	typedef unsigned int GLuint;
+	typedef int GLint;
+	typedef unsigned int GLenum;
+	typedef int GLsizei;
 #else
-	#error "define either GL_ATLAS_GLEW or GL_ATLAS_EGL to " \
+	#error "define GL_ATLAS_GLEW, GL_ATLAS_EGL or GL_ATLAS_NO_GL to " \
 		"choose header implementation"
 #endif
 
+#if defined(GL_ATLAS_GLEW) || defined(GL_ATLAS_GLES3)
+	#define GL_ATLAS_TEXTURE_ARRAYS
+#endif
+
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/matrix_access.hpp>
 #include <glm/gtc/type_ptr.hpp>
 
 #include <assert.h>
+#include <math.h>
 #include <stdarg.h>
 #include <stdint.h>
 
+// Define GL_ATLAS_NO_SIMD to build the CPU-side image processing scalar only.
+#if !defined(GL_ATLAS_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) \
+	|| (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+	#define GL_ATLAS_SSE2
+	#include <emmintrin.h>
+#endif
+
 #ifdef GL_ATLAS_MAIN
 	#define SHADER(s) "#version 410 core\n"#s
 	#define SS_INDEX(s) "[" << (s) << "]"
@@ -100,6 +157,7 @@ namespace gla {
 #endif
 	}
 
+#ifndef GL_ATLAS_NO_GL
 	static std::vector<std::string> g_gl_err_msg_cache;
 
 	static ga_inline void exit_on_gl_error(int line, const char* func,
@@ -140,6 +198,7 @@ namespace gla {
 			atlas_error_exit();
 		}
 	}
+#endif
 
 	static ga_inline void logf_impl( int line, const char* func,
 		const char* fmt, ... )
@@ -159,7 +218,7 @@ namespace gla {
 	#define IF_DEBUG(expr)
 #endif
 
-#ifdef DEBUG
+#if defined(DEBUG) && !defined(GL_ATLAS_NO_GL)
 	#define GL_H(expr) \
 	do { \
 		( expr ); \
@@ -190,635 +249,6973 @@ namespace gla {
 		return x;
 	}
 
-	// When we have multiple atlasses for a single set of images, we use layers.
+	// Word-at-a-time FNV-1a with an extra xorshift per step so the high
+	// bits of each word reach the low bits of the state. Used for change
+	// detection and cache keys, not for anything adversarial.
+	static ga_inline uint64_t hash_bytes(const void* data, size_t size,
+		uint64_t seed = 0)
+	{
+		const uint64_t prime = 0x100000001b3ULL;
+		const uint8_t* p = (const uint8_t*) data;
 
-	static void ga_inline alloc_blank_texture(
-		size_t width,
-		size_t height,
-		uint32_t clear_val);
+		uint64_t h = 0xcbf29ce484222325ULL ^ seed;
 
-	using image_fill_map_t = std::unordered_map<uint16_t, uint8_t>;
+		for (size_t i = 0; i < (size >> 3); ++i, p += 8) {
+			uint64_t w;
+			memcpy(&w, p, sizeof(w));
+			h = (h ^ w) * prime;
+			h ^= h >> 29;
+		}
 
-	struct atlas_image_info_t {
-		uint8_t 	layer;
-		glm::vec2 	coords;
-		glm::vec2 	inverse_layer_dims;
-	};
+		for (size_t i = 0; i < (size & 7); ++i)
+			h = (h ^ p[i]) * prime;
 
-	struct atlas_t {
-		uint32_t num_images;
+		h ^= (uint64_t) size;
+		h *= 0xff51afd7ed558ccdULL;
+		h ^= h >> 33;
 
-		uint32_t area_accum;
+		return h;
+	}
 
-		std::vector<uint8_t> layers;
+	//------------------------------------------------------------------------------------
+	// worker_pool_t
+	//
+	// Small fixed-size thread pool for the CPU-side stages of an atlas build
+	// (decode, conversion, packing). Nothing submitted here may touch GL.
+	//------------------------------------------------------------------------------------
 
-		std::vector<uint16_t> widths;
-		std::vector<uint16_t> heights;
+	class worker_pool_t
+	{
+		std::vector<std::thread> threads;
 
-		std::vector<uint16_t> dims_x;
-		std::vector<uint16_t> dims_y;
+		std::deque<std::function<void()>> tasks;
 
-		std::vector<uint16_t> coords_x;
-		std::vector<uint16_t> coords_y;
+		std::mutex mutex;
+		std::condition_variable wake;
 
-		std::vector<GLuint> layer_tex_handles;
+		bool stopping;
 
-		std::vector<std::vector<uint8_t>> buffer_table;
+		void run(void)
+		{
+			for (;;) {
+				std::function<void()> task;
 
-		std::vector<std::string> filenames; // optional
+				{
+					std::unique_lock<std::mutex> lock(mutex);
 
-		std::unordered_map<size_t, uint16_t> key_map;	// optional
+					wake.wait(lock, [this](void) -> bool {
+						return stopping || !tasks.empty();
+					});
 
-		uint16_t origin_x(uint16_t image) const
+					if (tasks.empty())
+						return;
+
+					task = std::move(tasks.front());
+					tasks.pop_front();
+				}
+
+				task();
+			}
+		}
+
+	public:
+		worker_pool_t(size_t count)
+			:	stopping(false)
 		{
-			return coords_x[image];
+			if (count == 0)
+				count = 1;
+
+			for (size_t i = 0; i < count; ++i)
+				threads.push_back(std::thread(&worker_pool_t::run, this));
 		}
 
-		uint16_t origin_y(uint16_t image) const
+		~worker_pool_t(void)
 		{
-			return coords_y[image];
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				stopping = true;
+			}
+
+			wake.notify_all();
+
+			for (std::thread& t: threads)
+				t.join();
 		}
 
-		uint8_t layer(uint16_t image) const
+		size_t size(void) const
 		{
-			assert(image < layers.size());
-			assert(layers[image] != 0xFF);
-			return layers[image];
+			return threads.size();
 		}
 
-		atlas_image_info_t image_info(uint16_t image) const
+		void submit(std::function<void()> task)
 		{
-			uint8_t L = layer(image);
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				tasks.push_back(std::move(task));
+			}
 
-			atlas_image_info_t img {
-				L,
-				glm::vec2(origin_x(image), origin_y(image)),
-				glm::vec2(
-					1.0f / static_cast<float>(widths[L]),
-					1.0f / static_cast<float>(heights[L])
-				)
+			wake.notify_one();
+		}
+
+		// Calls fn(i) for every i in [0, count) and returns once all calls
+		// have finished. The calling thread takes indices too, so this is
+		// safe to use from inside a pool task: if every worker is busy the
+		// caller simply does all of the work itself.
+		void parallel_for(size_t count, std::function<void(size_t)> fn)
+		{
+			if (count == 0)
+				return;
+
+			struct batch_t {
+				std::function<void(size_t)> fn;
+				size_t count;
+
+				std::atomic<size_t> next;
+				std::atomic<size_t> finished;
+
+				std::mutex mutex;
+				std::condition_variable done;
+
+				void work(void)
+				{
+					size_t i;
+
+					while ((i = next.fetch_add(1)) < count) {
+						fn(i);
+
+						if (finished.fetch_add(1) + 1 == count) {
+							std::lock_guard<std::mutex> lock(mutex);
+							done.notify_all();
+						}
+					}
+				}
 			};
 
-			return img;
+			// Helpers may only get scheduled after the batch is done,
+			// so they hold their own reference to it.
+			std::shared_ptr<batch_t> batch(new batch_t());
+			batch->fn = std::move(fn);
+			batch->count = count;
+			batch->next = 0;
+			batch->finished = 0;
+
+			size_t helpers = std::min(count - 1, threads.size());
+
+			for (size_t i = 0; i < helpers; ++i)
+				submit([batch](void) { batch->work(); });
+
+			batch->work();
+
+			std::unique_lock<std::mutex> lock(batch->mutex);
+			batch->done.wait(lock, [&batch](void) -> bool {
+				return batch->finished == batch->count;
+			});
 		}
+	};
 
-		void push_layer(uint16_t width, uint16_t height)
-		{
-			size_t index = layer_tex_handles.size();
+	static ga_inline worker_pool_t& default_worker_pool(void)
+	{
+		// One thread is left for whoever owns the GL context.
+		static worker_pool_t pool(
+			std::max(std::thread::hardware_concurrency(), 2u) - 1);
 
-			layer_tex_handles.push_back(0);
-			widths.push_back(width);
-			heights.push_back(height);
+		return pool;
+	}
+
+	static ga_inline void stbi_parallel_for_pool(void* user, int count,
+		void (*task)(void* arg, int index), void* arg)
+	{
+		static_cast<worker_pool_t*>(user)->parallel_for((size_t) count,
+			[task, arg](size_t i) { task(arg, (int) i); });
+	}
+
+	// Lets stb_image split a single large JPEG across the default pool
+	// (restart intervals and color conversion). Nested in a decode task,
+	// that's safe since parallel_for callers take work themselves.
+	static ga_inline void install_stbi_parallel_for(void)
+	{
+		static bool installed = (stbi_set_parallel_for(stbi_parallel_for_pool,
+			&default_worker_pool()), true);
 
-			GL_H( glGenTextures(1, &layer_tex_handles[index]) );
+		(void) installed;
+	}
+
+	// When we have multiple atlasses for a single set of images, we use layers.
+
+	// Every layer holds images stored in the same format. Whatever the
+	// format, a layer samples the same as if its images had been expanded to
+	// RGBA: opaque ones as (R, G, B, 1), gray as (L, L, L, 1) and gray+alpha
+	// as (L, L, L, A). On desktop GL the gray ones take a swizzle, since
+	// luminance formats aren't part of the core profile.
+	//
+	// The block compressed formats are only ever a layer's, never an
+	// image's: see atlas_build_opts_t::compression.
+	enum atlas_pixel_format_t : uint8_t {
+		ATLAS_PIXEL_RGBA8 = 0,
+		ATLAS_PIXEL_RGB8,
+		ATLAS_PIXEL_RGB565,	// lossy, only with atlas_build_opts_t::rgb565
+		ATLAS_PIXEL_L8,
+		ATLAS_PIXEL_LA8,
+		ATLAS_PIXEL_ETC1,	// opaque, 8 bytes per 4x4 block
+		ATLAS_PIXEL_BC1,	// opaque, 8 bytes per 4x4 block
+		ATLAS_PIXEL_BC3		// 16 bytes per 4x4 block
+	};
+
+	static ga_inline bool pixel_format_compressed(atlas_pixel_format_t format)
+	{
+		return format >= ATLAS_PIXEL_ETC1;
+	}
+
+	// 0 for the block compressed formats, see layer_data_bytes.
+	static ga_inline size_t pixel_format_bytes(atlas_pixel_format_t format)
+	{
+		static const uint8_t bytes[] = { 4, 3, 2, 1, 2, 0, 0, 0 };
+		return bytes[format];
+	}
 
-			bind(index);
+	static ga_inline uint8_t pixel_format_channels(atlas_pixel_format_t format)
+	{
+		static const uint8_t channels[] = { 4, 3, 3, 1, 2, 3, 3, 4 };
+		return channels[format];
+	}
+
+	// Size of a width x height level in format, partial blocks included.
+	static ga_inline size_t layer_data_bytes(atlas_pixel_format_t format,
+		size_t width, size_t height)
+	{
+		if (!pixel_format_compressed(format))
+			return width * height * pixel_format_bytes(format);
 
-			GL_H( glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
-				GL_LINEAR) );
-			GL_H( glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
-				GL_LINEAR) );
-			GL_H( glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S,
-				GL_CLAMP_TO_EDGE) );
-			GL_H( glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T,
-				GL_CLAMP_TO_EDGE) );
+		size_t blocks = ((width + 3) / 4) * ((height + 3) / 4);
+		return blocks * (format == ATLAS_PIXEL_BC3 ? 16 : 8);
+	}
 
-			alloc_blank_texture(widths[index], heights[index], 0x00);
+#ifndef GL_ATLAS_NO_GL
+	// format and type don't apply to the block compressed formats, which
+	// are uploaded as is.
+	static ga_inline void layer_tex_formats(atlas_pixel_format_t pixel_format,
+		GLint& internal_format, GLenum& format, GLenum& type)
+	{
+		type = GL_UNSIGNED_BYTE;
+
+		switch (pixel_format) {
+		case ATLAS_PIXEL_BC1:
+			internal_format = GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+			format = GL_RGB;
+			break;
+		case ATLAS_PIXEL_BC3:
+			internal_format = GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+			format = GL_RGBA;
+			break;
+#ifdef GL_ATLAS_TEXTURE_ARRAYS
+		// ETC2 decoders read ETC1 blocks unchanged, and unlike ETC1 it's
+		// allowed in texture arrays.
+		case ATLAS_PIXEL_ETC1:
+			internal_format = GL_COMPRESSED_RGB8_ETC2;
+			format = GL_RGB;
+			break;
+#else
+		case ATLAS_PIXEL_ETC1:
+			internal_format = GL_ETC1_RGB8_OES;
+			format = GL_RGB;
+			break;
+#endif
+#ifdef GL_ATLAS_GLEW
+		case ATLAS_PIXEL_RGB8:
+			internal_format = GL_RGB8;
+			format = GL_RGB;
+			break;
+		// GL_RGB565 is only a sized internal format from GL 4.1, or with
+		// ARB_ES2_compatibility. Older contexts get GL_RGB8, converting the
+		// 5:6:5 texels on upload, which loses the memory saving but not
+		// the smaller uploads.
+		case ATLAS_PIXEL_RGB565:
+			internal_format = GLEW_VERSION_4_1 || GLEW_ARB_ES2_compatibility
+				? GL_RGB565 : GL_RGB8;
+			format = GL_RGB;
+			type = GL_UNSIGNED_SHORT_5_6_5;
+			break;
+		case ATLAS_PIXEL_L8:
+			internal_format = GL_R8;
+			format = GL_RED;
+			break;
+		case ATLAS_PIXEL_LA8:
+			internal_format = GL_RG8;
+			format = GL_RG;
+			break;
+#else
+		case ATLAS_PIXEL_RGB8:
+			internal_format = GL_RGB;
+			format = GL_RGB;
+			break;
+		case ATLAS_PIXEL_RGB565:
+			internal_format = GL_RGB;
+			format = GL_RGB;
+			type = GL_UNSIGNED_SHORT_5_6_5;
+			break;
+		case ATLAS_PIXEL_L8:
+			internal_format = GL_LUMINANCE;
+			format = GL_LUMINANCE;
+			break;
+		case ATLAS_PIXEL_LA8:
+			internal_format = GL_LUMINANCE_ALPHA;
+			format = GL_LUMINANCE_ALPHA;
+			break;
+#endif
+		default:
+			internal_format = GL_ATLAS_INTERNAL_TEX_FORMAT;
+			format = GL_ATLAS_TEX_FORMAT;
+			break;
 		}
+	}
 
-		void set_layer(uint16_t image, uint8_t layer)
-		{
-			if (layers.size() != num_images)
-				layers.resize(num_images, 0xFF);
+#endif
 
-			layers[image] = layer;
+	// Texture calls made to build layers, for the build statistics. Each build
+	// has its own, which the backend counts into while that build uploads (see
+	// upload_stats_scope_t), so builds pumped side by side don't mix their
+	// counts. Backends other than GL count the same calls as if they were a
+	// GL context.
+	struct atlas_upload_stats_t {
+		uint64_t layers;				// layers allocated
+		uint64_t tex_image_calls;		// gl[Compressed]TexImage2D/3D
+		uint64_t tex_sub_image_calls;	// gl[Compressed]TexSubImage2D/3D, glClearTexSubImage
+		uint64_t bytes;					// pixel data handed to the backend
+		uint64_t pbo_waits;				// unpack buffers still in use by the GPU
+		uint64_t state_calls;			// binds, unit switches, pixel stores and queries made
+		uint64_t state_skipped;			// redundant ones, and queries answered from the shadow
+	};
+
+#ifndef GL_ATLAS_NO_GL
+	//------------------------------------------------------------------------------------
+	// gl_state_cache_t
+	//
+	// Shadow copy of the bits of GL state the library changes: the active
+	// texture unit, the texture bound to each unit, the bound pixel unpack
+	// buffer and GL_UNPACK_ALIGNMENT, plus GL_MAX_TEXTURE_SIZE, which the
+	// builds ask for. Calls which wouldn't change anything are skipped, and
+	// reads of that state are answered from the shadow rather than with a
+	// glGet, which can stall the pipeline on some drivers.
+	//
+	// Everything starts out unknown, so the first call for each piece of state
+	// always goes through. The shadow only stays right while that state is
+	// changed through it, though: call invalidate() after binding textures or
+	// buffers behind its back. Since that state belongs to a context, each
+	// gl_backend_t keeps its own shadow, and a context needs a backend of its
+	// own.
+	//------------------------------------------------------------------------------------
+
+	// Texture units tracked; binds on higher ones are always issued.
+	#define GL_ATLAS_STATE_UNITS 32
+
+	class gl_state_cache_t
+	{
+		enum {
+			TARGET_2D = 0,
+			TARGET_2D_ARRAY,
+			NUM_TARGETS
+		};
+
+		static const GLuint unknown = 0xFFFFFFFF;
+
+		GLuint active_unit; // offset from GL_TEXTURE0
+		GLuint textures[GL_ATLAS_STATE_UNITS][NUM_TARGETS];
+		GLuint unpack_buffer;
+		GLint unpack_alignment;
+		GLint max_texture;
+
+		atlas_upload_stats_t uncounted;
+
+		atlas_upload_stats_t& stats(void)
+		{
+			return counts ? *counts : uncounted;
 		}
 
-		void bind(uint8_t layer) const
+		// The shadow of target on the active unit, or null when that's
+		// not tracked.
+		GLuint* texture_shadow(GLenum target)
 		{
-			GL_H( glBindTexture(GL_TEXTURE_2D, layer_tex_handles[layer]) );
+			size_t index = TARGET_2D;
+
+#ifdef GL_ATLAS_TEXTURE_ARRAYS
+			if (target == GL_TEXTURE_2D_ARRAY)
+				index = TARGET_2D_ARRAY;
+			else
+#endif
+			if (target != GL_TEXTURE_2D)
+				return nullptr;
+
+			if (active_unit == unknown) {
+				GLint unit;
+				GL_H( glGetIntegerv(GL_ACTIVE_TEXTURE, &unit) );
+				stats().state_calls++;
+
+				active_unit = (GLuint) (unit - GL_TEXTURE0);
+			}
+
+			if (active_unit >= GL_ATLAS_STATE_UNITS)
+				return nullptr;
+
+			return &textures[active_unit][index];
 		}
 
-		void bind_to_active_slot(uint8_t layer, int offset) const
+	public:
+		// Where the calls are counted, null for nowhere; see
+		// gl_backend_t::count_into.
+		atlas_upload_stats_t* counts;
+
+		gl_state_cache_t(void)
+			:	uncounted(),
+				counts(nullptr)
 		{
-			GL_H( glActiveTexture(GL_TEXTURE0 + offset) );
-			bind(layer);
+			invalidate();
 		}
 
-		void release(void) const
+		void invalidate(void)
 		{
-			GL_H( glBindTexture(GL_TEXTURE_2D, 0) );
+			active_unit = unknown;
+
+			for (auto& unit: textures) {
+				for (GLuint& handle: unit)
+					handle = unknown;
+			}
+
+			unpack_buffer = unknown;
+			unpack_alignment = 0;
+			max_texture = 0;
 		}
 
-		void release_from_active_slot(int offset) const
+		void active_texture(GLuint unit)
 		{
-			GL_H( glActiveTexture(GL_TEXTURE0 + offset) );
-			release();
+			if (unit == active_unit) {
+				stats().state_skipped++;
+				return;
+			}
+
+			GL_H( glActiveTexture(GL_TEXTURE0 + unit) );
+			stats().state_calls++;
+
+			active_unit = unit;
 		}
 
-		void write_origins(uint16_t image, uint16_t x, uint16_t y)
+		void bind_texture(GLenum target, GLuint handle)
 		{
-			if (coords_x.size() != num_images)
-				coords_x.resize(num_images, 0);
+			GLuint* shadow = texture_shadow(target);
 
-			coords_x[image] = x;
+			if (shadow && *shadow == handle) {
+				stats().state_skipped++;
+				return;
+			}
 
-			if (coords_y.size() != num_images)
-				coords_y.resize(num_images, 0);
+			GL_H( glBindTexture(target, handle) );
+			stats().state_calls++;
 
-			coords_y[image] = y;
+			if (shadow)
+				*shadow = handle;
 		}
 
-		void fill_atlas_image(size_t image)
+		// Deleting a texture unbinds it from every unit it's bound to, so
+		// there's no need to check for or unbind it first.
+		void delete_textures(size_t count, const GLuint* handles)
 		{
-			GL_H( glTexSubImage2D(GL_TEXTURE_2D,
-								  0,
-								  (GLsizei) origin_x(image),
-								  (GLsizei) origin_y(image),
-								  dims_x[image],
-								  dims_y[image],
-								  GL_ATLAS_TEX_FORMAT,
-								  GL_UNSIGNED_BYTE,
-								  &buffer_table[image][0]) );
+			for (auto& unit: textures) {
+				for (GLuint& bound: unit) {
+					if (std::find(handles, handles + count, bound)
+						!= handles + count)
+						bound = 0;
+				}
+			}
+
+			GL_H( glDeleteTextures((GLsizei) count, handles) );
+			stats().state_calls++;
 		}
 
-		uint16_t key_image(size_t key) const
+#ifdef GL_ATLAS_GLEW
+		void bind_unpack_buffer(GLuint buffer)
 		{
-			return key_map.at(key);
+			if (buffer == unpack_buffer) {
+				stats().state_skipped++;
+				return;
+			}
+
+			GL_H( glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer) );
+			stats().state_calls++;
+
+			unpack_buffer = buffer;
 		}
 
-		void map_key_to_image(size_t key, uint16_t image)
+		GLuint bound_unpack_buffer(void)
 		{
-			key_map[key] = image;
+			if (unpack_buffer != unknown) {
+				stats().state_skipped++;
+				return unpack_buffer;
+			}
+
+			GLint buffer;
+			GL_H( glGetIntegerv(GL_PIXEL_UNPACK_BUFFER_BINDING, &buffer) );
+			stats().state_calls++;
+
+			unpack_buffer = (GLuint) buffer;
+			return unpack_buffer;
 		}
 
-		void free_memory(void)
+		void delete_buffer(GLuint buffer)
 		{
-			{
-				GLint curr_bound_tex;
-				GL_H( glGetIntegerv(GL_TEXTURE_BINDING_2D, &curr_bound_tex) );
+			if (buffer == unpack_buffer)
+				unpack_buffer = 0;
 
-				// We unbind if any of this atlas's textures are bound
-				// because a glDelete call on a bound item can't be fulfilled
-				// until that item is unbound
+			GL_H( glDeleteBuffers(1, &buffer) );
+			stats().state_calls++;
+		}
+#endif
 
-				bool bound = false;
-				for (GLuint handle = 0; handle < layer_tex_handles.size()
-					&& !bound && curr_bound_tex; ++handle) {
-					bound = (GLuint)curr_bound_tex == layer_tex_handles[handle];
-				}
+		void set_unpack_alignment(GLint alignment)
+		{
+			if (alignment == unpack_alignment) {
+				stats().state_skipped++;
+				return;
+			}
 
-				if (bound) {
-					GL_H( glBindTexture(GL_TEXTURE_2D, 0) );
-				}
+			GL_H( glPixelStorei(GL_UNPACK_ALIGNMENT, alignment) );
+			stats().state_calls++;
 
-				GL_H( glDeleteTextures(layer_tex_handles.size(),
-					&layer_tex_handles[0]) );
-			}
+			unpack_alignment = alignment;
+		}
 
-			num_images = 0;
-			area_accum = 0;
+		GLint get_unpack_alignment(void)
+		{
+			if (unpack_alignment) {
+				stats().state_skipped++;
+				return unpack_alignment;
+			}
 
-			widths.clear();
-			heights.clear();
-			dims_x.clear();
-			dims_y.clear();
-			coords_x.clear();
-			coords_y.clear();
-			buffer_table.clear();
-			filenames.clear();
+			GL_H( glGetIntegerv(GL_UNPACK_ALIGNMENT, &unpack_alignment) );
+			stats().state_calls++;
 
-			layers.clear();
-			layer_tex_handles.clear();
+			return unpack_alignment;
 		}
 
-		~atlas_t(void)
+		// Fixed for a context, so only queried once.
+		GLint max_texture_size(void)
 		{
-			free_memory();
-		}
+			if (max_texture) {
+				stats().state_skipped++;
+				return max_texture;
+			}
 
-		atlas_t(void)
-			: 	num_images(0),
-				area_accum(0)
-		{}
+			GL_H( glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_texture) );
+			stats().state_calls++;
+
+			return max_texture;
+		}
 	};
 
-	//------------------
-	// gen_layer_bsp
-	//
-	// generates a layer (think of "layer" in this sense as just a texture
-	// representing a portion for a set of a group of images ).
-	// The core algorithm is based on 2D BSP generation.
-	//
-	// it assesses whether or not sorted images for this layer
-	// actually save space and how large this layer actually needs to be.
-	//
-	// the set of images a layer has will be more efficiently placed if the
-	// variation of the image sizes is high; if a layer consists
-	// of images which are of the same dimensions, then there will be a lot of unused
-	// space.
+	// With null pixels this only allocates storage: the contents are
+	// undefined until written, see clear_atlas_gaps for zeroing what images
+	// don't cover.
 	//
-	// idea behind BSP algol is from here:
-	// http://gamedev.stackexchange.com/a/34193
-	//------------------
-
-	class gen_layer_bsp
+	// A slice of 0 or more writes to that slice of the bound texture array
+	// instead, whose storage gl_backend_t::create_array has allocated.
+	static ga_inline void alloc_layer_texture(size_t width, size_t height,
+		atlas_pixel_format_t pixel_format, const void* pixels, GLint level,
+		GLint slice, gl_state_cache_t& state, atlas_upload_stats_t& stats)
 	{
-		struct node_t;
+		GLint internal_format;
+		GLenum format, type;
+		layer_tex_formats(pixel_format, internal_format, format, type);
 
-		using node_ptr_t = std::unique_ptr<node_t, void (*)(node_t*)>;
-		using atlas_type_t = atlas_t;
+#ifndef GL_ATLAS_GLEW
+		(void) state; // only asked about unpack buffers
+#endif
 
-		atlas_type_t& atlas;
+		size_t bytes = layer_data_bytes(pixel_format, width, height);
 
-		node_ptr_t root;
-		glm::ivec3 layer_dims;
+#ifdef GL_ATLAS_TEXTURE_ARRAYS
+		if (slice >= 0) {
+			bool data = pixels != nullptr;
 
-		// Only left child's are capable of storing image indices,
-		// from the perspective of the child's parent.
+#ifdef GL_ATLAS_GLEW
+			// Null may also be an offset of 0 into an unpack buffer.
+			if (!data)
+				data = state.bound_unpack_buffer() != 0;
+#endif
 
-		// The "lines" (expressed implicitly) will only have
-		// positive normals that face either to the right, or upward.
-		struct node_t {
-			bool region;
-			int32_t image;
+			if (level == 0)
+				stats.layers++;
+
+			if (!data)
+				return;
+
+			if (pixel_format_compressed(pixel_format)) {
+				GL_H( glCompressedTexSubImage3D(GL_TEXTURE_2D_ARRAY,
+												level,
+												0,
+												0,
+												slice,
+												(GLsizei) width,
+												(GLsizei) height,
+												1,
+												(GLenum) internal_format,
+												(GLsizei) bytes,
+												pixels) );
+			} else {
+				GL_H( glTexSubImage3D(GL_TEXTURE_2D_ARRAY,
+									  level,
+									  0,
+									  0,
+									  slice,
+									  (GLsizei) width,
+									  (GLsizei) height,
+									  1,
+									  format,
+									  type,
+									  pixels) );
+			}
 
-			glm::ivec2 origin;
-			glm::ivec2 dims;
+			stats.tex_sub_image_calls++;
 
-			node_t* left_child;
+			if (pixels)
+				stats.bytes += bytes;
+
+			return;
+		}
+#else
+		(void) slice;
+#endif
+
+		if (pixel_format_compressed(pixel_format)) {
+			GL_H( glCompressedTexImage2D(GL_TEXTURE_2D,
+										 level,
+										 (GLenum) internal_format,
+										 (GLsizei) width,
+										 (GLsizei) height,
+										 0,
+										 (GLsizei) bytes,
+										 pixels) );
+		} else {
+			GL_H( glTexImage2D(GL_TEXTURE_2D,
+							   level,
+							   internal_format,
+							   (GLsizei) width,
+							   (GLsizei) height,
+							   0,
+							   format,
+							   type,
+							   pixels) );
+		}
+
+		if (level == 0)
+			stats.layers++;
+
+		stats.tex_image_calls++;
+
+		if (pixels)
+			stats.bytes += bytes;
+	}
+
+	static ga_inline bool gl_has_extension(const char* name)
+	{
+#ifdef GL_ATLAS_GLEW
+		GLint count = 0;
+		GL_H( glGetIntegerv(GL_NUM_EXTENSIONS, &count) );
+
+		for (GLint i = 0; i < count; ++i) {
+			const char* ext = (const char*) glGetStringi(GL_EXTENSIONS, i);
+
+			if (ext && !strcmp(ext, name))
+				return true;
+		}
+#else
+		const char* all = (const char*) glGetString(GL_EXTENSIONS);
+		size_t len = strlen(name);
+
+		for (const char* p = all; p && (p = strstr(p, name)); p += len) {
+			if ((p == all || p[-1] == ' ') && (p[len] == ' ' || !p[len]))
+				return true;
+		}
+#endif
+
+		return false;
+	}
+
+#endif
+
+	//------------------------------------------------------------------------------------
+	// atlas_backend_t
+	//
+	// Where an atlas's layers are created and written to. Packing, composing and
+	// block compression all happen on the CPU; only what's left is handed to the
+	// backend, one layer, level or rect at a time, so the same build can go to:
+	//
+	//	gl_backend_t	textures in the current GL context: desktop GL with GLEW or
+	//					GLES 2/3 with EGL, whichever the header is built for.
+	//					The default. It shadows the context's state (see
+	//					gl_state_cache_t), so with several contexts each
+	//					needs a backend of its own.
+	//	null_backend_t	nowhere, for timing the CPU side of builds.
+	//	cpu_backend_t	layers kept in memory as a GPU would hold them, for
+	//					baking atlases offline.
+	//
+	// The last two need no GL context, and with GL_ATLAS_NO_GL the header is
+	// built without GL altogether. Handles are whatever the backend hands out,
+	// never 0. Calls come from the thread uploading the layers, except for
+	// supports_arrays, which is asked while packing.
+	//------------------------------------------------------------------------------------
+
+	// Bytes of zeros atlas_backend_t::clear_rect writes from at most per call.
+	#ifndef GL_ATLAS_ZERO_STRIP_BYTES
+		#define GL_ATLAS_ZERO_STRIP_BYTES (256u << 10)
+	#endif
+
+	class atlas_backend_t
+	{
+		atlas_upload_stats_t* counts;
+		atlas_upload_stats_t uncounted;
+
+	protected:
+		// The stats of the build uploading, or a set nobody reads.
+		atlas_upload_stats_t& stats(void)
+		{
+			return counts ? *counts : uncounted;
+		}
+
+	public:
+		atlas_backend_t(void)
+			:	counts(nullptr),
+				uncounted()
+		{}
+
+		virtual ~atlas_backend_t(void) {}
+
+		// Where the calls from here on are counted, null for nowhere;
+		// returns where they were before. See upload_stats_scope_t.
+		virtual atlas_upload_stats_t* count_into(atlas_upload_stats_t* stats)
+		{
+			std::swap(counts, stats);
+			return stats;
+		}
+
+#ifdef GL_ATLAS_GLEW
+		// The shadow of the GL state this backend's calls go to, for
+		// upload_staging_t's unpack buffers; null for backends without GL.
+		virtual gl_state_cache_t* gl_state(void)
+		{
+			return nullptr;
+		}
+#endif
+
+		// The longest side a layer can have.
+		virtual GLint max_layer_size(void) = 0;
+
+		// Whether layers can be stored in format, which only the block
+		// compressed formats may not be.
+		virtual bool supports_format(atlas_pixel_format_t format) = 0;
+
+		// Whether layers can be the slices of one array texture.
+		virtual bool supports_arrays(void) const = 0;
+
+		// The most slices such a texture can have; by default the 256 both
+		// GL 3 and GLES 3 guarantee.
+		virtual GLint max_array_layers(void)
+		{
+			return supports_arrays() ? 256 : 0;
+		}
+
+		// Whether uploads may go through GL pixel unpack buffers, see
+		// upload_staging_t.
+		virtual bool streams_uploads(void) const
+		{
+			return false;
+		}
+
+		// A texture of its own for a layer, with level 0 from pixels: either
+		// null, leaving it undefined, or the full level in tightly packed
+		// rows. A mipmapped layer still needs every level below 0 written
+		// to be complete.
+		virtual GLuint create_layer(uint16_t width, uint16_t height,
+			atlas_pixel_format_t format, const void* pixels,
+			bool mipmapped) = 0;
+
+		// One texture for count layers of the same size and format, each a
+		// slice with levels mip levels, all undefined until written.
+		virtual GLuint create_array(uint16_t width, uint16_t height,
+			size_t count, atlas_pixel_format_t format, GLint levels) = 0;
+
+		// Writes a whole level of a layer, into its own texture with a slice
+		// of -1 and into that slice of an array otherwise. Null pixels leave
+		// it undefined.
+		virtual void write_level(GLuint handle, GLint slice, GLint level,
+			size_t width, size_t height, atlas_pixel_format_t format,
+			const void* pixels) = 0;
+
+		// Writes tightly packed rows to a rect of level 0 of a layer in an
+		// uncompressed format.
+		virtual void write_rect(GLuint handle, GLint slice, GLint x, GLint y,
+			GLsizei width, GLsizei height, atlas_pixel_format_t format,
+			const void* pixels) = 0;
+
+		// Zeroes a rect of level 0 of a layer in an uncompressed format. By
+		// default with write_rect, from a strip of zeros holding as many of
+		// the rect's rows as fit.
+		virtual void clear_rect(GLuint handle, GLint slice, GLint x, GLint y,
+			GLsizei width, GLsizei height, atlas_pixel_format_t format)
+		{
+			static const uint8_t zeros[GL_ATLAS_ZERO_STRIP_BYTES] = {};
+
+			// Rows are padded to 4 bytes, which covers either unpack
+			// alignment. Even the widest layer's fit at least once.
+			size_t row_bytes = ((size_t) width * pixel_format_bytes(format)
+				+ 3) & ~(size_t) 3;
+			GLsizei rows = (GLsizei) std::max(sizeof(zeros) / row_bytes,
+				(size_t) 1);
+
+			for (GLsizei y1 = 0; y1 < height; y1 += rows)
+				write_rect(handle, slice, x, y + y1, width,
+					std::min(rows, height - y1), format, zeros);
+		}
+
+		virtual void delete_layers(size_t count, const GLuint* handles) = 0;
+
+		// Around the writes uploading a layer whose images are in format.
+		virtual void begin_layer(atlas_pixel_format_t format)
+		{
+			(void) format;
+		}
+
+		virtual void end_layer(void) {}
+
+		// For drawing: binds a layer's texture, or unbinds with a handle of
+		// 0, on unit, or on the active one if that's -1.
+		virtual void bind(GLuint handle, bool array, GLint unit)
+		{
+			(void) handle;
+			(void) array;
+			(void) unit;
+		}
+	};
+
+	// Counts a backend's calls into stats until the scope ends.
+	class upload_stats_scope_t
+	{
+		atlas_backend_t& backend;
+		atlas_upload_stats_t* saved;
+
+	public:
+		upload_stats_scope_t(atlas_backend_t& counted,
+			atlas_upload_stats_t* stats)
+			:	backend(counted),
+				saved(counted.count_into(stats))
+		{}
+
+		~upload_stats_scope_t(void)
+		{
+			backend.count_into(saved);
+		}
+
+		upload_stats_scope_t(const upload_stats_scope_t&) = delete;
+		upload_stats_scope_t& operator=(const upload_stats_scope_t&) = delete;
+	};
+
+#ifndef GL_ATLAS_NO_GL
+	class gl_backend_t: public atlas_backend_t
+	{
+		gl_state_cache_t state;
+
+		GLenum bound_target;
+
+		// GL_UNPACK_ALIGNMENT to restore once the layer's done, 0 if it
+		// wasn't changed.
+		GLint saved_alignment;
+
+		static GLenum target(bool array)
+		{
+#ifdef GL_ATLAS_TEXTURE_ARRAYS
+			if (array)
+				return GL_TEXTURE_2D_ARRAY;
+#else
+			(void) array;
+#endif
+			return GL_TEXTURE_2D;
+		}
+
+		void bind_target(GLenum t, GLuint handle)
+		{
+			state.bind_texture(t, handle);
+			bound_target = t;
+		}
+
+		static void set_tex_params(GLenum t, bool mipmapped,
+			atlas_pixel_format_t format)
+		{
+			GL_H( glTexParameteri(t, GL_TEXTURE_MIN_FILTER,
+				mipmapped ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR) );
+			GL_H( glTexParameteri(t, GL_TEXTURE_MAG_FILTER, GL_LINEAR) );
+			GL_H( glTexParameteri(t, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE) );
+			GL_H( glTexParameteri(t, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE) );
+
+#ifdef GL_ATLAS_GLEW
+			if (format == ATLAS_PIXEL_L8 || format == ATLAS_PIXEL_LA8) {
+				GLint swizzle[4] = {
+					GL_RED, GL_RED, GL_RED,
+					format == ATLAS_PIXEL_LA8 ? GL_GREEN : GL_ONE
+				};
+
+				GL_H( glTexParameteriv(t, GL_TEXTURE_SWIZZLE_RGBA, swizzle) );
+			}
+#else
+			(void) format;
+#endif
+		}
+
+	public:
+		gl_backend_t(void)
+			:	bound_target(GL_TEXTURE_2D),
+				saved_alignment(0)
+		{}
+
+		// The state cache counts into the same stats.
+		atlas_upload_stats_t* count_into(atlas_upload_stats_t* into) override
+		{
+			state.counts = into;
+			return atlas_backend_t::count_into(into);
+		}
+
+#ifdef GL_ATLAS_GLEW
+		gl_state_cache_t* gl_state(void) override
+		{
+			return &state;
+		}
+#endif
+
+		// Call after binding textures or unpack buffers, or changing
+		// GL_UNPACK_ALIGNMENT, other than through this backend.
+		void invalidate_state(void)
+		{
+			state.invalidate();
+		}
+
+		GLint max_layer_size(void) override
+		{
+			return state.max_texture_size();
+		}
+
+		bool supports_format(atlas_pixel_format_t format) override
+		{
+			switch (format) {
+			case ATLAS_PIXEL_ETC1:
+#ifdef GL_ATLAS_GLEW
+				return gl_has_extension("GL_ARB_ES3_compatibility");
+#elif defined(GL_ATLAS_GLES3)
+				return true; // ETC2 is core
+#else
+				return gl_has_extension("GL_OES_compressed_ETC1_RGB8_texture");
+#endif
+			case ATLAS_PIXEL_BC1:
+			case ATLAS_PIXEL_BC3:
+				return gl_has_extension("GL_EXT_texture_compression_s3tc");
+			default:
+				return true;
+			}
+		}
+
+		bool supports_arrays(void) const override
+		{
+#ifdef GL_ATLAS_TEXTURE_ARRAYS
+			return true;
+#else
+			return false;
+#endif
+		}
+
+#ifdef GL_ATLAS_TEXTURE_ARRAYS
+		GLint max_array_layers(void) override
+		{
+			GLint max_layers = 0;
+			GL_H( glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &max_layers) );
+			return max_layers;
+		}
+#endif
+
+		bool streams_uploads(void) const override
+		{
+			return true;
+		}
+
+		GLuint create_layer(uint16_t width, uint16_t height,
+			atlas_pixel_format_t format, const void* pixels,
+			bool mipmapped) override
+		{
+			GLuint handle;
+			GL_H( glGenTextures(1, &handle) );
+
+			bind_target(GL_TEXTURE_2D, handle);
+			set_tex_params(GL_TEXTURE_2D, mipmapped, format);
+
+			alloc_layer_texture(width, height, format, pixels, 0, -1, state,
+				stats());
+
+			return handle;
+		}
+
+		GLuint create_array(uint16_t width, uint16_t height, size_t count,
+			atlas_pixel_format_t format, GLint levels) override
+		{
+#ifdef GL_ATLAS_TEXTURE_ARRAYS
+			GLuint handle;
+			GL_H( glGenTextures(1, &handle) );
+
+			bind_target(GL_TEXTURE_2D_ARRAY, handle);
+			set_tex_params(GL_TEXTURE_2D_ARRAY, levels > 1, format);
+
+			GLint internal_format;
+			GLenum pixel_format, type;
+			layer_tex_formats(format, internal_format, pixel_format, type);
+
+			size_t w = width, h = height;
+
+			for (GLint level = 0; level < levels; ++level) {
+				if (pixel_format_compressed(format)) {
+					GL_H( glCompressedTexImage3D(GL_TEXTURE_2D_ARRAY,
+						level, (GLenum) internal_format, (GLsizei) w,
+						(GLsizei) h, (GLsizei) count, 0,
+						(GLsizei) (layer_data_bytes(format, w, h) * count),
+						nullptr) );
+				} else {
+					GL_H( glTexImage3D(GL_TEXTURE_2D_ARRAY, level,
+						internal_format, (GLsizei) w, (GLsizei) h,
+						(GLsizei) count, 0, pixel_format, type, nullptr) );
+				}
+
+				stats().tex_image_calls++;
+
+				w = std::max(w / 2, (size_t) 1);
+				h = std::max(h / 2, (size_t) 1);
+			}
+
+			return handle;
+#else
+			(void) width; (void) height; (void) count; (void) format;
+			(void) levels;
+
+			assert(false && "texture arrays need GLEW or GL_ATLAS_GLES3");
+			return 0;
+#endif
+		}
+
+		void write_level(GLuint handle, GLint slice, GLint level,
+			size_t width, size_t height, atlas_pixel_format_t format,
+			const void* pixels) override
+		{
+			bind_target(target(slice >= 0), handle);
+			alloc_layer_texture(width, height, format, pixels, level, slice,
+				state, stats());
+		}
+
+		void write_rect(GLuint handle, GLint slice, GLint x, GLint y,
+			GLsizei width, GLsizei height, atlas_pixel_format_t format,
+			const void* pixels) override
+		{
+			GLint internal_format;
+			GLenum pixel_format, type;
+			layer_tex_formats(format, internal_format, pixel_format, type);
+
+			bind_target(target(slice >= 0), handle);
+
+			if (slice >= 0) {
+#ifdef GL_ATLAS_TEXTURE_ARRAYS
+				GL_H( glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, x, y, slice,
+					width, height, 1, pixel_format, type, pixels) );
+#endif
+			} else {
+				GL_H( glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, width, height,
+					pixel_format, type, pixels) );
+			}
+
+			stats().tex_sub_image_calls++;
+			stats().bytes += (size_t) width * height
+				* pixel_format_bytes(format);
+		}
+
+		// glClearTexSubImage where there is one, which needs no pixels at
+		// all, so no upload.
+		void clear_rect(GLuint handle, GLint slice, GLint x, GLint y,
+			GLsizei width, GLsizei height, atlas_pixel_format_t format) override
+		{
+#ifdef GL_ATLAS_GLEW
+			if (GLEW_VERSION_4_4 || GLEW_ARB_clear_texture) {
+				GLint internal_format;
+				GLenum pixel_format, type;
+				layer_tex_formats(format, internal_format, pixel_format, type);
+
+				GL_H( glClearTexSubImage(handle, 0, x, y, std::max(slice, 0),
+					width, height, 1, pixel_format, type, nullptr) );
+
+				stats().tex_sub_image_calls++;
+				return;
+			}
+#endif
+
+			atlas_backend_t::clear_rect(handle, slice, x, y, width, height,
+				format);
+		}
+
+		// Deleting unbinds whatever's bound, which the state cache keeps
+		// track of, so nothing needs querying or unbinding first.
+		void delete_layers(size_t count, const GLuint* handles) override
+		{
+			state.delete_textures(count, handles);
+		}
+
+		// Rows of anything narrower than RGBA are tightly packed, so they
+		// only start on a 4 byte boundary by chance.
+		void begin_layer(atlas_pixel_format_t format) override
+		{
+			if (pixel_format_bytes(format) != 4) {
+				saved_alignment = state.get_unpack_alignment();
+				state.set_unpack_alignment(1);
+			}
+		}
+
+		void end_layer(void) override
+		{
+			if (saved_alignment) {
+				state.set_unpack_alignment(saved_alignment);
+				saved_alignment = 0;
+			}
+
+			bind_target(bound_target, 0);
+		}
+
+		void bind(GLuint handle, bool array, GLint unit) override
+		{
+			if (unit >= 0)
+				state.active_texture((GLuint) unit);
+
+			state.bind_texture(target(array), handle);
+		}
+	};
+#endif
+
+	// Takes every call and does nothing but count it in the upload stats, as
+	// a GL context without glClearTexSubImage would: gap clears count as
+	// uploads of zeros. Handles are just numbered, and every format and
+	// arrays are supported.
+	class null_backend_t: public atlas_backend_t
+	{
+		GLint max_size;
+		GLint max_slices;
+		GLuint next_handle;
+
+	public:
+		explicit null_backend_t(GLint max_layer_size,
+			GLint max_array_layers = 2048)
+			:	max_size(max_layer_size),
+				max_slices(max_array_layers),
+				next_handle(1)
+		{}
+
+		GLint max_layer_size(void) override
+		{
+			return max_size;
+		}
+
+		GLint max_array_layers(void) override
+		{
+			return max_slices;
+		}
+
+		bool supports_format(atlas_pixel_format_t format) override
+		{
+			(void) format;
+			return true;
+		}
+
+		bool supports_arrays(void) const override
+		{
+			return true;
+		}
+
+		GLuint create_layer(uint16_t width, uint16_t height,
+			atlas_pixel_format_t format, const void* pixels,
+			bool mipmapped) override
+		{
+			(void) mipmapped;
+
+			stats().layers++;
+			stats().tex_image_calls++;
+
+			if (pixels)
+				stats().bytes +=
+					layer_data_bytes(format, width, height);
+
+			return next_handle++;
+		}
+
+		GLuint create_array(uint16_t width, uint16_t height, size_t count,
+			atlas_pixel_format_t format, GLint levels) override
+		{
+			(void) width; (void) height; (void) count; (void) format;
+
+			stats().tex_image_calls += levels;
+
+			return next_handle++;
+		}
+
+		void write_level(GLuint handle, GLint slice, GLint level,
+			size_t width, size_t height, atlas_pixel_format_t format,
+			const void* pixels) override
+		{
+			(void) handle;
+
+			if (level == 0)
+				stats().layers++;
+
+			// Like glTexSubImage3D, an array slice needs no call to stay
+			// undefined.
+			if (slice >= 0 && !pixels)
+				return;
+
+			if (slice >= 0)
+				stats().tex_sub_image_calls++;
+			else
+				stats().tex_image_calls++;
+
+			if (pixels)
+				stats().bytes +=
+					layer_data_bytes(format, width, height);
+		}
+
+		void write_rect(GLuint handle, GLint slice, GLint x, GLint y,
+			GLsizei width, GLsizei height, atlas_pixel_format_t format,
+			const void* pixels) override
+		{
+			(void) handle; (void) slice; (void) x; (void) y; (void) pixels;
+
+			stats().tex_sub_image_calls++;
+			stats().bytes += (size_t) width * height
+				* pixel_format_bytes(format);
+		}
+
+		void delete_layers(size_t count, const GLuint* handles) override
+		{
+			(void) count;
+			(void) handles;
+		}
+	};
+
+	// Keeps every layer in memory, each level of each slice laid out as a GPU
+	// would hold it: tightly packed rows, or blocks for the block compressed
+	// formats. Anything left undefined reads as zeros.
+	class cpu_backend_t: public null_backend_t
+	{
+		struct texture_t {
+			uint16_t width;
+			uint16_t height;
+			atlas_pixel_format_t format;
+
+			std::vector<std::vector<std::vector<uint8_t>>> slices; // of levels
+		};
+
+		std::unordered_map<GLuint, texture_t> textures;
+
+		static std::vector<uint8_t>& level_data(texture_t& t, GLint slice,
+			GLint level)
+		{
+			std::vector<std::vector<uint8_t>>& levels =
+				t.slices.at(slice < 0 ? 0 : (size_t) slice);
+
+			if (levels.size() <= (size_t) level)
+				levels.resize(level + 1);
+
+			size_t w = std::max(t.width >> level, 1);
+			size_t h = std::max(t.height >> level, 1);
+
+			levels[level].resize(layer_data_bytes(t.format, w, h));
+			return levels[level];
+		}
+
+	public:
+		explicit cpu_backend_t(GLint max_layer_size,
+			GLint max_array_layers = 2048)
+			:	null_backend_t(max_layer_size, max_array_layers)
+		{}
+
+		GLuint create_layer(uint16_t width, uint16_t height,
+			atlas_pixel_format_t format, const void* pixels,
+			bool mipmapped) override
+		{
+			GLuint handle = null_backend_t::create_layer(width, height,
+				format, pixels, mipmapped);
+
+			texture_t& t = textures[handle];
+			t.width = width;
+			t.height = height;
+			t.format = format;
+			t.slices.resize(1);
+
+			std::vector<uint8_t>& data = level_data(t, -1, 0);
+
+			if (pixels)
+				memcpy(&data[0], pixels, data.size());
+
+			return handle;
+		}
+
+		GLuint create_array(uint16_t width, uint16_t height, size_t count,
+			atlas_pixel_format_t format, GLint levels) override
+		{
+			GLuint handle = null_backend_t::create_array(width, height,
+				count, format, levels);
+
+			texture_t& t = textures[handle];
+			t.width = width;
+			t.height = height;
+			t.format = format;
+			t.slices.resize(count);
+
+			for (size_t slice = 0; slice < count; ++slice) {
+				for (GLint level = 0; level < levels; ++level)
+					level_data(t, (GLint) slice, level);
+			}
+
+			return handle;
+		}
+
+		void write_level(GLuint handle, GLint slice, GLint level,
+			size_t width, size_t height, atlas_pixel_format_t format,
+			const void* pixels) override
+		{
+			null_backend_t::write_level(handle, slice, level, width, height,
+				format, pixels);
+
+			std::vector<uint8_t>& data = level_data(textures.at(handle),
+				slice, level);
+
+			assert(data.size() == layer_data_bytes(format, width, height));
+
+			if (pixels)
+				memcpy(&data[0], pixels, data.size());
+			else if (slice < 0)
+				std::fill(data.begin(), data.end(), 0);
+		}
+
+		void write_rect(GLuint handle, GLint slice, GLint x, GLint y,
+			GLsizei width, GLsizei height, atlas_pixel_format_t format,
+			const void* pixels) override
+		{
+			null_backend_t::write_rect(handle, slice, x, y, width, height,
+				format, pixels);
+
+			texture_t& t = textures.at(handle);
+			std::vector<uint8_t>& data = level_data(t, slice, 0);
+
+			size_t bpp = pixel_format_bytes(format);
+			size_t pitch = (size_t) t.width * bpp;
+			size_t row_bytes = (size_t) width * bpp;
+
+			for (GLsizei y1 = 0; y1 < height; ++y1)
+				memcpy(&data[(y + y1) * pitch + x * bpp],
+					(const uint8_t*) pixels + y1 * row_bytes, row_bytes);
+		}
+
+		void delete_layers(size_t count, const GLuint* handles) override
+		{
+			for (size_t i = 0; i < count; ++i)
+				textures.erase(handles[i]);
+		}
+
+		// A level of a layer, of its own texture with a slice of -1, or
+		// null for a handle that isn't one of this backend's.
+		const std::vector<uint8_t>* layer_level(GLuint handle, GLint slice,
+			GLint level) const
+		{
+			auto it = textures.find(handle);
+
+			if (it == textures.end())
+				return nullptr;
+
+			size_t s = slice < 0 ? 0 : (size_t) slice;
+			const texture_t& t = it->second;
+
+			if (s >= t.slices.size() || (size_t) level >= t.slices[s].size())
+				return nullptr;
+
+			return &t.slices[s][level];
+		}
+	};
+
+	// What atlases and builds use unless told otherwise: the GL context's,
+	// or none with GL_ATLAS_NO_GL, where atlas_build_opts_t::backend has to
+	// be set. Unlike the rest of the header this has external linkage, so
+	// every translation unit gets the same backend, and so the same shadow
+	// of the context's state. That's only right for a single context; give
+	// any other its own gl_backend_t.
+	ga_inline atlas_backend_t* default_atlas_backend(void)
+	{
+#ifdef GL_ATLAS_NO_GL
+		return nullptr;
+#else
+		static gl_backend_t backend;
+		return &backend;
+#endif
+	}
+	using image_fill_map_t = std::unordered_map<uint16_t, uint8_t>;
+
+	// The extent of the cell an image of size dim claims in its layer: the
+	// image, its gutter on both sides, rounded up to a multiple of align.
+	static ga_inline uint16_t atlas_cell_extent(uint16_t dim, uint16_t gutter,
+		uint8_t align)
+	{
+		return (uint16_t) ((dim + 2 * gutter + align - 1) / align * align);
+	}
+
+	struct atlas_rect_t {
+		uint16_t x;
+		uint16_t y;
+		uint16_t w;
+		uint16_t h;
+	};
+
+	struct atlas_image_info_t {
+		uint8_t 	layer;
+		glm::vec2 	coords;
+		glm::vec2 	inverse_layer_dims;
+		int16_t 	slice;	// in the texture array, -1 without one
+	};
+
+	struct atlas_t {
+		uint32_t num_images;
+
+		uint32_t area_accum;
+
+		std::vector<uint8_t> layers;
+
+		std::vector<uint16_t> widths;
+		std::vector<uint16_t> heights;
+		std::vector<atlas_pixel_format_t> layer_formats;
+
+		std::vector<uint16_t> dims_x;
+		std::vector<uint16_t> dims_y;
+		std::vector<atlas_pixel_format_t> formats;	// of the pixels in buffer_table
+
+		std::vector<uint16_t> coords_x;
+		std::vector<uint16_t> coords_y;
+
+		// Where the layers live, see atlas_backend_t. Set by the build from
+		// atlas_build_opts_t::backend.
+		atlas_backend_t* backend;
+
+		std::vector<GLuint> layer_tex_handles;
+
+		// Non-zero when the layers are the slices of one array texture, see
+		// atlas_build_opts_t::texture_array. Every layer's handle is then
+		// this one.
+		GLuint array_tex_handle;
+
+		// Texels of edge-extruded padding around every image, see
+		// atlas_build_opts_t::gutter.
+		uint16_t gutter;
+
+		// Every image's cell starts on a multiple of this, and any slack
+		// at its right and bottom is extruded like the gutter. 4 for block
+		// compressed layers, so no block straddles two images.
+		uint8_t cell_align;
+
+		std::vector<std::vector<uint8_t>> buffer_table;
+
+		// Per layer, the rects changed in buffer_table since they were last
+		// uploaded, in layer texels; see mark_dirty.
+		std::vector<std::vector<atlas_rect_t>> dirty_rects;
+
+		std::vector<std::string> filenames; // optional
+
+		std::unordered_map<size_t, uint16_t> key_map;	// optional
+
+		uint16_t origin_x(uint16_t image) const
+		{
+			return coords_x[image];
+		}
+
+		uint16_t origin_y(uint16_t image) const
+		{
+			return coords_y[image];
+		}
+
+		// The rect an image claims in its layer, see cell_align.
+		uint16_t cell_x(uint16_t image) const
+		{
+			return coords_x[image] - gutter;
+		}
+
+		uint16_t cell_y(uint16_t image) const
+		{
+			return coords_y[image] - gutter;
+		}
+
+		uint16_t cell_width(uint16_t image) const
+		{
+			return atlas_cell_extent(dims_x[image], gutter, cell_align);
+		}
+
+		uint16_t cell_height(uint16_t image) const
+		{
+			return atlas_cell_extent(dims_y[image], gutter, cell_align);
+		}
+
+		uint8_t image_channels(uint16_t image) const
+		{
+			return pixel_format_channels(formats[image]);
+		}
+
+		uint8_t layer(uint16_t image) const
+		{
+			assert(image < layers.size());
+			assert(layers[image] != 0xFF);
+			return layers[image];
+		}
+
+		atlas_image_info_t image_info(uint16_t image) const
+		{
+			uint8_t L = layer(image);
+
+			atlas_image_info_t img {
+				L,
+				glm::vec2(origin_x(image), origin_y(image)),
+				glm::vec2(
+					1.0f / static_cast<float>(widths[L]),
+					1.0f / static_cast<float>(heights[L])
+				),
+				static_cast<int16_t>(array_tex_handle ? L : -1)
+			};
+
+			return img;
+		}
+
+#ifndef GL_ATLAS_NO_GL
+		GLenum target(void) const
+		{
+#ifdef GL_ATLAS_TEXTURE_ARRAYS
+			if (array_tex_handle)
+				return GL_TEXTURE_2D_ARRAY;
+#endif
+			return GL_TEXTURE_2D;
+		}
+#endif
+
+		// Where a layer's writes go: -1 for its own texture, else its
+		// slice of the array.
+		GLint slice(uint8_t layer) const
+		{
+			return array_tex_handle ? (GLint) layer : -1;
+		}
+
+		// Makes the layers pushed from here on the slices of one array
+		// texture, allocated for count of them with levels mip levels.
+		// They all have to share width, height and format.
+		void alloc_texture_array(uint16_t width, uint16_t height,
+			size_t count, atlas_pixel_format_t format, GLint levels)
+		{
+			assert(layer_tex_handles.empty() && !array_tex_handle);
+
+			array_tex_handle = backend->create_array(width, height, count,
+				format, levels);
+		}
+
+		// pixels is either null, leaving the layer undefined, or a full
+		// layer's worth of tightly packed rows. A mipmapped layer still
+		// needs every level below 0 written to be complete.
+		//
+		// With a texture array this fills the next slice instead, see
+		// alloc_texture_array; mipmapped is then up to the array.
+		void push_layer(uint16_t width, uint16_t height,
+			atlas_pixel_format_t format = ATLAS_PIXEL_RGBA8,
+			const void* pixels = nullptr, bool mipmapped = false)
+		{
+			size_t index = layer_tex_handles.size();
+			GLuint handle = array_tex_handle;
+
+			if (handle) {
+				assert(index == 0 || (width == widths[0]
+					&& height == heights[0] && format == layer_formats[0]));
+
+				backend->write_level(handle, (GLint) index, 0, width, height,
+					format, pixels);
+			} else {
+				handle = backend->create_layer(width, height, format, pixels,
+					mipmapped);
+			}
+
+			layer_tex_handles.push_back(handle);
+			widths.push_back(width);
+			heights.push_back(height);
+			layer_formats.push_back(format);
+		}
+
+		// Writes level (below 0) of a pushed layer; see push_layer.
+		void write_level(uint8_t layer, GLint level, size_t width,
+			size_t height, atlas_pixel_format_t format, const void* pixels)
+		{
+			backend->write_level(layer_tex_handles[layer], slice(layer),
+				level, width, height, format, pixels);
+		}
+
+		void set_layer(uint16_t image, uint8_t layer)
+		{
+			if (layers.size() != num_images)
+				layers.resize(num_images, 0xFF);
+
+			layers[image] = layer;
+		}
+
+		// With a texture array, binding any layer binds all of them.
+		void bind(uint8_t layer) const
+		{
+			backend->bind(layer_tex_handles[layer], array_tex_handle != 0, -1);
+		}
+
+		void bind_to_active_slot(uint8_t layer, int offset) const
+		{
+			backend->bind(layer_tex_handles[layer], array_tex_handle != 0,
+				offset);
+		}
+
+		void release(void) const
+		{
+			backend->bind(0, array_tex_handle != 0, -1);
+		}
+
+		void release_from_active_slot(int offset) const
+		{
+			backend->bind(0, array_tex_handle != 0, offset);
+		}
+
+		void write_origins(uint16_t image, uint16_t x, uint16_t y)
+		{
+			if (coords_x.size() != num_images)
+				coords_x.resize(num_images, 0);
+
+			coords_x[image] = x;
+
+			if (coords_y.size() != num_images)
+				coords_y.resize(num_images, 0);
+
+			coords_y[image] = y;
+		}
+
+		// Anything but RGBA needs GL_UNPACK_ALIGNMENT 1, see upload_atlas_layer.
+		void fill_atlas_image(size_t image)
+		{
+			fill_atlas_image_from(image, &buffer_table[image][0]);
+		}
+
+		// Same, with the image's pixels taken from source instead, which is
+		// an offset rather than a pointer while an unpack buffer is bound.
+		void fill_atlas_image_from(size_t image, const void* source)
+		{
+			write_rect(layer(image), origin_x(image), origin_y(image),
+				dims_x[image], dims_y[image], formats[image], source);
+		}
+
+		// Tightly packed rows into level 0 of a layer.
+		void write_rect(uint8_t layer, GLint x, GLint y, GLsizei width,
+			GLsizei height, atlas_pixel_format_t format,
+			const void* pixels) const
+		{
+			backend->write_rect(layer_tex_handles[layer], slice(layer), x, y,
+				width, height, format, pixels);
+		}
+
+		// Adds r to a layer's dirty rects. Any it overlaps or touches are
+		// merged into it, as long as their bounding box costs no more
+		// texels than the two would apart, so one write covers them.
+		void mark_dirty(uint8_t layer, atlas_rect_t r)
+		{
+			if (!r.w || !r.h)
+				return;
+
+			if (dirty_rects.size() <= layer)
+				dirty_rects.resize(layer + 1);
+
+			std::vector<atlas_rect_t>& rects = dirty_rects[layer];
+
+			for (size_t i = 0; i < rects.size();) {
+				const atlas_rect_t& a = rects[i];
+
+				uint16_t x0 = std::min(a.x, r.x), y0 = std::min(a.y, r.y);
+				uint16_t x1 = std::max(a.x + a.w, r.x + r.w);
+				uint16_t y1 = std::max(a.y + a.h, r.y + r.h);
+
+				bool touches = a.x <= r.x + r.w && r.x <= a.x + a.w
+					&& a.y <= r.y + r.h && r.y <= a.y + a.h;
+
+				uint32_t apart = (uint32_t) a.w * a.h + (uint32_t) r.w * r.h;
+
+				if (!touches || (uint32_t) (x1 - x0) * (y1 - y0) > apart) {
+					++i;
+					continue;
+				}
+
+				r = atlas_rect_t { x0, y0, (uint16_t) (x1 - x0),
+					(uint16_t) (y1 - y0) };
+
+				rects[i] = rects.back();
+				rects.pop_back();
+
+				// The grown rect may now reach ones already passed over.
+				i = 0;
+			}
+
+			rects.push_back(r);
+		}
+
+		// Zeroes a rect of level 0 of a layer.
+		void clear_rect(uint8_t layer, GLint x, GLint y, GLsizei width,
+			GLsizei height) const
+		{
+			backend->clear_rect(layer_tex_handles[layer], slice(layer), x, y,
+				width, height, layer_formats[layer]);
+		}
+
+		uint16_t key_image(size_t key) const
+		{
+			return key_map.at(key);
+		}
+
+		void map_key_to_image(size_t key, uint16_t image)
+		{
+			key_map[key] = image;
+		}
+
+		void free_memory(void)
+		{
+			// Every layer of an array shares the one handle, so it's
+			// deleted just once.
+			if (array_tex_handle) {
+				backend->delete_layers(1, &array_tex_handle);
+
+				array_tex_handle = 0;
+				layer_tex_handles.clear();
+			}
+
+			if (!layer_tex_handles.empty()) {
+				backend->delete_layers(layer_tex_handles.size(),
+					&layer_tex_handles[0]);
+			}
+
+			num_images = 0;
+			area_accum = 0;
+			gutter = 0;
+			cell_align = 1;
+
+			widths.clear();
+			heights.clear();
+			layer_formats.clear();
+			dims_x.clear();
+			dims_y.clear();
+			formats.clear();
+			coords_x.clear();
+			coords_y.clear();
+			buffer_table.clear();
+			dirty_rects.clear();
+			filenames.clear();
+
+			layers.clear();
+			layer_tex_handles.clear();
+		}
+
+		void swap(atlas_t& other)
+		{
+			std::swap(num_images, other.num_images);
+			std::swap(area_accum, other.area_accum);
+			std::swap(gutter, other.gutter);
+			std::swap(cell_align, other.cell_align);
+			std::swap(array_tex_handle, other.array_tex_handle);
+			std::swap(backend, other.backend);
+
+			layers.swap(other.layers);
+			widths.swap(other.widths);
+			heights.swap(other.heights);
+			layer_formats.swap(other.layer_formats);
+			dims_x.swap(other.dims_x);
+			dims_y.swap(other.dims_y);
+			formats.swap(other.formats);
+			coords_x.swap(other.coords_x);
+			coords_y.swap(other.coords_y);
+			layer_tex_handles.swap(other.layer_tex_handles);
+			buffer_table.swap(other.buffer_table);
+			dirty_rects.swap(other.dirty_rects);
+			filenames.swap(other.filenames);
+			key_map.swap(other.key_map);
+		}
+
+		~atlas_t(void)
+		{
+			free_memory();
+		}
+
+		atlas_t(void)
+			: 	num_images(0),
+				area_accum(0),
+				backend(default_atlas_backend()),
+				array_tex_handle(0),
+				gutter(0),
+				cell_align(1)
+		{}
+	};
+
+	//------------------------------------------------------------------------------------
+	// atlas_command_list_t
+	//
+	// A backend that records the calls a build makes instead of making them, so
+	// the whole build - decoding, packing and the uploads - can run on any
+	// thread, with no GL context there at all. The GL thread then replays the
+	// list onto the backend it was made for, either in one go or a byte budget
+	// at a time across frames.
+	//
+	// Pixels are copied into one buffer as they're recorded. When a layer
+	// ends, any two of its rects which line up along a whole edge are merged,
+	// again and again until none do, so replay makes one sub-image write per
+	// block of adjacent rects rather than one per image or gap. A cleared gap
+	// merged into written rects is written as zeros, which trades the clear
+	// for more bytes.
+	//
+	// The target's limits are asked for up front, so the list has to be made
+	// on the GL thread. Until replay finishes, the atlas's handles are the
+	// list's own and binding it binds nothing; the list must outlive the
+	// atlas until then. Each list records a single build.
+	//------------------------------------------------------------------------------------
+
+	class atlas_command_list_t: public atlas_backend_t
+	{
+		enum command_kind_t : uint8_t {
+			COMMAND_CREATE_LAYER = 0,
+			COMMAND_CREATE_ARRAY,
+			COMMAND_WRITE_LEVEL,
+			COMMAND_WRITE_RECT,
+			COMMAND_CLEAR_RECT,
+			COMMAND_DELETE_LAYERS,
+			COMMAND_BEGIN_LAYER,
+			COMMAND_END_LAYER
+		};
+
+		struct command_t {
+			command_kind_t kind;
+			atlas_pixel_format_t format;
+			bool mipmapped;
+
+			GLuint handle;		// the list's own, 0 for none
+			GLint slice;
+			GLint level;		// levels of each slice for COMMAND_CREATE_ARRAY
+
+			GLint x;
+			GLint y;
+			uint32_t width;
+			uint32_t height;
+
+			size_t count;		// slices or deleted handles
+
+			size_t offset;		// of pixels or deleted handles in data
+			size_t bytes;		// 0 for no pixels
+		};
+
+		atlas_backend_t& target;
+
+		GLint max_size;
+		bool arrays;
+		GLint max_slices;
+		bool block_formats[3];	// ETC1, BC1, BC3
+
+		GLuint next_handle;
+
+		std::vector<command_t> commands;
+		std::vector<uint8_t> data;
+
+		// Where replay has got to, and the target's handle for each of the
+		// list's.
+		size_t next;
+		std::vector<GLuint> handles;
+
+		// A layer replay paused inside of, to resume after re-beginning it.
+		bool layer_open;
+		atlas_pixel_format_t layer_format;
+
+		// The command the layer being recorded begins with.
+		size_t layer_first;
+
+		command_t& push(command_kind_t kind, atlas_pixel_format_t format)
+		{
+			command_t c;
+			memset(&c, 0, sizeof(c));
+
+			c.kind = kind;
+			c.format = format;
+			c.slice = -1;
+			c.offset = data.size();
+
+			commands.push_back(c);
+			return commands.back();
+		}
+
+		void append(command_t& c, const void* pixels, size_t bytes)
+		{
+			if (!pixels)
+				return;
+
+			const uint8_t* p = (const uint8_t*) pixels;
+			data.insert(data.end(), p, p + bytes);
+			c.bytes += bytes;
+		}
+
+		const void* pixels(const command_t& c) const
+		{
+			return c.bytes ? &data[c.offset] : nullptr;
+		}
+
+		GLuint mapped(GLuint handle) const
+		{
+			return handle ? handles.at(handle - 1) : 0;
+		}
+
+		// Merges the rects written or cleared since commands[first] wherever
+		// two of them exactly tile their bounding box, until no two do. A
+		// cleared rect merged with written ones is written as zeros; only
+		// clears merged together stay a clear. A layer's rects don't
+		// overlap, so a merged one can be written where any of its pieces
+		// was. Pixels are only copied once, into the merged rects, after all
+		// the merging.
+		void merge_layer_rects(size_t first)
+		{
+			struct extent_t {
+				GLint x;
+				GLint y;
+				uint32_t width;
+				uint32_t height;
+			};
+
+			size_t count = commands.size() - first;
+
+			// Per command from first on: the one its rect was merged into,
+			// itself if none, or SIZE_MAX for anything but a rect; and the
+			// extent of what's been merged into it.
+			std::vector<size_t> parent(count, SIZE_MAX);
+			std::vector<extent_t> extents(count);
+			std::vector<size_t> rects, blocks;
+
+			for (size_t i = first; i < commands.size(); ++i) {
+				const command_t& c = commands[i];
+
+				bool rect = (c.kind == COMMAND_WRITE_RECT && c.bytes)
+					|| c.kind == COMMAND_CLEAR_RECT;
+
+				if (!rect || pixel_format_compressed(c.format))
+					continue;
+
+				parent[i - first] = i;
+				extents[i - first] = extent_t { c.x, c.y, c.width, c.height };
+				rects.push_back(i);
+			}
+
+			if (rects.size() < 2)
+				return;
+
+			auto root = [&](size_t i) -> size_t {
+				while (parent[i - first] != i)
+					i = parent[i - first] = parent[parent[i - first] - first];
+
+				return i;
+			};
+
+			// Sorted so that rects of the same column (or row) follow each
+			// other top to bottom (or left to right), one pass merges each
+			// run of them that touch.
+			auto merge_pass = [&](bool vertical) -> bool {
+				// The column (or row) a rect is in, and where in it.
+				auto line = [&](size_t i) {
+					const command_t& c = commands[i];
+					const extent_t& e = extents[i - first];
+
+					return std::make_tuple(c.handle, c.slice, c.format,
+						vertical ? e.x : e.y, vertical ? e.width : e.height);
+				};
+
+				auto start = [&](size_t i) -> GLint {
+					return vertical ? extents[i - first].y : extents[i - first].x;
+				};
+
+				std::sort(blocks.begin(), blocks.end(), [&](size_t a, size_t b) {
+					return line(a) < line(b)
+						|| (line(a) == line(b) && start(a) < start(b));
+				});
+
+				size_t kept = 0;
+
+				for (size_t b: blocks) {
+					if (kept) {
+						size_t a = blocks[kept - 1];
+						extent_t& ea = extents[a - first];
+						const extent_t& eb = extents[b - first];
+
+						GLint end = start(a) + (GLint) (vertical ? ea.height
+							: ea.width);
+
+						if (line(a) == line(b) && end == start(b)) {
+							if (vertical)
+								ea.height += eb.height;
+							else
+								ea.width += eb.width;
+
+							parent[b - first] = a;
+							continue;
+						}
+					}
+
+					blocks[kept++] = b;
+				}
+
+				bool merged = kept < blocks.size();
+				blocks.resize(kept);
+
+				return merged;
+			};
+
+			blocks = rects;
+
+			bool merged = false;
+
+			// Both passes every time round, as either can line rects up
+			// for the other.
+			while (merge_pass(true) | merge_pass(false))
+				merged = true;
+
+			if (!merged)
+				return;
+
+			std::vector<std::vector<size_t>> pieces(count);
+
+			for (size_t i: rects)
+				pieces[root(i) - first].push_back(i);
+
+			// Rebuilds the layer's commands and the tail of the data they
+			// point into.
+			std::vector<command_t> merged_commands;
+			std::vector<uint8_t> tail;
+			size_t base = commands[first].offset;
+
+			for (size_t i = first; i < commands.size(); ++i) {
+				command_t c = commands[i];
+				const std::vector<size_t>& parts = pieces[i - first];
+
+				if (parent[i - first] != SIZE_MAX && parts.empty())
+					continue; // merged into another
+
+				c.offset = base + tail.size();
+
+				if (parts.size() > 1) {
+					const extent_t& e = extents[i - first];
+					size_t bpp = pixel_format_bytes(c.format);
+					size_t row_bytes = e.width * bpp;
+					size_t at = tail.size();
+
+					c.x = e.x;
+					c.y = e.y;
+					c.width = e.width;
+					c.height = e.height;
+
+					bool writes = false;
+
+					for (size_t part: parts)
+						writes = writes || commands[part].bytes;
+
+					if (!writes) {
+						merged_commands.push_back(c);
+						continue;
+					}
+
+					c.kind = COMMAND_WRITE_RECT;
+					c.bytes = row_bytes * e.height;
+
+					// Zeros wherever a cleared piece is.
+					tail.resize(at + c.bytes, 0);
+
+					for (size_t part: parts) {
+						const command_t& p = commands[part];
+						size_t part_row_bytes = p.width * bpp;
+
+						if (!p.bytes)
+							continue;
+
+						for (uint32_t y = 0; y < p.height; ++y) {
+							memcpy(&tail[at + (p.y - e.y + y) * row_bytes
+								+ (p.x - e.x) * bpp],
+								&data[p.offset + y * part_row_bytes],
+								part_row_bytes);
+						}
+					}
+				} else {
+					// Pixels, or the handles a delete carries.
+					size_t end = i + 1 < commands.size()
+						? commands[i + 1].offset : data.size();
+
+					tail.insert(tail.end(), data.begin() + commands[i].offset,
+						data.begin() + end);
+				}
+
+				merged_commands.push_back(c);
+			}
+
+			commands.resize(first);
+			commands.insert(commands.end(), merged_commands.begin(),
+				merged_commands.end());
+
+			data.resize(base);
+			data.insert(data.end(), tail.begin(), tail.end());
+		}
+
+		void run(const command_t& c)
+		{
+			switch (c.kind) {
+			case COMMAND_CREATE_LAYER:
+				handles[c.handle - 1] = target.create_layer(
+					(uint16_t) c.width, (uint16_t) c.height, c.format,
+					pixels(c), c.mipmapped);
+				break;
+
+			case COMMAND_CREATE_ARRAY:
+				handles[c.handle - 1] = target.create_array(
+					(uint16_t) c.width, (uint16_t) c.height, c.count,
+					c.format, c.level);
+				break;
+
+			case COMMAND_WRITE_LEVEL:
+				target.write_level(mapped(c.handle), c.slice, c.level,
+					c.width, c.height, c.format, pixels(c));
+				break;
+
+			case COMMAND_WRITE_RECT:
+				target.write_rect(mapped(c.handle), c.slice, c.x, c.y,
+					(GLsizei) c.width, (GLsizei) c.height, c.format,
+					pixels(c));
+				break;
+
+			case COMMAND_CLEAR_RECT:
+				target.clear_rect(mapped(c.handle), c.slice, c.x, c.y,
+					(GLsizei) c.width, (GLsizei) c.height, c.format);
+				break;
+
+			case COMMAND_DELETE_LAYERS: {
+				std::vector<GLuint> deleted(c.count);
+				memcpy(&deleted[0], &data[c.offset], c.count * sizeof(GLuint));
+
+				for (GLuint& handle: deleted)
+					handle = mapped(handle);
+
+				target.delete_layers(c.count, &deleted[0]);
+				break;
+			}
+
+			case COMMAND_BEGIN_LAYER:
+				target.begin_layer(c.format);
+				layer_open = true;
+				layer_format = c.format;
+				break;
+
+			case COMMAND_END_LAYER:
+				target.end_layer();
+				layer_open = false;
+				break;
+			}
+		}
+
+	public:
+		explicit atlas_command_list_t(atlas_backend_t& target_backend)
+			:	target(target_backend),
+				max_size(target_backend.max_layer_size()),
+				arrays(target_backend.supports_arrays()),
+				max_slices(target_backend.max_array_layers()),
+				next_handle(1),
+				next(0),
+				layer_open(false),
+				layer_format(ATLAS_PIXEL_RGBA8),
+				layer_first(0)
+		{
+			for (int i = 0; i < 3; ++i) {
+				block_formats[i] = target.supports_format(
+					(atlas_pixel_format_t) (ATLAS_PIXEL_ETC1 + i));
+			}
+		}
+
+		GLint max_layer_size(void) override
+		{
+			return max_size;
+		}
+
+		bool supports_format(atlas_pixel_format_t format) override
+		{
+			return !pixel_format_compressed(format)
+				|| block_formats[format - ATLAS_PIXEL_ETC1];
+		}
+
+		bool supports_arrays(void) const override
+		{
+			return arrays;
+		}
+
+		GLint max_array_layers(void) override
+		{
+			return max_slices;
+		}
+
+		GLuint create_layer(uint16_t width, uint16_t height,
+			atlas_pixel_format_t format, const void* pixels,
+			bool mipmapped) override
+		{
+			command_t& c = push(COMMAND_CREATE_LAYER, format);
+			c.handle = next_handle++;
+			c.width = width;
+			c.height = height;
+			c.mipmapped = mipmapped;
+
+			append(c, pixels, layer_data_bytes(format, width, height));
+			return c.handle;
+		}
+
+		GLuint create_array(uint16_t width, uint16_t height, size_t count,
+			atlas_pixel_format_t format, GLint levels) override
+		{
+			command_t& c = push(COMMAND_CREATE_ARRAY, format);
+			c.handle = next_handle++;
+			c.width = width;
+			c.height = height;
+			c.count = count;
+			c.level = levels;
+
+			return c.handle;
+		}
+
+		void write_level(GLuint handle, GLint slice, GLint level,
+			size_t width, size_t height, atlas_pixel_format_t format,
+			const void* pixels) override
+		{
+			command_t& c = push(COMMAND_WRITE_LEVEL, format);
+			c.handle = handle;
+			c.slice = slice;
+			c.level = level;
+			c.width = (uint32_t) width;
+			c.height = (uint32_t) height;
+
+			append(c, pixels, layer_data_bytes(format, width, height));
+		}
+
+		void write_rect(GLuint handle, GLint slice, GLint x, GLint y,
+			GLsizei width, GLsizei height, atlas_pixel_format_t format,
+			const void* pixels) override
+		{
+			command_t& c = push(COMMAND_WRITE_RECT, format);
+			c.handle = handle;
+			c.slice = slice;
+			c.x = x;
+			c.y = y;
+			c.width = (uint32_t) width;
+			c.height = (uint32_t) height;
+
+			append(c, pixels, layer_data_bytes(format, width, height));
+		}
+
+		// Recorded as is, so the zeros are neither stored nor replayed
+		// through write_rect unless the target does that itself.
+		void clear_rect(GLuint handle, GLint slice, GLint x, GLint y,
+			GLsizei width, GLsizei height, atlas_pixel_format_t format) override
+		{
+			command_t& c = push(COMMAND_CLEAR_RECT, format);
+			c.handle = handle;
+			c.slice = slice;
+			c.x = x;
+			c.y = y;
+			c.width = (uint32_t) width;
+			c.height = (uint32_t) height;
+		}
+
+		void delete_layers(size_t count, const GLuint* deleted) override
+		{
+			command_t& c = push(COMMAND_DELETE_LAYERS, ATLAS_PIXEL_RGBA8);
+			c.count = count;
+
+			const uint8_t* p = (const uint8_t*) deleted;
+			data.insert(data.end(), p, p + count * sizeof(GLuint));
+		}
+
+		void begin_layer(atlas_pixel_format_t format) override
+		{
+			layer_first = commands.size();
+			push(COMMAND_BEGIN_LAYER, format);
+		}
+
+		void end_layer(void) override
+		{
+			merge_layer_rects(layer_first);
+			push(COMMAND_END_LAYER, ATLAS_PIXEL_RGBA8);
+		}
+
+		// Pixel data recorded and still to be replayed, in bytes.
+		size_t pending_bytes(void) const
+		{
+			size_t bytes = 0;
+
+			for (size_t i = next; i < commands.size(); ++i)
+				bytes += commands[i].bytes;
+
+			return bytes;
+		}
+
+		// On the GL thread: replays commands onto the target until the next
+		// would take the pixel data replayed by this call past byte_budget,
+		// but always at least one. Returns true once the whole list has been
+		// replayed, at which point atlas, which the list recorded the build
+		// of, uses the target's textures instead of the list's. The target
+		// counts its calls into stats, if given.
+		bool replay(atlas_t& atlas, size_t byte_budget = SIZE_MAX,
+			atlas_upload_stats_t* stats = nullptr)
+		{
+			upload_stats_scope_t counting(target, stats);
+
+			handles.resize(next_handle - 1, 0);
+
+			if (layer_open && next < commands.size())
+				target.begin_layer(layer_format);
+
+			size_t spent = 0;
+
+			while (next < commands.size()) {
+				const command_t& c = commands[next];
+
+				if (spent && spent + c.bytes > byte_budget)
+					break;
+
+				spent += c.bytes;
+				run(c);
+				++next;
+			}
+
+			if (next < commands.size()) {
+				// Back to how the target expects to be left between layers.
+				if (layer_open)
+					target.end_layer();
+
+				return false;
+			}
+
+			if (atlas.backend == this) {
+				for (GLuint& handle: atlas.layer_tex_handles)
+					handle = mapped(handle);
+
+				atlas.array_tex_handle = mapped(atlas.array_tex_handle);
+				atlas.backend = &target;
+			}
+
+			std::vector<command_t>().swap(commands);
+			std::vector<uint8_t>().swap(data);
+			next = 0;
+
+			return true;
+		}
+	};
+
+	//------------------
+	// gen_layer_bsp
+	//
+	// generates a layer (think of "layer" in this sense as just a texture
+	// representing a portion for a set of a group of images ).
+	// The core algorithm is based on 2D BSP generation.
+	//
+	// it assesses whether or not sorted images for this layer
+	// actually save space and how large this layer actually needs to be.
+	//
+	// the set of images a layer has will be more efficiently placed if the
+	// variation of the image sizes is high; if a layer consists
+	// of images which are of the same dimensions, then there will be a lot of unused
+	// space.
+	//
+	// idea behind BSP algol is from here:
+	// http://gamedev.stackexchange.com/a/34193
+	//------------------
+
+	class gen_layer_bsp
+	{
+		struct node_t;
+
+		using node_ptr_t = std::unique_ptr<node_t, void (*)(node_t*)>;
+		using atlas_type_t = atlas_t;
+
+		atlas_type_t& atlas;
+
+		node_ptr_t root;
+		glm::ivec3 layer_dims;
+
+		// Added to each side of every image, before rounding it up to a
+		// multiple of align.
+		int32_t pad;
+		uint8_t align;
+
+		glm::ivec2 padded_dims(uint16_t image) const
+		{
+			return glm::ivec2(
+				atlas_cell_extent(atlas.dims_x[image], pad, align),
+				atlas_cell_extent(atlas.dims_y[image], pad, align));
+		}
+
+		// Only left child's are capable of storing image indices,
+		// from the perspective of the child's parent.
+
+		// The "lines" (expressed implicitly) will only have
+		// positive normals that face either to the right, or upward.
+		struct node_t {
+			bool region;
+			int32_t image;
+
+			glm::ivec2 origin;
+			glm::ivec2 dims;
+
+			node_t* left_child;
 			node_t* right_child;
 
-			node_t(void)
-			:   region(false),
-				image(-1),
-				origin(0, 0), dims(0, 0),
-				left_child(nullptr), right_child(nullptr)
-			{}
+			node_t(void)
+			:   region(false),
+				image(-1),
+				origin(0, 0), dims(0, 0),
+				left_child(nullptr), right_child(nullptr)
+			{}
+
+			static void destroy(node_t* n)
+			{
+				if (n) {
+					destroy(n->left_child);
+					destroy(n->right_child);
+					delete n;
+				}
+			}
+		};
+
+		node_t* insert_node(node_t* node, uint16_t image)
+		{
+			if (node->region) {
+				node_t* n = insert_node(node->left_child, image);
+
+				if (n) {
+					node->left_child = n;
+					return node;
+				}
+
+				n = insert_node(node->right_child, image);
+
+				if (n) {
+					node->right_child = n;
+					return node;
+				}
+			} else {
+
+				if (node->image >= 0)
+					return nullptr;
+
+				glm::ivec2 image_dims = padded_dims(image);
+
+				if (node->dims.x < image_dims.x || node->dims.y < image_dims.y)
+					return nullptr;
+
+				if (node->dims.x == image_dims.x
+					&& node->dims.y == image_dims.y) {
+
+					node->image = image;
+
+					if ((node->origin.x + image_dims.x) > layer_dims.x)
+						layer_dims.x = node->origin.x + image_dims.x;
+
+					if ((node->origin.y + image_dims.y) > layer_dims.y)
+						layer_dims.y = node->origin.y + image_dims.y;
+
+					atlas.write_origins(node->image, node->origin.x + pad,
+						node->origin.y + pad);
+
+					return node;
+				}
+
+				node->region = true;
+
+				uint16_t dx = node->dims.x - image_dims.x;
+				uint16_t dy = node->dims.y - image_dims.y;
+
+				node->left_child = new node_t();
+				node->right_child = new node_t();
+
+				// Is the partition line vertical?
+				if (dx > dy) {
+					node->left_child->dims.x = image_dims.x;
+					node->left_child->dims.y = node->dims.y;
+					node->left_child->origin = node->origin;
+
+					node->right_child->dims.x = dx;
+					node->right_child->dims.y = node->dims.y;
+					node->right_child->origin = node->origin;
+
+					node->right_child->origin.x += image_dims.x;
+
+				// Nope, it's horizontal
+				} else {
+					node->left_child->dims.x = node->dims.x;
+					node->left_child->dims.y = image_dims.y;
+					node->left_child->origin = node->origin;
+
+					node->right_child->dims.x = node->dims.x;
+					node->right_child->dims.y = dy;
+					node->right_child->origin = node->origin;
+
+					node->right_child->origin.y += image_dims.y;
+				}
+
+				// The only way we're able to make it here
+				// is if node's dimensions are >= the image's dimensions.
+				// If they're exactly equal, then node would have already been
+				// set and this call won't happen.
+				// Otherwise, the left child's values are set to values
+				// which have already been examined for size, or are
+				// set to one of the image's dimension values.
+
+				node->left_child = insert_node(node->left_child, image);
+
+				return node;
+			}
+
+			return nullptr;
+		}
+
+		bool insert(uint16_t image)
+		{
+			node_t* res = insert_node(root.get(), image);
+
+			return !!res;
+		}
+
+	public:
+
+		const glm::ivec3& dims(void) const
+		{
+			return layer_dims;
+		}
+
+		// area_accum is the total area of the images' cells being packed,
+		// which bounds the root's dimensions.
+		gen_layer_bsp(atlas_type_t& atlas_, image_fill_map_t& image_check,
+			GLint max_dims, uint32_t area_accum, uint16_t gutter = 0,
+			uint8_t cell_align = 1)
+			:   atlas(atlas_),
+				root(new node_t(), node_t::destroy),
+				pad(gutter),
+				align(cell_align)
+		{
+			// Setup some upper bounds for the width/height values
+			{
+				uint32_t root_area_accumf =
+					next_power2((uint32_t) glm::sqrt((float) area_accum));
+
+				// A small set with a long, thin image can have less area
+				// than that image's extent, which then wouldn't fit
+				// into any layer.
+				for (const auto& image: image_check) {
+					glm::ivec2 dims = padded_dims(image.first);
+
+					root_area_accumf = std::max(root_area_accumf,
+						next_power2((uint32_t) std::max(dims.x, dims.y)));
+				}
+
+				if ((uint32_t) max_dims > root_area_accumf)
+					max_dims = (GLint) root_area_accumf;
+
+				root->dims = glm::ivec2(max_dims, max_dims);
+			}
+
+			std::vector<uint16_t> sorted(image_check.size(), 0);
+
+			uint16_t i = 0;
+
+			for (auto image: image_check)
+				sorted[i++] = image.first;
+
+			std::sort(sorted.begin(), sorted.end(), [this](uint16_t a,
+				uint16_t b) -> bool {
+				if (atlas.dims_x[a] == atlas.dims_x[b]) {
+					return atlas.dims_y[a] > atlas.dims_y[b];
+				}
+				return atlas.dims_x[a] > atlas.dims_x[b];
+			});
+
+			for (uint16_t image: sorted) {
+				if (insert(image)) {
+					image_check[image] = 1;
+					layer_dims[2] += 1;
+				}
+			}
+		}
+	};
+
+	//------------------------------------------------------------------------------------
+	// minor texture utils
+	//------------------------------------------------------------------------------------
+	static ga_inline void convert_rgb_to_rgba(uint8_t* dest,
+		const uint8_t* src, size_t dim_x, size_t dim_y)
+	{
+		for (size_t y = 0; y < dim_y; ++y) {
+			for (size_t x = 0; x < dim_x; ++x) {
+				size_t i = y * dim_x + x;
+				dest[i * 4 + 0] = src[i * 3 + 0];
+				dest[i * 4 + 1] = src[i * 3 + 1];
+				dest[i * 4 + 2] = src[i * 3 + 2];
+				dest[i * 4 + 3] = 255;
+			}
+		}
+	}
+
+	static ga_inline void convert_rgba_to_rgb(uint8_t* dest,
+		const uint8_t* src, size_t count)
+	{
+		for (size_t i = 0; i < count; ++i) {
+			dest[i * 3 + 0] = src[i * 4 + 0];
+			dest[i * 3 + 1] = src[i * 4 + 1];
+			dest[i * 3 + 2] = src[i * 4 + 2];
+		}
+	}
+
+	// src has bpp (3 or 4) bytes per pixel, alpha is dropped. dest gets
+	// GL_UNSIGNED_SHORT_5_6_5 pixels in host byte order.
+	static ga_inline void convert_to_rgb565(uint8_t* dest,
+		const uint8_t* src, size_t count, int bpp)
+	{
+		for (size_t i = 0; i < count; ++i, src += bpp) {
+			uint16_t px = (uint16_t) (((src[0] * 31 + 127) / 255) << 11
+				| ((src[1] * 63 + 127) / 255) << 5
+				| ((src[2] * 31 + 127) / 255));
+
+			memcpy(dest + i * 2, &px, sizeof(px));
+		}
+	}
+
+	// Any uncompressed format to RGBA8, as the layer would sample it.
+	static ga_inline void expand_to_rgba(uint8_t* dest, const uint8_t* src,
+		size_t count, atlas_pixel_format_t format)
+	{
+		for (size_t i = 0; i < count; ++i, dest += 4) {
+			switch (format) {
+			case ATLAS_PIXEL_RGB565: {
+				uint16_t px;
+				memcpy(&px, src + i * 2, sizeof(px));
+
+				uint32_t r = px >> 11, g = (px >> 5) & 0x3F, b = px & 0x1F;
+
+				dest[0] = (uint8_t) ((r << 3) | (r >> 2));
+				dest[1] = (uint8_t) ((g << 2) | (g >> 4));
+				dest[2] = (uint8_t) ((b << 3) | (b >> 2));
+				dest[3] = 255;
+				break;
+			}
+			case ATLAS_PIXEL_L8:
+			case ATLAS_PIXEL_LA8: {
+				size_t bpp = pixel_format_bytes(format);
+
+				dest[0] = dest[1] = dest[2] = src[i * bpp];
+				dest[3] = bpp == 2 ? src[i * 2 + 1] : 255;
+				break;
+			}
+			default: {
+				size_t bpp = pixel_format_bytes(format);
+
+				memcpy(dest, src + i * bpp, 3);
+				dest[3] = bpp == 4 ? src[i * 4 + 3] : 255;
+				break;
+			}
+			}
+		}
+	}
+
+	static ga_inline bool is_opaque_rgba(const uint8_t* rgba, size_t count)
+	{
+		uint8_t alpha = 0xFF;
+
+		// Checked a row's worth at a time, so translucent images bail early
+		// without the inner loop losing its vectorization.
+		for (size_t i = 0; i < count && alpha == 0xFF;) {
+			size_t end = std::min(count, i + 256);
+
+			for (; i < end; ++i)
+				alpha &= rgba[i * 4 + 3];
+		}
+
+		return alpha == 0xFF;
+	}
+
+	static ga_inline uint32_t pack_rgba(uint8_t* rgba)
+	{
+		return (((uint32_t)rgba[0]) << 0)
+		| (((uint32_t)rgba[1]) << 8)
+		| (((uint32_t)rgba[2]) << 16)
+		| (((uint32_t)rgba[3]) << 24);
+	}
+
+	static ga_inline void unpack_rgba(uint8_t* dest, uint32_t src)
+	{
+		dest[0] = (src >> 0) & 0xFF;
+		dest[1] = (src >> 8) & 0xFF;
+		dest[2] = (src >> 16) & 0xFF;
+		dest[3] = (src >> 24) & 0xFF;
+	}
+
+	static ga_inline void flip_rows_rgba(uint8_t* image_data,
+		size_t dim_x, size_t dim_y)
+	{
+		size_t half_dy = dim_y >> 1;
+		for (size_t y = 0; y < half_dy; ++y) {
+			for (size_t x = 0; x < dim_x; ++x) {
+				size_t top_x = (y * dim_x + x) * 4;
+				size_t bot_x = ((dim_y - y - 1) * dim_x + x) * 4;
+				uint32_t top = pack_rgba(&image_data[top_x]);
+
+				unpack_rgba(&image_data[top_x],
+							pack_rgba(&image_data[bot_x]));
+
+				unpack_rgba(&image_data[bot_x], top);
+			}
+		}
+	}
+
+	static ga_inline void flip_rows(uint8_t* image_data, size_t row_bytes,
+		size_t dim_y)
+	{
+		for (size_t y = 0; y < (dim_y >> 1); ++y) {
+			std::swap_ranges(image_data + y * row_bytes,
+				image_data + (y + 1) * row_bytes,
+				image_data + (dim_y - y - 1) * row_bytes);
+		}
+	}
+
+	//------------------------------------------------------------------------------------
+	// resampling
+	//
+	// Separable resize used to shrink images on the loader threads, before
+	// they're packed. Rows are widened to floats with premultiplied alpha,
+	// filtered horizontally into an intermediate image, then vertically into
+	// the output; alpha is only divided back out at the very end, so fully
+	// transparent texels don't bleed their color into their neighbours.
+	//------------------------------------------------------------------------------------
+
+	enum atlas_filter_t {
+		ATLAS_FILTER_BOX = 0,
+		ATLAS_FILTER_TRIANGLE,
+		ATLAS_FILTER_LANCZOS3
+	};
+
+	static ga_inline float resize_filter_support(atlas_filter_t filter)
+	{
+		switch (filter) {
+		case ATLAS_FILTER_BOX:
+			return 0.5f;
+		case ATLAS_FILTER_TRIANGLE:
+			return 1.0f;
+		default:
+			return 3.0f;
+		}
+	}
+
+	static ga_inline float resize_filter_weight(atlas_filter_t filter, float x)
+	{
+		x = fabsf(x);
+
+		switch (filter) {
+		case ATLAS_FILTER_BOX:
+			return x < 0.5f ? 1.0f : 0.0f;
+		case ATLAS_FILTER_TRIANGLE:
+			return x < 1.0f ? 1.0f - x : 0.0f;
+		default:
+			if (x < 1e-5f)
+				return 1.0f;
+
+			if (x >= 3.0f)
+				return 0.0f;
+
+			{
+				const float pi = 3.14159265358979f;
+				float px = pi * x;
+
+				return 3.0f * sinf(px) * sinf(px / 3.0f) / (px * px);
+			}
+		}
+	}
+
+	// Weights from one axis of the source to one axis of the output: output
+	// texel i is the sum of weights[i * taps + k] * source[first[i] + k].
+	struct resize_axis_t {
+		std::vector<int> first;
+		std::vector<float> weights;
+		int taps;
+
+		resize_axis_t(int in, int out, atlas_filter_t filter)
+		{
+			float inv_scale = (float) in / (float) out;
+
+			// Shrinking widens the filter so every source texel counts.
+			float stretch = std::max(inv_scale, 1.0f);
+			float support = resize_filter_support(filter) * stretch;
+
+			taps = std::min((int) ceilf(support * 2.0f) + 2, in);
+
+			first.resize(out);
+			weights.assign((size_t) out * taps, 0.0f);
+
+			for (int i = 0; i < out; ++i) {
+				float center = ((float) i + 0.5f) * inv_scale;
+
+				int lo = std::max((int) floorf(center - support), 0);
+				lo = std::min(lo, in - taps);
+
+				float* w = &weights[(size_t) i * taps];
+				float sum = 0.0f;
+
+				for (int k = 0; k < taps; ++k) {
+					float x = ((float) (lo + k) + 0.5f - center) / stretch;
+					w[k] = resize_filter_weight(filter, x);
+					sum += w[k];
+				}
+
+				// Box weights can all miss when upscaling between centers
+				if (sum == 0.0f) {
+					int nearest = std::min((int) center, in - 1) - lo;
+					w[nearest] = sum = 1.0f;
+				}
+
+				for (int k = 0; k < taps; ++k)
+					w[k] /= sum;
+
+				first[i] = lo;
+			}
+		}
+	};
+
+	// Widens a row of count texels to floats, premultiplying by alpha if the
+	// texels have any (the last channel for 2 and 4 channels).
+	static ga_inline void resize_load_row(float* dest, const uint8_t* src,
+		size_t count, int channels)
+	{
+		bool alpha = channels == 2 || channels == 4;
+
+		if (!alpha) {
+			for (size_t i = 0; i < count * channels; ++i)
+				dest[i] = (float) src[i];
+
+			return;
+		}
+
+		for (size_t i = 0; i < count; ++i, src += channels, dest += channels) {
+			float a = (float) src[channels - 1];
+			float scale = a * (1.0f / 255.0f);
+
+			for (int c = 0; c < channels - 1; ++c)
+				dest[c] = (float) src[c] * scale;
+
+			dest[channels - 1] = a;
+		}
+	}
+
+	// The inverse of resize_load_row, rounding and clamping to bytes.
+	static ga_inline void resize_store_row(uint8_t* dest, const float* src,
+		size_t count, int channels)
+	{
+		bool alpha = channels == 2 || channels == 4;
+
+		for (size_t i = 0; i < count; ++i, src += channels, dest += channels) {
+			float a = src[channels - 1];
+			float unscale = !alpha ? 1.0f : a >= 0.5f ? 255.0f / a : 0.0f;
+
+			for (int c = 0; c < channels; ++c) {
+				float v = (alpha && c < channels - 1) ? src[c] * unscale : src[c];
+				v = std::min(std::max(v + 0.5f, 0.0f), 255.0f);
+
+				dest[c] = (uint8_t) v;
+			}
+		}
+	}
+
+	// Filters a row of floats along x. Both rows must have room for one float
+	// past their last texel, which the SIMD path may touch for 3 channels.
+	static ga_inline void resize_row_h(float* dest, const float* src,
+		const resize_axis_t& axis, int channels)
+	{
+		size_t out = axis.first.size();
+		const float* w = &axis.weights[0];
+
+#ifdef GL_ATLAS_SSE2
+		if (channels == 3 || channels == 4) {
+			for (size_t i = 0; i < out; ++i, w += axis.taps) {
+				const float* s = src + (size_t) axis.first[i] * channels;
+				__m128 acc = _mm_setzero_ps();
+
+				for (int k = 0; k < axis.taps; ++k, s += channels)
+					acc = _mm_add_ps(acc,
+						_mm_mul_ps(_mm_set1_ps(w[k]), _mm_loadu_ps(s)));
+
+				// For 3 channels the 4th lane is overwritten by the next texel
+				_mm_storeu_ps(dest + i * channels, acc);
+			}
+
+			return;
+		}
+#endif
+
+		for (size_t i = 0; i < out; ++i, w += axis.taps) {
+			const float* s = src + (size_t) axis.first[i] * channels;
+			float acc[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+
+			for (int k = 0; k < axis.taps; ++k, s += channels) {
+				for (int c = 0; c < channels; ++c)
+					acc[c] += w[k] * s[c];
+			}
+
+			for (int c = 0; c < channels; ++c)
+				dest[i * channels + c] = acc[c];
+		}
+	}
+
+	// dest = sum of weights[k] * rows[k], over n floats.
+	static ga_inline void resize_row_v(float* dest, const float* const* rows,
+		const float* weights, int taps, size_t n)
+	{
+		size_t i = 0;
+
+#ifdef GL_ATLAS_SSE2
+		for (; i + 4 <= n; i += 4) {
+			__m128 acc = _mm_setzero_ps();
+
+			for (int k = 0; k < taps; ++k)
+				acc = _mm_add_ps(acc, _mm_mul_ps(_mm_set1_ps(weights[k]),
+					_mm_loadu_ps(rows[k] + i)));
+
+			_mm_storeu_ps(dest + i, acc);
+		}
+#endif
+
+		for (; i < n; ++i) {
+			float acc = 0.0f;
+
+			for (int k = 0; k < taps; ++k)
+				acc += weights[k] * rows[k][i];
+
+			dest[i] = acc;
+		}
+	}
+
+	// Resizes an image of 8 bit texels with 1 to 4 channels. The orientation
+	// of the rows doesn't matter.
+	static ga_inline void resize_image(uint8_t* dest, int dest_x, int dest_y,
+		const uint8_t* src, int src_x, int src_y, int channels,
+		atlas_filter_t filter)
+	{
+		resize_axis_t axis_x(src_x, dest_x, filter);
+		resize_axis_t axis_y(src_y, dest_y, filter);
+
+		size_t src_row = (size_t) src_x * channels;
+		size_t mid_row = (size_t) dest_x * channels;
+
+		// Only the source rows some output row reads are filtered along x
+		int row_lo = axis_y.first[0];
+		int row_hi = axis_y.first[dest_y - 1] + axis_y.taps;
+
+		std::vector<float> wide(src_row + 1);
+		std::vector<float> mid((size_t) (row_hi - row_lo) * mid_row + 1);
+		std::vector<float> out(mid_row);
+		std::vector<const float*> rows(axis_y.taps);
+
+		for (int y = row_lo; y < row_hi; ++y) {
+			resize_load_row(&wide[0], src + (size_t) y * src_row,
+				(size_t) src_x, channels);
+
+			resize_row_h(&mid[(size_t) (y - row_lo) * mid_row], &wide[0],
+				axis_x, channels);
+		}
+
+		for (int y = 0; y < dest_y; ++y) {
+			for (int k = 0; k < axis_y.taps; ++k)
+				rows[k] = &mid[(size_t) (axis_y.first[y] + k - row_lo) * mid_row];
+
+			resize_row_v(&out[0], &rows[0],
+				&axis_y.weights[(size_t) y * axis_y.taps], axis_y.taps, mid_row);
+
+			resize_store_row(dest + (size_t) y * mid_row, &out[0],
+				(size_t) dest_x, channels);
+		}
+	}
+
+	//------------------------------------------------------------------------------------
+	// mip downsampling
+	//
+	// Each mip level is the previous one through a 2x2 box filter, rounded to
+	// nearest. A side that's already 1 texel wide stays at 1, reusing its one
+	// column or row for both taps. Layers are powers of two, so there are no
+	// odd sizes to worry about past that.
+	//------------------------------------------------------------------------------------
+
+#ifdef GL_ATLAS_SSE2
+	// Two rows of four RGBA8 texels each to two texels.
+	static ga_inline __m128i box2x2_rgba_sse2(__m128i a, __m128i b)
+	{
+		const __m128i zero = _mm_setzero_si128();
+
+		__m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(a, zero),
+			_mm_unpacklo_epi8(b, zero));
+		__m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(a, zero),
+			_mm_unpackhi_epi8(b, zero));
+
+		// [t0 | t2] + [t1 | t3]
+		__m128i sum = _mm_add_epi16(_mm_unpacklo_epi64(lo, hi),
+			_mm_unpackhi_epi64(lo, hi));
+
+		return _mm_srli_epi16(_mm_add_epi16(sum, _mm_set1_epi16(2)), 2);
+	}
+#endif
+
+	static ga_inline void downsample_row(uint8_t* dest, const uint8_t* r0,
+		const uint8_t* r1, size_t src_x, size_t dest_x,
+		atlas_pixel_format_t format)
+	{
+		if (format == ATLAS_PIXEL_RGB565) {
+			const uint16_t* a = (const uint16_t*) r0;
+			const uint16_t* b = (const uint16_t*) r1;
+			uint16_t* d = (uint16_t*) dest;
+
+			for (size_t x = 0; x < dest_x; ++x) {
+				size_t x0 = 2 * x, x1 = std::min(2 * x + 1, src_x - 1);
+				uint16_t t[4] = { a[x0], a[x1], b[x0], b[x1] };
+				uint32_t r = 2, g = 2, bl = 2;
+
+				for (uint16_t v: t) {
+					r += v >> 11;
+					g += (v >> 5) & 0x3F;
+					bl += v & 0x1F;
+				}
+
+				d[x] = (uint16_t) (((r >> 2) << 11) | ((g >> 2) << 5) | (bl >> 2));
+			}
+
+			return;
+		}
+
+		size_t bpp = pixel_format_bytes(format);
+		size_t x = 0;
+
+#ifdef GL_ATLAS_SSE2
+		if (bpp == 4) {
+			for (; x + 4 <= dest_x && 2 * x + 8 <= src_x; x += 4) {
+				const uint8_t* a = r0 + x * 8;
+				const uint8_t* b = r1 + x * 8;
+
+				__m128i lo = box2x2_rgba_sse2(
+					_mm_loadu_si128((const __m128i*) a),
+					_mm_loadu_si128((const __m128i*) b));
+				__m128i hi = box2x2_rgba_sse2(
+					_mm_loadu_si128((const __m128i*) (a + 16)),
+					_mm_loadu_si128((const __m128i*) (b + 16)));
+
+				_mm_storeu_si128((__m128i*) (dest + x * 4),
+					_mm_packus_epi16(lo, hi));
+			}
+		}
+#endif
+
+		for (; x < dest_x; ++x) {
+			size_t x0 = 2 * x * bpp;
+			size_t x1 = std::min(2 * x + 1, src_x - 1) * bpp;
+
+			for (size_t c = 0; c < bpp; ++c)
+				dest[x * bpp + c] = (uint8_t) ((r0[x0 + c] + r0[x1 + c]
+					+ r1[x0 + c] + r1[x1 + c] + 2) >> 2);
+		}
+	}
+
+	// Writes the level below a src_x x src_y one, in bands of rows spread
+	// over the pool once it's big enough to be worth it.
+	static ga_inline void downsample_level(uint8_t* dest, const uint8_t* src,
+		size_t src_x, size_t src_y, atlas_pixel_format_t format,
+		worker_pool_t& pool, size_t parallel_bytes)
+	{
+		const size_t band = 32;
+
+		size_t bpp = pixel_format_bytes(format);
+		size_t dest_x = std::max(src_x / 2, (size_t) 1);
+		size_t dest_y = std::max(src_y / 2, (size_t) 1);
+
+		auto run_band = [&](size_t n) {
+			size_t end = std::min((n + 1) * band, dest_y);
+
+			for (size_t y = n * band; y < end; ++y) {
+				const uint8_t* r0 = src + 2 * y * src_x * bpp;
+				const uint8_t* r1 = src
+					+ std::min(2 * y + 1, src_y - 1) * src_x * bpp;
+
+				downsample_row(dest + y * dest_x * bpp, r0, r1, src_x, dest_x,
+					format);
+			}
+		};
+
+		size_t bands = (dest_y + band - 1) / band;
+
+		if (dest_x * dest_y * bpp >= parallel_bytes)
+			pool.parallel_for(bands, run_band);
+		else
+			for (size_t n = 0; n < bands; ++n)
+				run_band(n);
+	}
+
+	//------------------------------------------------------------------------------------
+	// block compression
+	//
+	// CPU encoders for the layer formats GPUs decode in 4x4 texel blocks:
+	// ETC1 for opaque layers on GLES 2, and BC1/BC3 (S3TC) for opaque and
+	// alpha ones on desktop GL. Either way a block stores a couple of base
+	// colors and a 2 bit index per texel into four colors derived from them,
+	// so most of the time goes into finding each texel's nearest of four,
+	// which nearest_of_4 does four texels at a time with SSE. Palettes hold
+	// the exact integer colors a decoder produces, so the errors are exact
+	// and both paths pick the same indices.
+	//
+	// ATLAS_ENCODE_FAST takes the obvious endpoints (BC1: the extremes along
+	// the block's principal axis) or base colors (ETC1: each half's mean).
+	// ATLAS_ENCODE_HIGH then refines BC1 endpoints by least squares and
+	// tries the neighbours of each ETC1 base color, for a few times the
+	// time. Rows of blocks are spread over the pool.
+	//------------------------------------------------------------------------------------
+
+	enum atlas_encode_quality_t : uint8_t {
+		ATLAS_ENCODE_FAST = 0,
+		ATLAS_ENCODE_HIGH
+	};
+
+	// Levels with fewer blocks than this are encoded on the calling thread
+	// alone.
+	#ifndef GL_ATLAS_ENCODE_PARALLEL_BLOCKS
+		#define GL_ATLAS_ENCODE_PARALLEL_BLOCKS 1024
+	#endif
+
+	// A block's texels row by row, one plane per channel.
+	struct block_texels_t {
+		float r[16];
+		float g[16];
+		float b[16];
+		uint8_t a[16];
+	};
+
+	static ga_inline int expand_bits(int v, int bits)
+	{
+		return (v << (8 - bits)) | (v >> (2 * bits - 8));
+	}
+
+	// Texels past the level's right or bottom edge repeat its last column
+	// or row.
+	static ga_inline void load_block(block_texels_t& block, const uint8_t* src,
+		size_t width, size_t height, size_t x0, size_t y0,
+		atlas_pixel_format_t format)
+	{
+		size_t bpp = pixel_format_bytes(format);
+
+		for (size_t i = 0; i < 16; ++i) {
+			size_t x = std::min(x0 + (i & 3), width - 1);
+			size_t y = std::min(y0 + (i >> 2), height - 1);
+			const uint8_t* p = src + (y * width + x) * bpp;
+
+			if (format == ATLAS_PIXEL_RGB565) {
+				uint16_t v;
+				memcpy(&v, p, sizeof(v));
+
+				block.r[i] = (float) expand_bits(v >> 11, 5);
+				block.g[i] = (float) expand_bits((v >> 5) & 0x3F, 6);
+				block.b[i] = (float) expand_bits(v & 0x1F, 5);
+				block.a[i] = 255;
+			} else {
+				block.r[i] = p[0];
+				block.g[i] = p[1];
+				block.b[i] = p[2];
+				block.a[i] = bpp == 4 ? p[3] : 255;
+			}
+		}
+	}
+
+	// For each of n texels, the index of the nearest of the four palette
+	// colors. Returns the total squared error.
+	static ga_inline float nearest_of_4(const float* r, const float* g,
+		const float* b, size_t n, const float palette[4][3], uint8_t* indices)
+	{
+		float total = 0.0f;
+		size_t i = 0;
+
+#ifdef GL_ATLAS_SSE2
+		// A bound GCC can see is a multiple of 4; with i + 4 <= n it warns
+		// about the tail loop overrunning 8 and 16 texel blocks it never
+		// enters.
+		size_t vector_n = n & ~(size_t) 3;
+
+		for (; i < vector_n; i += 4) {
+			__m128 tr = _mm_loadu_ps(r + i);
+			__m128 tg = _mm_loadu_ps(g + i);
+			__m128 tb = _mm_loadu_ps(b + i);
+
+			__m128 best = _mm_set1_ps(1e30f);
+			__m128i index = _mm_setzero_si128();
+
+			for (int k = 0; k < 4; ++k) {
+				__m128 dr = _mm_sub_ps(tr, _mm_set1_ps(palette[k][0]));
+				__m128 dg = _mm_sub_ps(tg, _mm_set1_ps(palette[k][1]));
+				__m128 db = _mm_sub_ps(tb, _mm_set1_ps(palette[k][2]));
+
+				__m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dr, dr),
+					_mm_mul_ps(dg, dg)), _mm_mul_ps(db, db));
+
+				__m128i closer = _mm_castps_si128(_mm_cmplt_ps(d, best));
+
+				best = _mm_min_ps(d, best);
+				index = _mm_or_si128(_mm_andnot_si128(closer, index),
+					_mm_and_si128(closer, _mm_set1_epi32(k)));
+			}
+
+			int32_t lane_index[4];
+			float lane_error[4];
+
+			_mm_storeu_si128((__m128i*) lane_index, index);
+			_mm_storeu_ps(lane_error, best);
+
+			for (size_t j = 0; j < 4; ++j) {
+				indices[i + j] = (uint8_t) lane_index[j];
+				total += lane_error[j];
+			}
+		}
+#endif
+
+		for (; i < n; ++i) {
+			float best = 1e30f;
+			uint8_t index = 0;
+
+			for (int k = 0; k < 4; ++k) {
+				float dr = r[i] - palette[k][0];
+				float dg = g[i] - palette[k][1];
+				float db = b[i] - palette[k][2];
+				float d = dr * dr + dg * dg + db * db;
+
+				if (d < best) {
+					best = d;
+					index = (uint8_t) k;
+				}
+			}
+
+			indices[i] = index;
+			total += best;
+		}
+
+		return total;
+	}
+
+	static ga_inline uint16_t pack_565(const float c[3])
+	{
+		int q[3];
+		const float levels[3] = { 31.0f, 63.0f, 31.0f };
+
+		for (int k = 0; k < 3; ++k)
+			q[k] = std::min(std::max((int) (c[k] * levels[k] / 255.0f + 0.5f),
+				0), (int) levels[k]);
+
+		return (uint16_t) ((q[0] << 11) | (q[1] << 5) | q[2]);
+	}
+
+	// The colors of a four color block, c0 > c1.
+	static ga_inline void bc1_palette(uint16_t c0, uint16_t c1,
+		float palette[4][3])
+	{
+		int e[2][3];
+
+		for (int k = 0; k < 2; ++k) {
+			uint16_t v = k ? c1 : c0;
+
+			e[k][0] = expand_bits(v >> 11, 5);
+			e[k][1] = expand_bits((v >> 5) & 0x3F, 6);
+			e[k][2] = expand_bits(v & 0x1F, 5);
+		}
+
+		for (int c = 0; c < 3; ++c) {
+			palette[0][c] = (float) e[0][c];
+			palette[1][c] = (float) e[1][c];
+			palette[2][c] = (float) ((2 * e[0][c] + e[1][c] + 1) / 3);
+			palette[3][c] = (float) ((e[0][c] + 2 * e[1][c] + 1) / 3);
+		}
+	}
+
+	// Quantizes endpoints e0 and e1 and fits the block to them. Returns the
+	// error.
+	static ga_inline float bc1_fit(const block_texels_t& block,
+		const float e0[3], const float e1[3], uint16_t& c0, uint16_t& c1,
+		uint8_t indices[16])
+	{
+		c0 = pack_565(e0);
+		c1 = pack_565(e1);
+
+		// c0 <= c1 would select three colors and transparent black instead.
+		if (c0 < c1)
+			std::swap(c0, c1);
+
+		float palette[4][3];
+		bc1_palette(c0, c1, palette);
+
+		return nearest_of_4(block.r, block.g, block.b, 16, palette, indices);
+	}
+
+	static ga_inline void encode_bc1_block(const block_texels_t& block,
+		uint8_t* out, atlas_encode_quality_t quality)
+	{
+		const float* planes[3] = { block.r, block.g, block.b };
+
+		float mean[3] = { 0.0f, 0.0f, 0.0f };
+
+		for (int c = 0; c < 3; ++c) {
+			for (int i = 0; i < 16; ++i)
+				mean[c] += planes[c][i];
+
+			mean[c] /= 16.0f;
+		}
+
+		float cov[3][3] = {};
+
+		for (int i = 0; i < 16; ++i) {
+			float d[3] = { block.r[i] - mean[0], block.g[i] - mean[1],
+				block.b[i] - mean[2] };
+
+			for (int c = 0; c < 3; ++c)
+				for (int k = 0; k < 3; ++k)
+					cov[c][k] += d[c] * d[k];
+		}
+
+		// Principal axis by power iteration, starting from the covariance
+		// of the channel that varies the most.
+		int widest = 0;
+
+		for (int c = 1; c < 3; ++c) {
+			if (cov[c][c] > cov[widest][widest])
+				widest = c;
+		}
+
+		float axis[3] = { cov[widest][0], cov[widest][1], cov[widest][2] };
+
+		for (int it = 0; it < 8; ++it) {
+			float next[3];
+			float scale = 0.0f;
+
+			for (int c = 0; c < 3; ++c) {
+				next[c] = cov[c][0] * axis[0] + cov[c][1] * axis[1]
+					+ cov[c][2] * axis[2];
+				scale = std::max(scale, std::max(next[c], -next[c]));
+			}
+
+			if (scale == 0.0f)
+				break;
+
+			for (int c = 0; c < 3; ++c)
+				axis[c] = next[c] / scale;
+		}
+
+		int lo = 0, hi = 0;
+		float lo_t = 1e30f, hi_t = -1e30f;
+
+		for (int i = 0; i < 16; ++i) {
+			float t = (block.r[i] - mean[0]) * axis[0]
+				+ (block.g[i] - mean[1]) * axis[1]
+				+ (block.b[i] - mean[2]) * axis[2];
+
+			if (t < lo_t) {
+				lo_t = t;
+				lo = i;
+			}
+
+			if (t > hi_t) {
+				hi_t = t;
+				hi = i;
+			}
+		}
+
+		float e0[3] = { block.r[hi], block.g[hi], block.b[hi] };
+		float e1[3] = { block.r[lo], block.g[lo], block.b[lo] };
+
+		uint16_t c0, c1;
+		uint8_t indices[16];
+		float error = bc1_fit(block, e0, e1, c0, c1, indices);
+
+		// Least squares endpoints for the indices so far, where a texel is
+		// c0 * w + c1 * (1 - w), for as long as that helps.
+		static const float weights[4] = { 1.0f, 0.0f, 2.0f / 3.0f, 1.0f / 3.0f };
+
+		for (int pass = 0; quality == ATLAS_ENCODE_HIGH && pass < 2
+			&& error > 0.0f; ++pass) {
+			float aa = 0.0f, ab = 0.0f, bb = 0.0f;
+			float ax[3] = {}, bx[3] = {};
+
+			for (int i = 0; i < 16; ++i) {
+				float a = weights[indices[i]], b = 1.0f - a;
+
+				aa += a * a;
+				ab += a * b;
+				bb += b * b;
+
+				for (int c = 0; c < 3; ++c) {
+					ax[c] += a * planes[c][i];
+					bx[c] += b * planes[c][i];
+				}
+			}
+
+			float det = aa * bb - ab * ab;
+
+			if (det < 1e-3f)
+				break;
+
+			for (int c = 0; c < 3; ++c) {
+				e0[c] = std::min(std::max((ax[c] * bb - bx[c] * ab) / det,
+					0.0f), 255.0f);
+				e1[c] = std::min(std::max((bx[c] * aa - ax[c] * ab) / det,
+					0.0f), 255.0f);
+			}
+
+			uint16_t n0, n1;
+			uint8_t refined[16];
+			float e = bc1_fit(block, e0, e1, n0, n1, refined);
+
+			if (e >= error)
+				break;
+
+			error = e;
+			c0 = n0;
+			c1 = n1;
+			memcpy(indices, refined, sizeof(refined));
+		}
+
+		uint32_t bits = 0;
+
+		for (int i = 0; i < 16; ++i)
+			bits |= (uint32_t) indices[i] << (2 * i);
+
+		out[0] = (uint8_t) c0;
+		out[1] = (uint8_t) (c0 >> 8);
+		out[2] = (uint8_t) c1;
+		out[3] = (uint8_t) (c1 >> 8);
+
+		for (int k = 0; k < 4; ++k)
+			out[4 + k] = (uint8_t) (bits >> (8 * k));
+	}
+
+	// BC3's alpha half: the block's extremes and the six values between.
+	static ga_inline void encode_bc3_alpha_block(const uint8_t alpha[16],
+		uint8_t* out)
+	{
+		int lo = 255, hi = 0;
+
+		for (int i = 0; i < 16; ++i) {
+			lo = std::min(lo, (int) alpha[i]);
+			hi = std::max(hi, (int) alpha[i]);
+		}
+
+		// hi == lo selects the other mode, but then every index is 0.
+		int palette[8] = { hi, lo };
+
+		for (int k = 2; k < 8; ++k)
+			palette[k] = ((8 - k) * hi + (k - 1) * lo) / 7;
+
+		uint64_t bits = 0;
+
+		for (int i = 0; i < 16; ++i) {
+			int best = 256, code = 0;
+
+			for (int k = 0; k < 8; ++k) {
+				int d = std::abs(palette[k] - (int) alpha[i]);
+
+				if (d < best) {
+					best = d;
+					code = k;
+				}
+			}
+
+			bits |= (uint64_t) code << (3 * i);
+		}
+
+		out[0] = (uint8_t) hi;
+		out[1] = (uint8_t) lo;
+
+		for (int k = 0; k < 6; ++k)
+			out[2 + k] = (uint8_t) (bits >> (8 * k));
+	}
+
+	// Indexed by table, then by a texel's index: +small, +large, -small,
+	// -large.
+	static const int etc1_modifiers[8][4] = {
+		{ 2, 8, -2, -8 },
+		{ 5, 17, -5, -17 },
+		{ 9, 29, -9, -29 },
+		{ 13, 42, -13, -42 },
+		{ 18, 60, -18, -60 },
+		{ 24, 80, -24, -80 },
+		{ 33, 106, -33, -106 },
+		{ 47, 183, -47, -183 }
+	};
+
+	// One half of an ETC1 block: its base color, 4 bits a channel in
+	// individual mode and 5 in differential mode, and the texels' indices.
+	struct etc1_half_t {
+		int base[3];
+		int table;
+		uint8_t indices[8];
+		float error;
+	};
+
+	// Fits a half's 8 texels to each table around base color q, keeping
+	// whatever beats the best so far.
+	static ga_inline void etc1_try_base(const float* r, const float* g,
+		const float* b, const int q[3], bool differential, etc1_half_t& half)
+	{
+		int base[3];
+
+		for (int c = 0; c < 3; ++c)
+			base[c] = expand_bits(q[c], differential ? 5 : 4);
+
+		for (int t = 0; t < 8; ++t) {
+			float palette[4][3];
+
+			for (int k = 0; k < 4; ++k)
+				for (int c = 0; c < 3; ++c)
+					palette[k][c] = (float) std::min(std::max(
+						base[c] + etc1_modifiers[t][k], 0), 255);
+
+			uint8_t indices[8];
+			float error = nearest_of_4(r, g, b, 8, palette, indices);
+
+			if (error < half.error) {
+				half.error = error;
+				half.table = t;
+				memcpy(half.base, q, sizeof(half.base));
+				memcpy(half.indices, indices, sizeof(indices));
+			}
+		}
+	}
+
+	// The best base color for a half, within [lo, hi] per channel.
+	static ga_inline void etc1_fit_half(const float* r, const float* g,
+		const float* b, bool differential, const int lo[3], const int hi[3],
+		atlas_encode_quality_t quality, etc1_half_t& half)
+	{
+		const float* planes[3] = { r, g, b };
+		float levels = differential ? 31.0f : 15.0f;
+		int q[3];
+
+		for (int c = 0; c < 3; ++c) {
+			float mean = 0.0f;
+
+			for (int i = 0; i < 8; ++i)
+				mean += planes[c][i];
+
+			q[c] = std::min(std::max((int) (mean / 8.0f * levels / 255.0f
+				+ 0.5f), lo[c]), hi[c]);
+		}
+
+		half.error = 1e30f;
+		etc1_try_base(r, g, b, q, differential, half);
+
+		if (quality != ATLAS_ENCODE_HIGH)
+			return;
+
+		for (int c = 0; c < 3; ++c) {
+			for (int d = -1; d <= 1; d += 2) {
+				int n[3] = { q[0], q[1], q[2] };
+				n[c] += d;
+
+				if (n[c] >= lo[c] && n[c] <= hi[c])
+					etc1_try_base(r, g, b, n, differential, half);
+			}
+		}
+	}
+
+	static ga_inline void encode_etc1_block(const block_texels_t& block,
+		uint8_t* out, atlas_encode_quality_t quality)
+	{
+		static const int zero[3] = { 0, 0, 0 };
+		static const int max4[3] = { 15, 15, 15 };
+		static const int max5[3] = { 31, 31, 31 };
+
+		float best_error = 1e30f;
+
+		// Unflipped the halves are 2x4 side by side, flipped 4x2 stacked.
+		for (int flip = 0; flip < 2; ++flip) {
+			float r[2][8], g[2][8], b[2][8];
+			uint8_t texel[2][8];
+			int count[2] = { 0, 0 };
+
+			for (int i = 0; i < 16; ++i) {
+				int s = flip ? (i >> 3) : ((i & 3) >> 1);
+				int j = count[s]++;
+
+				r[s][j] = block.r[i];
+				g[s][j] = block.g[i];
+				b[s][j] = block.b[i];
+				texel[s][j] = (uint8_t) i;
+			}
+
+			etc1_half_t individual[2], differential[2];
+
+			etc1_fit_half(r[0], g[0], b[0], false, zero, max4, quality,
+				individual[0]);
+			etc1_fit_half(r[1], g[1], b[1], false, zero, max4, quality,
+				individual[1]);
+
+			// The second base color is a 3 bit delta from the first.
+			etc1_fit_half(r[0], g[0], b[0], true, zero, max5, quality,
+				differential[0]);
+
+			int lo[3], hi[3];
+
+			for (int c = 0; c < 3; ++c) {
+				lo[c] = std::max(differential[0].base[c] - 4, 0);
+				hi[c] = std::min(differential[0].base[c] + 3, 31);
+			}
+
+			etc1_fit_half(r[1], g[1], b[1], true, lo, hi, quality,
+				differential[1]);
+
+			bool diff = differential[0].error + differential[1].error
+				<= individual[0].error + individual[1].error;
+			const etc1_half_t* half = diff ? differential : individual;
+
+			float error = half[0].error + half[1].error;
+
+			if (error >= best_error)
+				continue;
+
+			best_error = error;
+
+			for (int c = 0; c < 3; ++c) {
+				if (diff)
+					out[c] = (uint8_t) ((half[0].base[c] << 3)
+						| ((half[1].base[c] - half[0].base[c]) & 7));
+				else
+					out[c] = (uint8_t) ((half[0].base[c] << 4)
+						| half[1].base[c]);
+			}
+
+			out[3] = (uint8_t) ((half[0].table << 5) | (half[1].table << 2)
+				| (diff ? 2 : 0) | flip);
+
+			// Texels are numbered down the columns; each one's index is
+			// split into a high bit in the upper 16 and a low bit in the
+			// lower 16, all big endian.
+			uint32_t bits = 0;
+
+			for (int s = 0; s < 2; ++s) {
+				for (int j = 0; j < 8; ++j) {
+					int p = (texel[s][j] & 3) * 4 + (texel[s][j] >> 2);
+					uint32_t index = half[s].indices[j];
+
+					bits |= ((index >> 1) << (16 + p)) | ((index & 1) << p);
+				}
+			}
+
+			for (int k = 0; k < 4; ++k)
+				out[4 + k] = (uint8_t) (bits >> (24 - 8 * k));
+		}
+	}
+
+	// Encodes a width x height level of src_format pixels as format, one
+	// row of blocks after another.
+	static ga_inline void encode_blocks(uint8_t* dest, const uint8_t* src,
+		size_t width, size_t height, atlas_pixel_format_t src_format,
+		atlas_pixel_format_t format, atlas_encode_quality_t quality,
+		worker_pool_t& pool)
+	{
+		size_t blocks_x = (width + 3) / 4;
+		size_t blocks_y = (height + 3) / 4;
+		size_t block_bytes = layer_data_bytes(format, 4, 4);
+
+		auto run_row = [&](size_t row) {
+			block_texels_t block;
+
+			for (size_t x = 0; x < blocks_x; ++x) {
+				uint8_t* out = dest + (row * blocks_x + x) * block_bytes;
+
+				load_block(block, src, width, height, x * 4, row * 4,
+					src_format);
+
+				switch (format) {
+				case ATLAS_PIXEL_ETC1:
+					encode_etc1_block(block, out, quality);
+					break;
+				case ATLAS_PIXEL_BC1:
+					encode_bc1_block(block, out, quality);
+					break;
+				default:
+					encode_bc3_alpha_block(block.a, out);
+					encode_bc1_block(block, out + 8, quality);
+					break;
+				}
+			}
+		};
+
+		if (blocks_x * blocks_y >= GL_ATLAS_ENCODE_PARALLEL_BLOCKS)
+			pool.parallel_for(blocks_y, run_row);
+		else
+			for (size_t row = 0; row < blocks_y; ++row)
+				run_row(row);
+	}
+
+	//------------------------------------------------------------------------------------
+	// decode arena
+	//
+	// stb_image mallocs its output and scratch buffers per image and frees them
+	// right after we've copied the pixels out, which turns into allocator
+	// contention once several loader threads decode at once. When this header
+	// provides the stb_image implementation, STBI_MALLOC/REALLOC/FREE are routed
+	// here instead: inside a decode_arena_scope_t, allocations are bumped out of
+	// a per-thread arena that's reset when the scope ends (i.e. after each image),
+	// and outside of one they fall through to the heap.
+	//
+	// That only happens when STB_IMAGE_IMPLEMENTATION is defined before this
+	// header in the same translation unit. With stb_image.c compiled on its
+	// own, stb_image uses the heap, the scopes do nothing, and the stats stay
+	// at zero.
+	//
+	// Every block carries a small header saying where it came from, so freeing
+	// works regardless of scope. Arena frees only reclaim memory if they undo
+	// the most recent allocation, and likewise only the most recent allocation
+	// grows in place; that's the pattern zlib's output buffer follows.
+	//
+	// Anything stb_image returns inside a scope must be consumed before the
+	// scope ends.
+	//------------------------------------------------------------------------------------
+
+	// Arenas larger than this are returned to the heap on reset rather than
+	// held on to by their thread.
+	#ifndef GL_ATLAS_DECODE_ARENA_KEEP
+		#define GL_ATLAS_DECODE_ARENA_KEEP (64u << 20)
+	#endif
+
+	struct decode_arena_stats_t {
+		uint64_t allocs;		// every STBI_MALLOC, and STBI_REALLOCs that had to move
+		uint64_t arena_allocs;	// ... of which were served by an arena
+		uint64_t heap_allocs;	// ... of which went to the heap
+		uint64_t chunk_allocs;	// times an arena had to grow itself from the heap
+		uint64_t resets;		// decode_arena_scope_t's that ended
+
+		uint64_t peak_bytes;	// most arena memory used for a single image
+		uint64_t reserved_bytes;// arena memory currently held by all threads
+	};
+
+	struct decode_arena_counters_t {
+		std::atomic<uint64_t> allocs;
+		std::atomic<uint64_t> arena_allocs;
+		std::atomic<uint64_t> heap_allocs;
+		std::atomic<uint64_t> chunk_allocs;
+		std::atomic<uint64_t> resets;
+		std::atomic<uint64_t> peak_bytes;
+		std::atomic<int64_t> reserved_bytes;
+	};
+
+	static decode_arena_counters_t g_decode_arena_counters;
+
+	class decode_arena_t
+	{
+		static const uint64_t HEAP_MAGIC = 0x70616568616c6721ULL;
+		static const uint64_t ARENA_MAGIC = 0x616e657261616c67ULL;
+
+		struct header_t {
+			uint64_t size;
+			uint64_t magic;
+		};
+
+		static_assert(sizeof(header_t) == 16, "header must keep 16 byte alignment");
+
+		struct chunk_t {
+			uint8_t* base;
+			size_t capacity;
+			size_t used;
+		};
+
+		std::vector<chunk_t> chunks;
+
+		uint8_t* last; // most recent arena block, for in-place free/grow
+
+		size_t footprint; // bytes handed out since the last reset
+
+		bool active;
+
+		static size_t align16(size_t n)
+		{
+			return (n + 15) & ~(size_t) 15;
+		}
+
+		static header_t* header_of(void* p)
+		{
+			return (header_t*) p - 1;
+		}
+
+		static void* heap_alloc(size_t size)
+		{
+			g_decode_arena_counters.heap_allocs++;
+
+			header_t* h = (header_t*) malloc(sizeof(header_t) + size);
+
+			if (!h)
+				return nullptr;
+
+			h->size = size;
+			h->magic = HEAP_MAGIC;
+			return h + 1;
+		}
+
+		void add_chunk(size_t min_capacity)
+		{
+			size_t capacity = std::max(min_capacity, (size_t) 1 << 20);
+
+			if (!chunks.empty())
+				capacity = std::max(capacity, chunks.back().capacity * 2);
+
+			chunk_t c;
+			c.base = (uint8_t*) malloc(capacity);
+			c.capacity = c.base ? capacity : 0;
+			c.used = 0;
+
+			if (!c.base)
+				return;
+
+			chunks.push_back(c);
+
+			g_decode_arena_counters.chunk_allocs++;
+			g_decode_arena_counters.reserved_bytes += (int64_t) capacity;
+		}
+
+		void release_chunks(void)
+		{
+			for (chunk_t& c: chunks) {
+				g_decode_arena_counters.reserved_bytes -= (int64_t) c.capacity;
+				::free(c.base);
+			}
+
+			chunks.clear();
+		}
+
+		void* arena_alloc(size_t size)
+		{
+			size_t need = sizeof(header_t) + align16(size);
+
+			if (chunks.empty() || chunks.back().capacity - chunks.back().used < need)
+				add_chunk(need);
+
+			if (chunks.empty() || chunks.back().capacity - chunks.back().used < need)
+				return heap_alloc(size);
+
+			chunk_t& c = chunks.back();
+
+			header_t* h = (header_t*) (c.base + c.used);
+			h->size = size;
+			h->magic = ARENA_MAGIC;
+
+			c.used += need;
+			footprint += need;
+			last = (uint8_t*) (h + 1);
+
+			g_decode_arena_counters.arena_allocs++;
+
+			return h + 1;
+		}
+
+	public:
+		decode_arena_t(void)
+			:	last(nullptr),
+				footprint(0),
+				active(false)
+		{}
+
+		~decode_arena_t(void)
+		{
+			release_chunks();
+		}
+
+		static decode_arena_t& local(void)
+		{
+			static thread_local decode_arena_t arena;
+			return arena;
+		}
+
+		void begin(void)
+		{
+			active = true;
+		}
+
+		void reset(void)
+		{
+			active = false;
+			last = nullptr;
+
+			uint64_t peak = g_decode_arena_counters.peak_bytes;
+			while (footprint > peak
+				&& !g_decode_arena_counters.peak_bytes.compare_exchange_weak(
+					peak, footprint))
+				;
+
+			g_decode_arena_counters.resets++;
+
+			// An image that spilled into several chunks gets one chunk big
+			// enough for all of it next time.
+			size_t total = 0;
+			for (const chunk_t& c: chunks)
+				total += c.capacity;
+
+			if (chunks.size() > 1 || total > GL_ATLAS_DECODE_ARENA_KEEP) {
+				release_chunks();
+
+				if (total <= GL_ATLAS_DECODE_ARENA_KEEP)
+					add_chunk(total);
+			} else if (!chunks.empty()) {
+				chunks.back().used = 0;
+			}
+
+			footprint = 0;
+		}
+
+		void* alloc(size_t size)
+		{
+			g_decode_arena_counters.allocs++;
+
+			return active ? arena_alloc(size) : heap_alloc(size);
+		}
+
+		// old_size is what stb_image thinks it had; the header knows.
+		void* realloc(void* p, size_t old_size, size_t new_size)
+		{
+			(void) old_size;
+
+			if (!p)
+				return alloc(new_size);
+
+			header_t* h = header_of(p);
+
+			if (h->magic == HEAP_MAGIC && !active) {
+				header_t* n = (header_t*) ::realloc(h, sizeof(header_t) + new_size);
+
+				if (!n)
+					return nullptr;
+
+				n->size = new_size;
+				return n + 1;
+			}
+
+			if (h->magic == ARENA_MAGIC && p == last && active) {
+				chunk_t& c = chunks.back();
+
+				size_t old_need = align16(h->size);
+				size_t new_need = align16(new_size);
+				size_t offset = (uint8_t*) p - c.base;
+
+				if (offset + new_need <= c.capacity) {
+					c.used = offset + new_need;
+					footprint += new_need - std::min(old_need, new_need);
+					h->size = new_size;
+					return p;
+				}
+			}
+
+			void* n = alloc(new_size);
+
+			if (n) {
+				memcpy(n, p, std::min<size_t>(h->size, new_size));
+				free(p);
+			}
+
+			return n;
+		}
+
+		void free(void* p)
+		{
+			if (!p)
+				return;
+
+			header_t* h = header_of(p);
+
+			if (h->magic == HEAP_MAGIC) {
+				h->magic = 0;
+				::free(h);
+				return;
+			}
+
+			assert(h->magic == ARENA_MAGIC);
+
+			if (p == last && active) {
+				chunks.back().used = (uint8_t*) h - chunks.back().base;
+				last = nullptr;
+			}
+		}
+	};
+
+	// Decodes on the current thread use the arena until the scope ends.
+	class decode_arena_scope_t
+	{
+	public:
+		decode_arena_scope_t(void)
+		{
+			decode_arena_t::local().begin();
+		}
+
+		~decode_arena_scope_t(void)
+		{
+			decode_arena_t::local().reset();
+		}
+
+		decode_arena_scope_t(const decode_arena_scope_t&) = delete;
+		decode_arena_scope_t& operator=(const decode_arena_scope_t&) = delete;
+	};
+
+	static ga_inline decode_arena_stats_t decode_arena_stats(void)
+	{
+		decode_arena_stats_t s;
+
+		s.allocs = g_decode_arena_counters.allocs;
+		s.arena_allocs = g_decode_arena_counters.arena_allocs;
+		s.heap_allocs = g_decode_arena_counters.heap_allocs;
+		s.chunk_allocs = g_decode_arena_counters.chunk_allocs;
+		s.resets = g_decode_arena_counters.resets;
+		s.peak_bytes = g_decode_arena_counters.peak_bytes;
+		s.reserved_bytes = (uint64_t) std::max<int64_t>(
+			g_decode_arena_counters.reserved_bytes, 0);
+
+		return s;
+	}
+
+	// reserved_bytes tracks live memory and is left alone.
+	static ga_inline void reset_decode_arena_stats(void)
+	{
+		g_decode_arena_counters.allocs = 0;
+		g_decode_arena_counters.arena_allocs = 0;
+		g_decode_arena_counters.heap_allocs = 0;
+		g_decode_arena_counters.chunk_allocs = 0;
+		g_decode_arena_counters.resets = 0;
+		g_decode_arena_counters.peak_bytes = 0;
+	}
+
+#ifdef GL_ATLAS_DECODE_ARENA_HOOKS
+	static void* decode_arena_malloc(size_t size)
+	{
+		return decode_arena_t::local().alloc(size);
+	}
+
+	static void* decode_arena_realloc(void* p, size_t old_size, size_t new_size)
+	{
+		return decode_arena_t::local().realloc(p, old_size, new_size);
+	}
+
+	static void decode_arena_free(void* p)
+	{
+		decode_arena_t::local().free(p);
+	}
+#endif
+
+	//------------------------------------------------------------------------------------
+	// source file io
+	//------------------------------------------------------------------------------------
+
+	static ga_inline int64_t file_mtime_ns(const struct stat& st)
+	{
+#if defined(__APPLE__)
+		return (int64_t) st.st_mtimespec.tv_sec * 1000000000LL
+			+ st.st_mtimespec.tv_nsec;
+#else
+		return (int64_t) st.st_mtim.tv_sec * 1000000000LL
+			+ st.st_mtim.tv_nsec;
+#endif
+	}
+
+	static ga_inline bool read_file(const std::string& path,
+		std::vector<uint8_t>& out)
+	{
+		FILE* f = fopen(path.c_str(), "rb");
+
+		if (!f)
+			return false;
+
+		fseek(f, 0, SEEK_END);
+		long size = ftell(f);
+		fseek(f, 0, SEEK_SET);
+
+		bool ok = size >= 0;
+
+		if (ok) {
+			out.resize((size_t) size);
+			ok = out.empty() || fread(&out[0], 1, out.size(), f) == out.size();
+		}
+
+		fclose(f);
+		return ok;
+	}
+
+	// Helpers for the small binary files the caches persist. Values are
+	// written in host byte order; a cache isn't meant to move between machines.
+	template <class T>
+	static ga_inline void put(std::vector<uint8_t>& out, const T& v)
+	{
+		const uint8_t* p = (const uint8_t*) &v;
+		out.insert(out.end(), p, p + sizeof(T));
+	}
+
+	template <class T>
+	static ga_inline void put(std::vector<uint8_t>& out, const std::vector<T>& v)
+	{
+		put(out, (uint32_t) v.size());
+
+		const uint8_t* p = (const uint8_t*) v.data();
+		out.insert(out.end(), p, p + v.size() * sizeof(T));
+	}
+
+	template <class T>
+	static ga_inline bool get(const std::vector<uint8_t>& in, size_t& offset,
+		T& v)
+	{
+		if (offset + sizeof(T) > in.size())
+			return false;
+
+		memcpy(&v, &in[offset], sizeof(T));
+		offset += sizeof(T);
+		return true;
+	}
+
+	template <class T>
+	static ga_inline bool get(const std::vector<uint8_t>& in, size_t& offset,
+		std::vector<T>& v)
+	{
+		uint32_t count;
+
+		if (!get(in, offset, count)
+			|| offset + (size_t) count * sizeof(T) > in.size())
+			return false;
+
+		v.resize(count);
+
+		if (count)
+			memcpy(&v[0], &in[offset], (size_t) count * sizeof(T));
+
+		offset += (size_t) count * sizeof(T);
+		return true;
+	}
+
+	static ga_inline bool write_file(const std::string& path,
+		const void* data, size_t size)
+	{
+		FILE* f = fopen(path.c_str(), "wb");
+
+		if (!f)
+			return false;
+
+		bool ok = fwrite(data, 1, size, f) == size;
+		ok = (fclose(f) == 0) && ok;
+
+		return ok;
+	}
+
+	// write_file to a temporary next to path, renamed over it once complete,
+	// so a crash or a full disk never leaves path half written. The temporary
+	// is named after the process and thread, so writers racing on one path
+	// each write their own and the last rename wins with a whole file.
+	static ga_inline bool replace_file(const std::string& path,
+		const void* data, size_t size)
+	{
+		char suffix[48];
+		snprintf(suffix, sizeof(suffix), ".%ld.%zx.tmp", (long) getpid(),
+			std::hash<std::thread::id>()(std::this_thread::get_id()));
+
+		std::string tmp = path + suffix;
+
+		if (!write_file(tmp, data, size) || rename(tmp.c_str(), path.c_str())) {
+			unlink(tmp.c_str());
+			return false;
+		}
+
+		return true;
+	}
+
+	//------------------------------------------------------------------------------------
+	// zip_archive_t
+	//
+	// Read-only view of a zip archive (which is all a Quake-style pk3 is), so
+	// texture sets can be loaded straight from the archive without extracting
+	// them. The file is mapped rather than read, the central directory is parsed
+	// once, and entries are inflated on demand with stb_image's zlib decoder.
+	// Only stored and deflated entries are supported; no zip64, no encryption.
+	//------------------------------------------------------------------------------------
+
+	struct zip_entry_t {
+		std::string name;
+
+		uint32_t dos_time; // date << 16 | time, as stored
+		uint32_t crc32;
+		uint32_t compressed_size;
+		uint32_t uncompressed_size;
+		uint32_t local_header_offset;
+		uint16_t method;
+	};
+
+	class zip_archive_t
+	{
+		const uint8_t* data;
+		size_t size;
+
+		std::vector<zip_entry_t> entries;
+
+		static uint16_t read16(const uint8_t* p)
+		{
+			return (uint16_t) (p[0] | (p[1] << 8));
+		}
+
+		static uint32_t read32(const uint8_t* p)
+		{
+			return (uint32_t) p[0] | ((uint32_t) p[1] << 8)
+				| ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+		}
+
+		bool parse_central_directory(void)
+		{
+			const size_t EOCD_SIZE = 22;
+
+			if (size < EOCD_SIZE)
+				return false;
+
+			// The end of central directory record sits at the very end,
+			// followed by a comment of up to 64k
+			size_t eocd = size - EOCD_SIZE;
+			size_t search_end = size > EOCD_SIZE + 0xFFFF
+				? size - EOCD_SIZE - 0xFFFF
+				: 0;
+
+			while (read32(data + eocd) != 0x06054b50) {
+				if (eocd == search_end)
+					return false;
+				eocd--;
+			}
+
+			uint16_t count = read16(data + eocd + 10);
+			uint32_t cd_size = read32(data + eocd + 12);
+			uint32_t cd_offset = read32(data + eocd + 16);
+
+			if (cd_offset == 0xFFFFFFFF || (size_t) cd_offset + cd_size > size) {
+				gla_logf("Warning: unsupported or corrupt zip central directory");
+				return false;
+			}
+
+			entries.reserve(count);
+
+			const uint8_t* p = data + cd_offset;
+			const uint8_t* end = p + cd_size;
+
+			for (uint16_t i = 0; i < count; ++i) {
+				if (p + 46 > end || read32(p) != 0x02014b50)
+					return false;
+
+				uint16_t flags = read16(p + 8);
+				uint16_t name_len = read16(p + 28);
+				uint16_t extra_len = read16(p + 30);
+				uint16_t comment_len = read16(p + 32);
+
+				if (p + 46 + name_len > end)
+					return false;
+
+				zip_entry_t e;
+				e.method = read16(p + 10);
+				e.dos_time = ((uint32_t) read16(p + 14) << 16) | read16(p + 12);
+				e.crc32 = read32(p + 16);
+				e.compressed_size = read32(p + 20);
+				e.uncompressed_size = read32(p + 24);
+				e.local_header_offset = read32(p + 42);
+				e.name.assign((const char*) p + 46, name_len);
+
+				p += 46 + name_len + extra_len + comment_len;
+
+				bool is_dir = !e.name.empty() && e.name.back() == '/';
+				bool encrypted = (flags & 0x1) != 0;
+
+				if (!is_dir && !encrypted)
+					entries.push_back(std::move(e));
+			}
+
+			return true;
+		}
+
+	public:
+		zip_archive_t(void)
+			:	data(nullptr),
+				size(0)
+		{}
+
+		~zip_archive_t(void)
+		{
+			close();
+		}
+
+		zip_archive_t(const zip_archive_t&) = delete;
+		zip_archive_t& operator=(const zip_archive_t&) = delete;
+
+		bool open(const std::string& path)
+		{
+			close();
+
+			int fd = ::open(path.c_str(), O_RDONLY);
+
+			if (fd < 0)
+				return false;
+
+			struct stat st;
+
+			if (fstat(fd, &st) == 0 && st.st_size > 0) {
+				void* m = mmap(nullptr, (size_t) st.st_size, PROT_READ,
+					MAP_PRIVATE, fd, 0);
+
+				if (m != MAP_FAILED) {
+					data = (const uint8_t*) m;
+					size = (size_t) st.st_size;
+				}
+			}
+
+			// The mapping keeps the file alive on its own
+			::close(fd);
+
+			if (!data)
+				return false;
+
+			if (!parse_central_directory()) {
+				gla_logf("Warning: %s is not a readable zip archive",
+					path.c_str());
+				close();
+				return false;
+			}
+
+			return true;
+		}
+
+		void close(void)
+		{
+			if (data)
+				munmap((void*) data, size);
+
+			data = nullptr;
+			size = 0;
+			entries.clear();
+		}
+
+		const std::vector<zip_entry_t>& files(void) const
+		{
+			return entries;
+		}
+
+		// Safe to call from several threads at once.
+		bool extract(const zip_entry_t& e, std::vector<uint8_t>& out) const
+		{
+			const size_t LOCAL_HEADER_SIZE = 30;
+
+			size_t offset = e.local_header_offset;
+
+			if (offset + LOCAL_HEADER_SIZE > size
+				|| read32(data + offset) != 0x04034b50)
+				return false;
+
+			// Local name/extra lengths needn't match the central directory's
+			offset += LOCAL_HEADER_SIZE + read16(data + offset + 26)
+				+ read16(data + offset + 28);
+
+			if (offset + e.compressed_size > size)
+				return false;
+
+			const uint8_t* src = data + offset;
+
+			out.resize(e.uncompressed_size);
+
+			if (e.method == 0) {
+				if (e.compressed_size != e.uncompressed_size)
+					return false;
+
+				if (!out.empty())
+					memcpy(&out[0], src, out.size());
+
+				return true;
+			}
+
+			if (e.method == 8) {
+				if (out.empty())
+					return true;
+
+				int n = stbi_zlib_decode_noheader_buffer((char*) &out[0],
+					(int) out.size(), (const char*) src, (int) e.compressed_size);
+
+				return n == (int) out.size();
+			}
+
+			return false;
+		}
+	};
+
+	//------------------------------------------------------------------------------------
+	// image_cache_t
+	//
+	// Persistent on-disk cache of decoded, already converted image data, so that
+	// rebuilding an atlas for a directory only decodes the files that changed.
+	//
+	// The index maps a source path to the file's size, mtime and a hash of its
+	// contents. If size and mtime still match, the entry is trusted as is; if they
+	// don't, the file is read and hashed, and only a differing hash forces a decode
+	// (so a touched-but-unchanged file is still a hit).
+	//
+	// Pixels are kept in one blob per content hash under the cache directory,
+	// which lets identical files share a blob and means a rebuild only writes
+	// blobs for files that were actually decoded. Files which failed to decode
+	// are remembered too, with a bpp of 0, so they're skipped without a retry.
+	//
+	// Every entry also records the variant, a signature of the decode options
+	// (see atlas_build_opts_t::decode_variant) its pixels were produced with;
+	// a lookup with different options is a miss, and the variant is part of
+	// the blob name so the same file decoded two ways doesn't share a blob.
+	//------------------------------------------------------------------------------------
+
+	// Bump whenever the layout of converted pixel data or the index changes.
+	#define GL_ATLAS_CACHE_VERSION 4
+
+	struct image_cache_entry_t {
+		uint64_t size;
+		int64_t mtime;
+		uint64_t hash;
+		uint32_t variant;
+
+		uint16_t dim_x;
+		uint16_t dim_y;
+		uint8_t bpp;
+		atlas_pixel_format_t format;
+
+		bool seen; // looked up or stored since loading or the last prune
+	};
+
+	class image_cache_t
+	{
+		std::string dir;
+
+		std::unordered_map<std::string, image_cache_entry_t> entries;
+
+		// Blobs of entries dropped or replaced since the last prune, which
+		// prune deletes unless another entry still uses them.
+		std::vector<std::pair<uint64_t, uint32_t>> released;
+
+		bool dirty;
+
+		mutable std::mutex mutex;
+
+		std::string index_path(void) const
+		{
+			return dir + "index.bin";
+		}
+
+		std::string blob_path(uint64_t hash, uint32_t variant) const
+		{
+			char name[48];
+
+			if (variant)
+				snprintf(name, sizeof(name), "%016llx_%08x.px",
+					(unsigned long long) hash, (unsigned) variant);
+			else
+				snprintf(name, sizeof(name), "%016llx.px",
+					(unsigned long long) hash);
+
+			return dir + name;
+		}
+
+		void load_index(void)
+		{
+			std::vector<uint8_t> in;
+
+			if (!read_file(index_path(), in))
+				return;
+
+			size_t offset = 0;
+			uint32_t magic, version, count;
+
+			if (!get(in, offset, magic) || magic != 0x43414c47 // "GLAC"
+				|| !get(in, offset, version) || version != GL_ATLAS_CACHE_VERSION
+				|| !get(in, offset, count)) {
+				gla_logf("Warning: discarding stale image cache index %s",
+					index_path().c_str());
+				return;
+			}
+
+			for (uint32_t i = 0; i < count; ++i) {
+				uint16_t path_len;
+				image_cache_entry_t e;
+
+				if (!get(in, offset, path_len)
+					|| offset + path_len > in.size())
+					break;
+
+				std::string path((const char*) &in[offset], path_len);
+				offset += path_len;
+
+				if (!get(in, offset, e.size) || !get(in, offset, e.mtime)
+					|| !get(in, offset, e.hash) || !get(in, offset, e.variant)
+					|| !get(in, offset, e.dim_x)
+					|| !get(in, offset, e.dim_y) || !get(in, offset, e.bpp)
+					|| !get(in, offset, e.format))
+					break;
+
+				e.seen = false;
+				entries[path] = e;
+			}
+		}
+
+	public:
+		image_cache_t(std::string cache_dir)
+			:	dir(std::move(cache_dir)),
+				dirty(false)
+		{
+			if (dir.empty() || dir.back() != '/')
+				dir.append(1, '/');
+
+			mkdir(dir.c_str(), 0755);
+
+			load_index();
+		}
+
+		~image_cache_t(void)
+		{
+			save();
+		}
+
+		// All public members may be called from multiple loader threads.
+
+		// Identity check: finds the entry for path if its size and mtime
+		// still match what's on disk.
+		bool find(const std::string& path, uint64_t size, int64_t mtime,
+			uint32_t variant, image_cache_entry_t& out)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+
+			auto it = entries.find(path);
+
+			if (it == entries.end() || it->second.size != size
+				|| it->second.mtime != mtime || it->second.variant != variant)
+				return false;
+
+			it->second.seen = true;
+			out = it->second;
+			return true;
+		}
+
+		// Content check: finds the entry for path if the file's contents
+		// are unchanged, refreshing its size and mtime.
+		bool find_hash(const std::string& path, uint64_t size, int64_t mtime,
+			uint64_t hash, uint32_t variant, image_cache_entry_t& out)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+
+			auto it = entries.find(path);
+
+			if (it == entries.end() || it->second.hash != hash
+				|| it->second.variant != variant)
+				return false;
+
+			it->second.size = size;
+			it->second.mtime = mtime;
+			it->second.seen = true;
+			dirty = true;
+
+			out = it->second;
+			return true;
+		}
+
+		bool load_pixels(const image_cache_entry_t& e,
+			std::vector<uint8_t>& pixels) const
+		{
+			if (!read_file(blob_path(e.hash, e.variant), pixels))
+				return false;
+
+			return pixels.size() ==
+				(size_t) e.dim_x * (size_t) e.dim_y * (size_t) e.bpp;
+		}
+
+		// Pass null pixels to record a file that isn't a loadable image.
+		void store(const std::string& path, uint64_t size, int64_t mtime,
+			uint64_t hash, uint32_t variant, const uint8_t* pixels,
+			uint16_t dim_x, uint16_t dim_y, atlas_pixel_format_t format)
+		{
+			size_t bpp = pixel_format_bytes(format);
+
+			if (pixels) {
+				size_t bytes = (size_t) dim_x * (size_t) dim_y * (size_t) bpp;
+
+				// Identical files share a blob, so other loader threads may
+				// be writing or reading this one right now.
+				if (!replace_file(blob_path(hash, variant), pixels, bytes)) {
+					gla_logf("Warning: could not write image cache blob for %s",
+						path.c_str());
+					return;
+				}
+			}
+
+			image_cache_entry_t e;
+			e.size = size;
+			e.mtime = mtime;
+			e.hash = hash;
+			e.variant = variant;
+			e.dim_x = dim_x;
+			e.dim_y = dim_y;
+			e.bpp = pixels ? (uint8_t) bpp : 0;
+			e.format = format;
+			e.seen = true;
+
+			std::lock_guard<std::mutex> lock(mutex);
+
+			auto it = entries.find(path);
+
+			if (it != entries.end() && it->second.bpp
+				&& (it->second.hash != hash || it->second.variant != variant))
+				released.emplace_back(it->second.hash, it->second.variant);
+
+			entries[path] = e;
+			dirty = true;
+		}
+
+		// Drops the entries directly inside the directory prefix that weren't
+		// seen since the cache was loaded or the directory last pruned, i.e.
+		// files that have been deleted from a rebuilt directory. The others
+		// become unseen again for the next build. Their blobs, and those of entries
+		// replaced since, are deleted once no entry uses them any more.
+		void prune(const std::string& prefix)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+
+			for (auto it = entries.begin(); it != entries.end();) {
+				bool under = it->first.compare(0, prefix.size(), prefix) == 0
+					&& it->first.find('/', prefix.size()) == std::string::npos;
+
+				if (under && !it->second.seen) {
+					if (it->second.bpp)
+						released.emplace_back(it->second.hash,
+							it->second.variant);
+
+					it = entries.erase(it);
+					dirty = true;
+				} else {
+					if (under)
+						it->second.seen = false;
+
+					++it;
+				}
+			}
+
+			if (released.empty())
+				return;
+
+			std::sort(released.begin(), released.end());
+			released.erase(std::unique(released.begin(), released.end()),
+				released.end());
+
+			// Identical files share a blob, so only delete the unused ones.
+			std::vector<bool> used(released.size(), false);
+
+			for (const auto& kv: entries) {
+				const image_cache_entry_t& e = kv.second;
+
+				auto blob = std::lower_bound(released.begin(), released.end(),
+					std::make_pair(e.hash, e.variant));
+
+				if (e.bpp && blob != released.end()
+					&& *blob == std::make_pair(e.hash, e.variant))
+					used[blob - released.begin()] = true;
+			}
+
+			for (size_t i = 0; i < released.size(); ++i) {
+				if (!used[i])
+					unlink(blob_path(released[i].first,
+						released[i].second).c_str());
+			}
+
+			released.clear();
+		}
+
+		void save(void)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+
+			if (!dirty)
+				return;
+
+			std::vector<uint8_t> out;
+
+			put(out, (uint32_t) 0x43414c47);
+			put(out, (uint32_t) GL_ATLAS_CACHE_VERSION);
+			put(out, (uint32_t) entries.size());
+
+			for (const auto& kv: entries) {
+				const image_cache_entry_t& e = kv.second;
+
+				put(out, (uint16_t) kv.first.size());
+				out.insert(out.end(), kv.first.begin(), kv.first.end());
+
+				put(out, e.size);
+				put(out, e.mtime);
+				put(out, e.hash);
+				put(out, e.variant);
+				put(out, e.dim_x);
+				put(out, e.dim_y);
+				put(out, e.bpp);
+				put(out, e.format);
+			}
+
+			if (replace_file(index_path(), &out[0], out.size()))
+				dirty = false;
+			else
+				gla_logf("Warning: could not write image cache index %s",
+					index_path().c_str());
+		}
+	};
+
+	//------------------------------------------------------------------------------------
+	// layout_cache_t
+	//
+	// The packer only looks at image dimensions, pixel formats and its own
+	// settings, never at pixel data, so a finished layout can be reused for any
+	// image set with the same sequence of dimensions and formats. Entries
+	// are keyed by a hash of those and the packer config; the inputs themselves
+	// are kept alongside to rule out collisions. Optionally persisted to a
+	// single file.
+	//------------------------------------------------------------------------------------
+
+	// Bump whenever the packer's output for a given input changes.
+	#define GL_ATLAS_PACKER_VERSION 6
+
+	struct atlas_layout_t {
+		// per layer
+		std::vector<uint16_t> widths;
+		std::vector<uint16_t> heights;
+		std::vector<atlas_pixel_format_t> formats;
+
+		// per image
+		std::vector<uint8_t> layers;
+		std::vector<uint16_t> coords_x;
+		std::vector<uint16_t> coords_y;
+
+		uint16_t gutter;
+		uint8_t cell_align;
+
+		// Every layer the same size, packed for the slices of a texture
+		// array; see pack_atlas_slices.
+		bool uniform;
+
+		atlas_layout_t(void)
+			:	gutter(0),
+				cell_align(1),
+				uniform(false)
+		{}
+	};
+
+	class layout_cache_t
+	{
+		struct entry_t {
+			std::vector<uint16_t> dims_x;
+			std::vector<uint16_t> dims_y;
+			std::vector<atlas_pixel_format_t> formats;
+			int32_t max_dims;
+
+			atlas_layout_t layout;
+		};
+
+		std::string path;
+
+		std::unordered_map<uint64_t, entry_t> entries;
+
+		bool dirty;
+
+		mutable std::mutex mutex;
+
+		void load(void)
+		{
+			std::vector<uint8_t> in;
+
+			if (path.empty() || !read_file(path, in))
+				return;
+
+			size_t offset = 0;
+			uint32_t magic, version, count;
+
+			if (!get(in, offset, magic) || magic != 0x4c4c4c47 // "GLLL"
+				|| !get(in, offset, version) || version != GL_ATLAS_PACKER_VERSION
+				|| !get(in, offset, count)) {
+				gla_logf("Warning: discarding stale layout cache %s",
+					path.c_str());
+				return;
+			}
+
+			for (uint32_t i = 0; i < count; ++i) {
+				uint64_t key;
+				entry_t e;
+
+				if (!get(in, offset, key) || !get(in, offset, e.dims_x)
+					|| !get(in, offset, e.dims_y) || !get(in, offset, e.formats)
+					|| !get(in, offset, e.max_dims)
+					|| !get(in, offset, e.layout.widths)
+					|| !get(in, offset, e.layout.heights)
+					|| !get(in, offset, e.layout.formats)
+					|| !get(in, offset, e.layout.layers)
+					|| !get(in, offset, e.layout.coords_x)
+					|| !get(in, offset, e.layout.coords_y)
+					|| !get(in, offset, e.layout.gutter)
+					|| !get(in, offset, e.layout.cell_align)
+					|| !get(in, offset, e.layout.uniform))
+					break;
+
+				entries[key] = std::move(e);
+			}
+		}
+
+	public:
+		static uint64_t key(const std::vector<uint16_t>& dims_x,
+			const std::vector<uint16_t>& dims_y,
+			const std::vector<atlas_pixel_format_t>& formats, int32_t max_dims,
+			uint16_t gutter, uint8_t cell_align, bool uniform)
+		{
+			uint64_t h = hash_bytes(&max_dims, sizeof(max_dims),
+				GL_ATLAS_PACKER_VERSION);
+
+			h = hash_bytes(&gutter, sizeof(gutter), h);
+			h = hash_bytes(&cell_align, sizeof(cell_align), h);
+			h = hash_bytes(&uniform, sizeof(uniform), h);
+			h = hash_bytes(dims_x.data(), dims_x.size() * sizeof(uint16_t), h);
+			h = hash_bytes(dims_y.data(), dims_y.size() * sizeof(uint16_t), h);
+			h = hash_bytes(formats.data(), formats.size(), h);
+
+			return h;
+		}
+
+		// An empty path keeps the cache in memory only.
+		layout_cache_t(std::string path_ = std::string())
+			:	path(std::move(path_)),
+				dirty(false)
+		{
+			load();
+		}
+
+		~layout_cache_t(void)
+		{
+			save();
+		}
+
+		bool find(const std::vector<uint16_t>& dims_x,
+			const std::vector<uint16_t>& dims_y,
+			const std::vector<atlas_pixel_format_t>& formats, int32_t max_dims,
+			uint16_t gutter, uint8_t cell_align, bool uniform,
+			atlas_layout_t& out) const
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+
+			auto it = entries.find(key(dims_x, dims_y, formats, max_dims,
+				gutter, cell_align, uniform));
+
+			if (it == entries.end() || it->second.max_dims != max_dims
+				|| it->second.dims_x != dims_x || it->second.dims_y != dims_y
+				|| it->second.formats != formats
+				|| it->second.layout.gutter != gutter
+				|| it->second.layout.cell_align != cell_align
+				|| it->second.layout.uniform != uniform)
+				return false;
+
+			out = it->second.layout;
+			return true;
+		}
+
+		void store(const std::vector<uint16_t>& dims_x,
+			const std::vector<uint16_t>& dims_y,
+			const std::vector<atlas_pixel_format_t>& formats, int32_t max_dims,
+			const atlas_layout_t& layout)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+
+			entry_t& e = entries[key(dims_x, dims_y, formats, max_dims,
+				layout.gutter, layout.cell_align, layout.uniform)];
+
+			e.dims_x = dims_x;
+			e.dims_y = dims_y;
+			e.formats = formats;
+			e.max_dims = max_dims;
+			e.layout = layout;
+
+			dirty = true;
+		}
+
+		void save(void)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+
+			if (!dirty || path.empty())
+				return;
+
+			std::vector<uint8_t> out;
+
+			put(out, (uint32_t) 0x4c4c4c47);
+			put(out, (uint32_t) GL_ATLAS_PACKER_VERSION);
+			put(out, (uint32_t) entries.size());
+
+			for (const auto& kv: entries) {
+				const entry_t& e = kv.second;
+
+				put(out, kv.first);
+				put(out, e.dims_x);
+				put(out, e.dims_y);
+				put(out, e.formats);
+				put(out, e.max_dims);
+				put(out, e.layout.widths);
+				put(out, e.layout.heights);
+				put(out, e.layout.formats);
+				put(out, e.layout.layers);
+				put(out, e.layout.coords_x);
+				put(out, e.layout.coords_y);
+				put(out, e.layout.gutter);
+				put(out, e.layout.cell_align);
+				put(out, e.layout.uniform);
+			}
+
+			if (replace_file(path, &out[0], out.size()))
+				dirty = false;
+			else
+				gla_logf("Warning: could not write layout cache %s",
+					path.c_str());
+		}
+	};
+
+	enum atlas_compression_t : uint8_t {
+		ATLAS_COMPRESSION_NONE = 0,
+		ATLAS_COMPRESSION_ETC1,	// GL_OES_compressed_ETC1_RGB8_texture
+		ATLAS_COMPRESSION_BC	// GL_EXT_texture_compression_s3tc
+	};
+
+	struct atlas_build_opts_t {
+		image_cache_t* image_cache; // optional
+		layout_cache_t* layout_cache; // optional
+
+		// Where the layers go, see atlas_backend_t; the GL context by
+		// default, and unset with GL_ATLAS_NO_GL. Has to outlive the atlas.
+		atlas_backend_t* backend;
+
+		// 1 for full size, or 2, 4 or 8 to decode JPEGs at that fraction of
+		// their size (rounded up), in the DCT domain. Other formats are
+		// unaffected.
+		uint8_t jpeg_scale;
+
+		// Keep gray and gray+alpha images at 1 and 2 bytes per pixel, in
+		// layers of their own, rather than expanding them to RGBA.
+		bool narrow_layers;
+
+		// Store images without (or with an all opaque) alpha channel in RGB
+		// layers, at 3 bytes per pixel.
+		bool opaque_layers;
+
+		// ... or at 2, as RGB565. Lossy, so off by default.
+		bool rgb565;
+
+		// Zero the texels of each layer that no image covers. Without it
+		// they're left undefined, which only matters if something samples
+		// across image borders, e.g. linear filtering at an image's edge.
+		bool clear_gaps;
+
+		// Compose each layer in a CPU-side buffer and upload it with one
+		// call, instead of one call per image. Costs a layer-sized buffer
+		// during the upload, but saves the per-call driver overhead when
+		// there are many small images.
+		bool compose_layers;
+
+		// Stream uploads through a ring of pixel unpack buffers, see
+		// upload_staging_t. GLEW path only, since GLES 2 has no PBOs.
+		bool stream_uploads;
+
+		// Pads every image by this many texels on each side, filled by
+		// extruding its edge texels, so filtering at the image's border
+		// doesn't pick up its neighbours. Implies compose_layers.
+		uint16_t gutter;
+
+		// Give layers a full mip chain, box filtered on the CPU, and sample
+		// them trilinearly. Implies compose_layers. A gutter of g keeps
+		// neighbours apart down to about mip level log2(g); below that
+		// images inevitably blend into each other.
+		bool mipmaps;
+
+		// Store layers block compressed, encoded on the CPU (see
+		// encode_blocks): ETC1 takes opaque layers, BC opaque ones as BC1
+		// and alpha ones as BC3. Gray layers stay as they are, and so does
+		// everything if the backend lacks the format. Lossy; aligns
+		// images to 4x4 blocks and implies compose_layers.
+		atlas_compression_t compression;
+		atlas_encode_quality_t encode_quality;
+
+		// Make the layers the slices of one GL_TEXTURE_2D_ARRAY, so a
+		// single bind covers the whole atlas; atlas_image_info_t::slice is
+		// each image's. Slices share a size and a format, so the packer
+		// settles on one slice size for all of them (see pack_atlas_slices),
+		// and images of differing formats are all brought to the narrowest
+		// one that holds them (see unify_atlas_formats). Separate textures
+		// are used instead when that takes more slices than the backend's
+		// max_array_layers. Ignored if the backend has no arrays, which for
+		// GL means without GLEW or GL_ATLAS_GLES3.
+		bool texture_array;
+
+		// Resizes every image by scale, then shrinks whatever still has a
+		// side longer than max_dimension (0 for no limit) to fit, keeping
+		// its aspect ratio. Done on the loader threads, before packing.
+		// JPEGs are first decoded at the smallest fraction of their size
+		// that's still large enough (see jpeg_scale), which is cheaper.
+		float scale;
+		uint16_t max_dimension;
+		atlas_filter_t resize_filter;
+
+		atlas_build_opts_t(void)
+			:	image_cache(nullptr),
+				layout_cache(nullptr),
+				backend(default_atlas_backend()),
+				jpeg_scale(1),
+				narrow_layers(true),
+				opaque_layers(true),
+				rgb565(false),
+				clear_gaps(true),
+				compose_layers(false),
+#ifdef GL_ATLAS_GLEW
+				stream_uploads(true),
+#else
+				stream_uploads(false),
+#endif
+				gutter(0),
+				mipmaps(false),
+				compression(ATLAS_COMPRESSION_NONE),
+				encode_quality(ATLAS_ENCODE_FAST),
+				texture_array(false),
+				scale(1.0f),
+				max_dimension(0),
+				resize_filter(ATLAS_FILTER_TRIANGLE)
+		{}
+
+		bool uses_texture_array(void) const
+		{
+			return texture_array && backend->supports_arrays();
+		}
+
+		// The most slices an array may have, 0 if there won't be one. Asks
+		// the backend, so GL thread only.
+		GLint max_slices(void) const
+		{
+			return uses_texture_array() ? backend->max_array_layers() : 0;
+		}
+
+		// Whether uploads go through upload_staging_t's unpack buffers.
+		bool streams(void) const
+		{
+			return stream_uploads && backend->streams_uploads();
+		}
+
+		// See atlas_t::cell_align.
+		uint8_t cell_align(void) const
+		{
+			return compression != ATLAS_COMPRESSION_NONE ? 4 : 1;
+		}
+
+		bool resizes(void) const
+		{
+			return scale != 1.0f || max_dimension != 0;
+		}
+
+		// The size an image that decodes to dx x dy ends up with.
+		void resized_dims(int dx, int dy, int& rx, int& ry) const
+		{
+			float f = scale;
+			int longest = std::max(dx, dy);
+
+			if (max_dimension && (float) longest * f > (float) max_dimension)
+				f = (float) max_dimension / (float) longest;
+
+			rx = std::min(std::max((int) ((float) dx * f + 0.5f), 1), 0xFFFF);
+			ry = std::min(std::max((int) ((float) dy * f + 0.5f), 1), 0xFFFF);
+		}
+
+		// Signature of the options which affect decoded pixels; 0 for the
+		// defaults.
+		uint32_t decode_variant(void) const
+		{
+			uint32_t v = 0;
+
+			if (jpeg_scale > 1)
+				v |= (uint32_t) jpeg_scale;
+
+			if (!narrow_layers)
+				v |= 0x100;
+
+			if (!opaque_layers)
+				v |= 0x200;
+			else if (rgb565)
+				v |= 0x400;
+
+			if (resizes()) {
+				uint32_t resize[3];
+				memcpy(&resize[0], &scale, sizeof(float));
+				resize[1] = max_dimension;
+				resize[2] = (uint32_t) resize_filter;
+
+				v |= 0x800 | (uint32_t) (hash_bytes(resize, sizeof(resize)) << 12);
+			}
+
+			return v;
+		}
+	};
+
+	// Default options build into the GL context, so with GL_ATLAS_NO_GL the
+	// builds take no default and have to be given a backend.
+	#ifdef GL_ATLAS_NO_GL
+		#define GL_ATLAS_DEFAULT_OPTS
+	#else
+		#define GL_ATLAS_DEFAULT_OPTS = atlas_build_opts_t()
+	#endif
+
+	//------------------------------------------------------------------------------------
+	// gen
+	//------------------------------------------------------------------------------------
+
+	// A non-zero slice packs every layer into a slice x slice square rather
+	// than one as small as its images allow.
+	static ga_inline atlas_layout_t pack_atlas_layers(atlas_t& atlas,
+		GLint max_dims, uint16_t gutter = 0, uint8_t cell_align = 1,
+		GLint slice = 0)
+	{
+		atlas_layout_t layout;
+		layout.gutter = gutter;
+		layout.cell_align = cell_align;
+
+		layout.layers.resize(atlas.num_images, 0xFF);
+
+		uint8_t layer = 0;
+
+		// Images only share layers with images of the same format, so each
+		// format is packed on its own, in enum order.
+		for (uint8_t f = 0; f <= ATLAS_PIXEL_LA8; ++f) {
+			atlas_pixel_format_t format = (atlas_pixel_format_t) f;
+
+			// Basic idea is to keep track of each image
+			// and the layer it belongs to; every image
+			// which has yet to be assigned to a layer
+			// remains in this map after a given iteration
+			image_fill_map_t global_unfill;
+			uint32_t area_accum = 0;
+
+			for (uint16_t i = 0; i < atlas.num_images; ++i) {
+				if (atlas.formats[i] == format) {
+					global_unfill[i];
+					area_accum += (uint32_t) atlas_cell_extent(atlas.dims_x[i],
+						gutter, cell_align) * atlas_cell_extent(atlas.dims_y[i],
+						gutter, cell_align);
+				}
+			}
+
+			while (!global_unfill.empty()) {
+				image_fill_map_t local_fill;
+
+				local_fill.insert(global_unfill.begin(),
+								  global_unfill.end());
+
+				// gen_layer_bsp allocates a fair amount of memory
+				// internally, so it's best to just wrap it in an
+				// inner block since we have plenty of processing to do
+				// afterward
+				{
+					gen_layer_bsp placed(atlas, local_fill,
+						slice ? slice : max_dims, slice ? (uint32_t) slice
+						* (uint32_t) slice : area_accum, gutter, cell_align);
+
+					const glm::ivec3& dims = placed.dims();
+
+					layout.widths.push_back(next_power2(dims[0]));
+					layout.heights.push_back(next_power2(dims[1]));
+					layout.formats.push_back(format);
+				}
+
+				for (auto& image: local_fill) {
+					if (image.second) {
+						layout.layers[image.first] = layer;
+						global_unfill.erase(image.first);
+					}
+				}
+
+				layer++;
+			}
+		}
+
+		// gen_layer_bsp writes origins straight into the atlas
+		layout.coords_x = atlas.coords_x;
+		layout.coords_y = atlas.coords_y;
+
+		return layout;
+	}
+
+	// Packs for the slices of a texture array, which all share one size.
+	// Each power of two slice size from the largest cell's up to max_dims
+	// is tried, and the one needing the fewest texels over all its slices
+	// wins, fewer slices breaking ties.
+	static ga_inline atlas_layout_t pack_atlas_slices(atlas_t& atlas,
+		GLint max_dims, uint16_t gutter = 0, uint8_t cell_align = 1)
+	{
+		uint32_t largest = 1;
+
+		for (uint16_t i = 0; i < atlas.num_images; ++i) {
+			largest = std::max(largest, (uint32_t) std::max(
+				atlas_cell_extent(atlas.dims_x[i], gutter, cell_align),
+				atlas_cell_extent(atlas.dims_y[i], gutter, cell_align)));
+		}
+
+		atlas_layout_t best;
+		uint64_t best_texels = UINT64_MAX;
+
+		for (uint32_t slice = next_power2(largest);
+			slice <= (uint32_t) max_dims; slice *= 2) {
+			atlas_layout_t layout = pack_atlas_layers(atlas, max_dims, gutter,
+				cell_align, (GLint) slice);
+
+			// The slices can still shrink to the largest used extent.
+			uint16_t w = 1, h = 1;
+
+			for (size_t l = 0; l < layout.widths.size(); ++l) {
+				w = std::max(w, layout.widths[l]);
+				h = std::max(h, layout.heights[l]);
+			}
+
+			std::fill(layout.widths.begin(), layout.widths.end(), w);
+			std::fill(layout.heights.begin(), layout.heights.end(), h);
+
+			uint64_t texels = (uint64_t) w * h * layout.widths.size();
+
+			if (texels < best_texels || (texels == best_texels
+				&& layout.widths.size() < best.widths.size())) {
+				best = std::move(layout);
+				best_texels = texels;
+			}
+
+			// Larger slices only add texels once everything fits one.
+			if (best.widths.size() <= 1)
+				break;
+		}
+
+		// Images too large for max_dims leave nothing to choose from.
+		if (best_texels == UINT64_MAX)
+			best = pack_atlas_layers(atlas, max_dims, gutter, cell_align);
+
+		best.uniform = true;
+
+		return best;
+	}
+
+	// Returns true if the layout came from the cache. uniform packs with
+	// pack_atlas_slices.
+	static ga_inline bool find_or_pack_layout(atlas_t& atlas, GLint max_dims,
+		layout_cache_t* layout_cache, atlas_layout_t& layout,
+		uint16_t gutter = 0, uint8_t cell_align = 1, bool uniform = false)
+	{
+		if (layout_cache
+			&& layout_cache->find(atlas.dims_x, atlas.dims_y, atlas.formats,
+				max_dims, gutter, cell_align, uniform, layout))
+			return true;
+
+		layout = uniform ? pack_atlas_slices(atlas, max_dims, gutter, cell_align)
+			: pack_atlas_layers(atlas, max_dims, gutter, cell_align);
+
+		if (layout_cache)
+			layout_cache->store(atlas.dims_x, atlas.dims_y, atlas.formats,
+				max_dims, layout);
+
+		return false;
+	}
+
+	// Brings every image to one format: the one they share, or else RGBA8
+	// if any has alpha, RGB565 if any is, and RGB8 otherwise.
+	static ga_inline void unify_atlas_formats(atlas_t& atlas)
+	{
+		bool mixed = false, alpha = false, rgb565 = false;
+
+		for (uint16_t i = 0; i < atlas.num_images; ++i) {
+			atlas_pixel_format_t f = atlas.formats[i];
+
+			mixed = mixed || f != atlas.formats[0];
+			alpha = alpha || f == ATLAS_PIXEL_RGBA8 || f == ATLAS_PIXEL_LA8;
+			rgb565 = rgb565 || f == ATLAS_PIXEL_RGB565;
+		}
+
+		if (!mixed)
+			return;
+
+		atlas_pixel_format_t target = alpha ? ATLAS_PIXEL_RGBA8
+			: rgb565 ? ATLAS_PIXEL_RGB565 : ATLAS_PIXEL_RGB8;
+
+		default_worker_pool().parallel_for(atlas.num_images, [&](size_t i) {
+			if (atlas.formats[i] == target)
+				return;
+
+			std::vector<uint8_t>& pixels = atlas.buffer_table[i];
+			size_t count = (size_t) atlas.dims_x[i] * atlas.dims_y[i];
+
+			std::vector<uint8_t> rgba(count * 4);
+			expand_to_rgba(&rgba[0], &pixels[0], count, atlas.formats[i]);
+
+			if (target == ATLAS_PIXEL_RGBA8) {
+				pixels.swap(rgba);
+			} else {
+				pixels.resize(count * pixel_format_bytes(target));
+
+				if (target == ATLAS_PIXEL_RGB565)
+					convert_to_rgb565(&pixels[0], &rgba[0], count, 4);
+				else
+					convert_rgba_to_rgb(&pixels[0], &rgba[0], count);
+			}
+
+			atlas.formats[i] = target;
+		});
+	}
+
+	// find_or_pack_layout with the packer settings opts asks for. A texture
+	// array needing more than max_slices (see atlas_build_opts_t::max_slices)
+	// falls back to separate textures; layout.uniform tells which one it
+	// got. Doesn't touch GL, so it can run on a worker thread.
+	static ga_inline bool find_or_pack_layout(atlas_t& atlas, GLint max_dims,
+		GLint max_slices, const atlas_build_opts_t& opts,
+		atlas_layout_t& layout)
+	{
+		assert(opts.backend);
+
+		bool array = opts.uses_texture_array();
+
+		if (array)
+			unify_atlas_formats(atlas);
+
+		bool cached = find_or_pack_layout(atlas, max_dims, opts.layout_cache,
+			layout, opts.gutter, opts.cell_align(), array);
+
+		if (array && layout.widths.size() > (size_t) max_slices) {
+			gla_logf("Warning: %u layers are more than the %d slices a "
+				"texture array can have here, using separate textures",
+				(unsigned) layout.widths.size(), max_slices);
+
+			cached = find_or_pack_layout(atlas, max_dims, opts.layout_cache,
+				layout, opts.gutter, opts.cell_align(), false);
+		}
+
+		return cached;
+	}
+
+	static ga_inline void apply_atlas_layout(atlas_t& atlas,
+		const atlas_layout_t& layout)
+	{
+		for (uint16_t i = 0; i < atlas.num_images; ++i) {
+			atlas.set_layer(i, layout.layers[i]);
+			atlas.write_origins(i, layout.coords_x[i], layout.coords_y[i]);
+		}
+
+		atlas.gutter = layout.gutter;
+		atlas.cell_align = layout.cell_align;
+	}
+
+	// The parts of a layer no image covers, as rectangles. The layer is cut
+	// into bands at every image's top and bottom edge, and each band scanned
+	// left to right; a gap spanning the same columns as one in the band
+	// above just extends that one downwards.
+	static ga_inline void atlas_layer_gaps(const atlas_t& atlas,
+		uint8_t layer, uint16_t width, uint16_t height,
+		std::vector<atlas_rect_t>& gaps)
+	{
+		std::vector<uint16_t> images;
+		std::vector<uint16_t> edges = { 0, height };
+
+		// Images cover their whole cells, gutters included.
+		for (uint16_t i = 0; i < atlas.num_images; ++i) {
+			if (atlas.layers[i] == layer) {
+				images.push_back(i);
+				edges.push_back(atlas.cell_y(i));
+				edges.push_back(atlas.cell_y(i) + atlas.cell_height(i));
+			}
+		}
+
+		std::sort(images.begin(), images.end(), [&](uint16_t a, uint16_t b) {
+			return atlas.coords_x[a] < atlas.coords_x[b];
+		});
+
+		std::sort(edges.begin(), edges.end());
+		edges.erase(std::unique(edges.begin(), edges.end()), edges.end());
+
+		// Both sorted by x.
+		std::vector<atlas_rect_t> open, next;
+
+		for (size_t b = 0; b + 1 < edges.size(); ++b) {
+			uint16_t y0 = edges[b];
+			uint16_t y1 = edges[b + 1];
+			size_t o = 0;
+
+			auto emit = [&](uint16_t x0, uint16_t x1) {
+				while (o < open.size() && open[o].x < x0)
+					gaps.push_back(open[o++]);
+
+				if (o < open.size() && open[o].x == x0
+					&& open[o].w == x1 - x0) {
+					next.push_back(open[o++]);
+					next.back().h += y1 - y0;
+				} else {
+					next.push_back({ x0, y0, (uint16_t) (x1 - x0),
+						(uint16_t) (y1 - y0) });
+				}
+			};
+
+			uint16_t x = 0;
+
+			for (uint16_t i: images) {
+				uint16_t top = atlas.cell_y(i);
+				uint16_t left = atlas.cell_x(i);
+
+				if (top > y0 || top + atlas.cell_height(i) <= y0)
+					continue;
+
+				if (left > x)
+					emit(x, left);
+
+				x = std::max(x, (uint16_t) (left + atlas.cell_width(i)));
+			}
+
+			if (x < width)
+				emit(x, width);
+
+			gaps.insert(gaps.end(), open.begin() + o, open.end());
+
+			open.swap(next);
+			next.clear();
+		}
+
+		gaps.insert(gaps.end(), open.begin(), open.end());
+	}
+
+	// Zeroes what images don't cover in a layer, from one small static strip
+	// of zeros rather than a layer-sized buffer.
+	static ga_inline void clear_atlas_gaps(const atlas_t& atlas, uint8_t layer)
+	{
+		std::vector<atlas_rect_t> gaps;
+		atlas_layer_gaps(atlas, layer, atlas.widths[layer],
+			atlas.heights[layer], gaps);
+
+		for (const atlas_rect_t& r: gaps)
+			atlas.clear_rect(layer, r.x, r.y, r.w, r.h);
+	}
+
+	// Staging copies smaller than this are done on the calling thread alone.
+	#ifndef GL_ATLAS_COMPOSE_PARALLEL_BYTES
+		#define GL_ATLAS_COMPOSE_PARALLEL_BYTES (1u << 20)
+	#endif
+
+	//------------------------------------------------------------------------------------
+	// upload_staging_t
+	//
+	// Where pixel data is gathered before it's handed to glTex(Sub)Image2D.
+	//
+	// By default that's a plain heap buffer, reused between uploads. With
+	// streaming on the GLEW path, it's a ring of pixel unpack buffers instead:
+	// a slot is mapped, filled by the worker pool, unmapped, and the texture
+	// calls then source it by offset while it's still bound, so the driver can
+	// DMA from it asynchronously. A fence after those calls marks when the slot
+	// may be written again; by the time the ring wraps around it has usually
+	// long passed, so filling the next slot overlaps the transfer of the
+	// previous ones instead of stalling on them.
+	//
+	// GL thread only, including destruction.
+	//------------------------------------------------------------------------------------
+
+	#ifndef GL_ATLAS_PBO_SLOTS
+		#define GL_ATLAS_PBO_SLOTS 3
+	#endif
+
+	// Per-image uploads are batched into slots of about this size; a single
+	// image or composed layer that's larger gets a slot grown to fit.
+	#ifndef GL_ATLAS_PBO_SLOT_BYTES
+		#define GL_ATLAS_PBO_SLOT_BYTES (4u << 20)
+	#endif
+
+	class upload_staging_t
+	{
+		std::unique_ptr<uint8_t[]> heap;
+		size_t heap_size;
+
+#ifdef GL_ATLAS_GLEW
+		struct slot_t {
+			GLuint buffer;
+			size_t capacity;
+			GLsync fence;
+		};
+
+		std::vector<slot_t> slots;
+		size_t next;
+
+		gl_state_cache_t* state;
+#endif
+
+		bool pbo;
+
+		atlas_upload_stats_t& counts;
+
+		uint8_t* map_heap(size_t bytes)
+		{
+			if (heap_size < bytes) {
+				heap.reset(new uint8_t[bytes]);
+				heap_size = bytes;
+			}
+
+			return heap.get();
+		}
+
+#ifdef GL_ATLAS_GLEW
+		void wait(slot_t& slot)
+		{
+			if (!slot.fence)
+				return;
+
+			GLenum result;
+			GL_H( result = glClientWaitSync(slot.fence, 0, 0) );
+
+			if (result == GL_TIMEOUT_EXPIRED) {
+				stats().pbo_waits++;
+
+				do {
+					GL_H( result = glClientWaitSync(slot.fence,
+						GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000ull) );
+				} while (result == GL_TIMEOUT_EXPIRED);
+			}
+
+			GL_H( glDeleteSync(slot.fence) );
+			slot.fence = 0;
+		}
+#endif
+
+	public:
+		// Waits, and bytes the texture calls can't see, go into stats. The
+		// unpack buffers are bound through backend's GL state.
+		upload_staging_t(atlas_backend_t& backend, bool stream,
+			atlas_upload_stats_t& stats)
+			:	heap_size(0),
+#ifdef GL_ATLAS_GLEW
+				slots(GL_ATLAS_PBO_SLOTS, slot_t { 0, 0, 0 }),
+				next(0),
+				state(backend.gl_state()),
+				pbo(stream && state),
+#else
+				pbo(false),
+#endif
+				counts(stats)
+		{
+			(void) backend;
+			(void) stream;
+		}
+
+		atlas_upload_stats_t& stats(void)
+		{
+			return counts;
+		}
+
+		~upload_staging_t(void)
+		{
+#ifdef GL_ATLAS_GLEW
+			for (slot_t& slot: slots) {
+				if (slot.fence)
+					GL_H( glDeleteSync(slot.fence) );
+
+				if (slot.buffer)
+					state->delete_buffer(slot.buffer);
+			}
+#endif
+		}
+
+		upload_staging_t(const upload_staging_t&) = delete;
+		upload_staging_t& operator=(const upload_staging_t&) = delete;
+
+		// Whether per-image uploads are worth copying through here too,
+		// rather than straight from the images' own buffers.
+		bool streams(void) const
+		{
+			return pbo;
+		}
+
+		// Room for bytes of pixels, valid until unmap().
+		uint8_t* map(size_t bytes)
+		{
+#ifdef GL_ATLAS_GLEW
+			if (pbo) {
+				slot_t& slot = slots[next];
+
+				if (!slot.buffer)
+					GL_H( glGenBuffers(1, &slot.buffer) );
+
+				state->bind_unpack_buffer(slot.buffer);
+
+				wait(slot);
+
+				if (slot.capacity < bytes) {
+					GL_H( glBufferData(GL_PIXEL_UNPACK_BUFFER, bytes, nullptr,
+						GL_STREAM_DRAW) );
+					slot.capacity = bytes;
+				}
+
+				// The fence already guarantees the GPU is done with the slot.
+				void* p;
+				GL_H( p = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, bytes,
+					GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT
+					| GL_MAP_UNSYNCHRONIZED_BIT) );
+
+				if (p)
+					return (uint8_t*) p;
+
+				gla_logf("Warning: could not map a pixel unpack buffer, "
+					"uploading from client memory instead");
+
+				state->bind_unpack_buffer(0);
+				pbo = false;
+			}
+#endif
+
+			return map_heap(bytes);
+		}
+
+		// Ends writing; returns what the texture calls should take as the
+		// start of the mapped range, which is a null offset for a PBO.
+		const uint8_t* unmap(void)
+		{
+#ifdef GL_ATLAS_GLEW
+			if (pbo) {
+				GLboolean intact;
+				GL_H( intact = glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER) );
+
+				if (!intact)
+					gla_logf("Warning: pixel unpack buffer contents were lost");
+
+				return nullptr;
+			}
+#endif
+
+			return heap.get();
+		}
+
+		// Call once the texture calls sourcing the mapped range are issued.
+		void retire(void)
+		{
+#ifdef GL_ATLAS_GLEW
+			if (pbo) {
+				slot_t& slot = slots[next];
+
+				GL_H( slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0) );
+				state->bind_unpack_buffer(0);
+
+				next = (next + 1) % slots.size();
+			}
+#endif
+		}
+
+		static const void* at(const uint8_t* base, size_t offset)
+		{
+			return (const void*) ((uintptr_t) base + offset);
+		}
+	};
+
+	// Copies every image of a layer into one tightly packed buffer of the
+	// whole layer, row by row, and zeroes the gaps if asked to. Images are
+	// spread over the pool since they never overlap.
+	static ga_inline void compose_atlas_layer(const atlas_t& atlas,
+		const atlas_layout_t& layout, uint8_t layer, bool clear_gaps,
+		uint8_t* dest, worker_pool_t& pool)
+	{
+		size_t bpp = pixel_format_bytes(layout.formats[layer]);
+		size_t pitch = (size_t) layout.widths[layer] * bpp;
+
+		std::vector<uint16_t> images;
+
+		for (uint16_t i = 0; i < atlas.num_images; ++i) {
+			if (layout.layers[i] == layer)
+				images.push_back(i);
+		}
+
+		size_t g = atlas.gutter;
+
+		auto copy_image = [&](size_t n) {
+			uint16_t i = images[n];
+			size_t dx = atlas.dims_x[i], dy = atlas.dims_y[i];
+			size_t row_bytes = dx * bpp;
+			const uint8_t* src = &atlas.buffer_table[i][0];
+			uint8_t* row = dest + (size_t) atlas.coords_y[i] * pitch
+				+ (size_t) atlas.coords_x[i] * bpp;
+
+			for (size_t y = 0; y < dy; ++y)
+				memcpy(row + y * pitch, src + y * row_bytes, row_bytes);
+
+			// Texels past the image's right and bottom edges, gutter
+			// and any alignment slack.
+			size_t cell_w = atlas.cell_width(i);
+			size_t right = cell_w - g - dx;
+			size_t bottom = atlas.cell_height(i) - g - dy;
+
+			if (!g && !right && !bottom)
+				return;
+
+			// Extrude each row's end texels sideways, then the first and
+			// last rows, gutters included, up and down.
+			for (size_t y = 0; y < dy; ++y) {
+				uint8_t* r = row + y * pitch;
+
+				for (size_t k = 1; k <= g; ++k)
+					memcpy(r - k * bpp, r, bpp);
+
+				for (size_t k = 1; k <= right; ++k)
+					memcpy(r + (dx - 1 + k) * bpp, r + (dx - 1) * bpp, bpp);
+			}
+
+			uint8_t* first = row - g * bpp;
+			uint8_t* last = first + (dy - 1) * pitch;
+
+			for (size_t k = 1; k <= g; ++k)
+				memcpy(first - k * pitch, first, cell_w * bpp);
+
+			for (size_t k = 1; k <= bottom; ++k)
+				memcpy(last + k * pitch, last, cell_w * bpp);
+		};
+
+		if (pitch * layout.heights[layer] >= GL_ATLAS_COMPOSE_PARALLEL_BYTES)
+			pool.parallel_for(images.size(), copy_image);
+		else
+			for (size_t n = 0; n < images.size(); ++n)
+				copy_image(n);
+
+		if (!clear_gaps)
+			return;
+
+		std::vector<atlas_rect_t> gaps;
+		atlas_layer_gaps(atlas, layer, layout.widths[layer],
+			layout.heights[layer], gaps);
+
+		for (const atlas_rect_t& r: gaps) {
+			for (uint16_t y = 0; y < r.h; ++y)
+				memset(dest + (size_t) (r.y + y) * pitch + r.x * bpp, 0,
+					r.w * bpp);
+		}
+	}
+
+	// Uploads a layer's images in batches of up to GL_ATLAS_PBO_SLOT_BYTES,
+	// each copied into the staging area by the pool first.
+	static ga_inline void stream_atlas_images(atlas_t& atlas,
+		const atlas_layout_t& layout, uint8_t layer,
+		upload_staging_t& staging, worker_pool_t& pool)
+	{
+		std::vector<uint16_t> batch;
+		std::vector<size_t> offsets;
+		size_t bytes = 0;
+
+		auto flush = [&](void) {
+			if (batch.empty())
+				return;
+
+			uint8_t* dest = staging.map(bytes);
+
+			auto copy_image = [&](size_t n) {
+				const std::vector<uint8_t>& src = atlas.buffer_table[batch[n]];
+				memcpy(dest + offsets[n], &src[0], src.size());
+			};
+
+			if (bytes >= GL_ATLAS_COMPOSE_PARALLEL_BYTES)
+				pool.parallel_for(batch.size(), copy_image);
+			else
+				for (size_t n = 0; n < batch.size(); ++n)
+					copy_image(n);
+
+			const uint8_t* base = staging.unmap();
+
+			for (size_t n = 0; n < batch.size(); ++n)
+				atlas.fill_atlas_image_from(batch[n],
+					upload_staging_t::at(base, offsets[n]));
 
-			static void destroy(node_t* n)
-			{
-				if (n) {
-					destroy(n->left_child);
-					destroy(n->right_child);
-					delete n;
+			staging.retire();
+
+			batch.clear();
+			offsets.clear();
+			bytes = 0;
+		};
+
+		for (uint16_t i = 0; i < atlas.num_images; ++i) {
+			if (layout.layers[i] != layer)
+				continue;
+
+			// 16 byte aligned, which covers any pixel type's alignment.
+			size_t size = (atlas.buffer_table[i].size() + 15) & ~(size_t) 15;
+
+			if (!batch.empty() && bytes + size > GL_ATLAS_PBO_SLOT_BYTES)
+				flush();
+
+			batch.push_back(i);
+			offsets.push_back(bytes);
+			bytes += size;
+		}
+
+		flush();
+	}
+
+	// The format a layer of images in format is stored in by the backend.
+	static ga_inline atlas_pixel_format_t layer_storage_format(
+		atlas_pixel_format_t format, atlas_compression_t compression,
+		atlas_backend_t& backend)
+	{
+		static const char* names[] = { "ETC1", "BC1", "BC3" };
+
+		atlas_pixel_format_t stored = format;
+
+		if (format == ATLAS_PIXEL_RGB8 || format == ATLAS_PIXEL_RGB565) {
+			if (compression == ATLAS_COMPRESSION_ETC1) {
+				stored = ATLAS_PIXEL_ETC1;
+			} else if (compression == ATLAS_COMPRESSION_BC) {
+				stored = ATLAS_PIXEL_BC1;
+			}
+		} else if (format == ATLAS_PIXEL_RGBA8
+			&& compression == ATLAS_COMPRESSION_BC) {
+			stored = ATLAS_PIXEL_BC3;
+		}
+
+		if (stored != format && !backend.supports_format(stored)) {
+			gla_logf("Warning: %s not supported, layer left uncompressed",
+				names[stored - ATLAS_PIXEL_ETC1]);
+			return format;
+		}
+
+		return stored;
+	}
+
+	// Uploads a composed level of a layer, as level 0 creating the layer,
+	// block compressing it on the way if it's stored that way.
+	static ga_inline void upload_layer_level(atlas_t& atlas, uint8_t layer,
+		const uint8_t* pixels, size_t width, size_t height,
+		atlas_pixel_format_t format, atlas_pixel_format_t stored, GLint level,
+		bool mipmapped, const atlas_build_opts_t& opts,
+		upload_staging_t& staging)
+	{
+		size_t bytes = layer_data_bytes(stored, width, height);
+		const void* source = pixels;
+
+		if (stored != format || staging.streams()) {
+			uint8_t* dest = staging.map(bytes);
+
+			if (stored != format)
+				encode_blocks(dest, pixels, width, height, format, stored,
+					opts.encode_quality, default_worker_pool());
+			else
+				memcpy(dest, pixels, bytes);
+
+			source = upload_staging_t::at(staging.unmap(), 0);
+
+			// The texture calls can't tell a PBO offset of 0 from no data.
+			if (!source)
+				staging.stats().bytes += bytes;
+		}
+
+		if (level == 0)
+			atlas.push_layer((uint16_t) width, (uint16_t) height, stored,
+				source, mipmapped);
+		else
+			atlas.write_level(layer, level, width, height, stored, source);
+
+		staging.retire();
+	}
+
+	// Composes a layer on the CPU and uploads it with its full mip chain,
+	// level by level.
+	static ga_inline void upload_mipmapped_layer(atlas_t& atlas,
+		const atlas_layout_t& layout, uint8_t layer,
+		const atlas_build_opts_t& opts, atlas_pixel_format_t stored,
+		upload_staging_t& staging)
+	{
+		atlas_pixel_format_t format = layout.formats[layer];
+		size_t bpp = pixel_format_bytes(format);
+
+		std::vector<size_t> offsets;
+		size_t total = 0;
+
+		for (size_t w = layout.widths[layer], h = layout.heights[layer];;
+			w = std::max(w / 2, (size_t) 1), h = std::max(h / 2, (size_t) 1)) {
+			offsets.push_back(total);
+			total += w * h * bpp;
+
+			if (w == 1 && h == 1)
+				break;
+		}
+
+		// Every level, back to back, since each is made from the last.
+		std::unique_ptr<uint8_t[]> chain(new uint8_t[total]);
+		worker_pool_t& pool = default_worker_pool();
+
+		compose_atlas_layer(atlas, layout, layer, opts.clear_gaps, chain.get(),
+			pool);
+
+		size_t w = layout.widths[layer], h = layout.heights[layer];
+
+		for (size_t level = 0; level < offsets.size(); ++level) {
+			if (level > 0) {
+				downsample_level(&chain[offsets[level]], &chain[offsets[level - 1]],
+					w, h, format, pool, GL_ATLAS_COMPOSE_PARALLEL_BYTES);
+
+				w = std::max(w / 2, (size_t) 1);
+				h = std::max(h / 2, (size_t) 1);
+			}
+
+			upload_layer_level(atlas, layer, &chain[offsets[level]], w, h,
+				format, stored, (GLint) level, true, opts, staging);
+		}
+	}
+
+	// Layers must be uploaded in order, since push_layer appends.
+	//
+	// Images either go up one glTexSubImage2D each, or with
+	// opts.compose_layers are composed into a staging buffer first and the
+	// whole layer is created from it with a single glTexImage2D. Block
+	// compressed layers are composed on the heap, then encoded into the
+	// staging buffer.
+	static ga_inline void upload_atlas_layer(atlas_t& atlas,
+		const atlas_layout_t& layout, uint8_t layer,
+		const atlas_build_opts_t& opts, upload_staging_t& staging)
+	{
+		assert(layer == atlas.layer_tex_handles.size());
+		assert(opts.backend);
+
+		if (layer == 0)
+			atlas.backend = opts.backend;
+
+		atlas_backend_t& backend = *atlas.backend;
+
+		atlas_pixel_format_t format = layout.formats[layer];
+		atlas_pixel_format_t stored = layer_storage_format(format,
+			opts.compression, backend);
+
+		backend.begin_layer(format);
+
+		if (layer == 0 && layout.uniform) {
+			GLint levels = 1;
+
+			for (size_t d = std::max(layout.widths[0], layout.heights[0]);
+				opts.mipmaps && d > 1; d /= 2)
+				levels++;
+
+			atlas.alloc_texture_array(layout.widths[0], layout.heights[0],
+				layout.widths.size(), stored, levels);
+		}
+
+		if (opts.mipmaps) {
+			upload_mipmapped_layer(atlas, layout, layer, opts, stored, staging);
+		} else if (stored != format) {
+			std::unique_ptr<uint8_t[]> pixels(new uint8_t[(size_t)
+				layout.widths[layer] * layout.heights[layer]
+				* pixel_format_bytes(format)]);
+
+			compose_atlas_layer(atlas, layout, layer, opts.clear_gaps,
+				pixels.get(), default_worker_pool());
+
+			upload_layer_level(atlas, layer, pixels.get(), layout.widths[layer],
+				layout.heights[layer], format, stored, 0, false, opts,
+				staging);
+		} else if (opts.compose_layers || layout.gutter
+			|| layout.cell_align > 1) {
+			size_t bytes = (size_t) layout.widths[layer]
+				* layout.heights[layer] * pixel_format_bytes(format);
+
+			compose_atlas_layer(atlas, layout, layer, opts.clear_gaps,
+				staging.map(bytes), default_worker_pool());
+
+			const uint8_t* base = staging.unmap();
+
+			atlas.push_layer(layout.widths[layer], layout.heights[layer],
+				format, upload_staging_t::at(base, 0));
+
+			// push_layer can't tell a PBO offset of 0 from no data.
+			if (!base)
+				staging.stats().bytes += bytes;
+
+			staging.retire();
+		} else {
+			atlas.push_layer(layout.widths[layer], layout.heights[layer],
+				format);
+
+			if (staging.streams()) {
+				stream_atlas_images(atlas, layout, layer, staging,
+					default_worker_pool());
+			} else {
+				for (uint16_t i = 0; i < atlas.num_images; ++i) {
+					if (layout.layers[i] == layer)
+						atlas.fill_atlas_image(i);
 				}
 			}
+
+			if (opts.clear_gaps)
+				clear_atlas_gaps(atlas, layer);
+		}
+
+		backend.end_layer();
+	}
+
+	static ga_inline atlas_upload_stats_t upload_atlas_layer(atlas_t& atlas,
+		const atlas_layout_t& layout, uint8_t layer,
+		const atlas_build_opts_t& opts GL_ATLAS_DEFAULT_OPTS)
+	{
+		assert(opts.backend);
+
+		atlas_upload_stats_t stats = atlas_upload_stats_t();
+		upload_stats_scope_t counting(*opts.backend, &stats);
+
+		upload_staging_t staging(*opts.backend, opts.streams(), stats);
+		upload_atlas_layer(atlas, layout, layer, opts, staging);
+
+		return stats;
+	}
+
+	static ga_inline void log_atlas_upload_stats(const atlas_upload_stats_t& st)
+	{
+		gla_logf("Uploads: %llu layers, %llu glTexImage2D, %llu glTexSubImage2D, "
+			"%llu bytes, %llu PBO waits",
+			(unsigned long long) st.layers,
+			(unsigned long long) st.tex_image_calls,
+			(unsigned long long) st.tex_sub_image_calls,
+			(unsigned long long) st.bytes,
+			(unsigned long long) st.pbo_waits);
+
+#ifndef GL_ATLAS_NO_GL
+		gla_logf("GL state: %llu calls, %llu skipped as redundant",
+			(unsigned long long) st.state_calls,
+			(unsigned long long) st.state_skipped);
+#endif
+	}
+
+	// Returns what the upload took, which is also logged.
+	static ga_inline atlas_upload_stats_t gen_atlas_layers(atlas_t& atlas,
+		const atlas_build_opts_t& opts)
+	{
+		assert(opts.backend);
+
+		GLint max_dims = opts.backend->max_layer_size();
+
+		atlas_layout_t layout;
+		bool cached = find_or_pack_layout(atlas, max_dims, opts.max_slices(),
+			opts, layout);
+
+		apply_atlas_layout(atlas, layout);
+
+		atlas_upload_stats_t stats = atlas_upload_stats_t();
+		upload_stats_scope_t counting(*opts.backend, &stats);
+
+		upload_staging_t staging(*opts.backend, opts.streams(), stats);
+
+		for (uint8_t layer = 0; layer < layout.widths.size(); ++layer)
+			upload_atlas_layer(atlas, layout, layer, opts, staging);
+
+		gla_logf("Total Images: %lu\nArea Accum: %lu\nLayout: %s",
+			 atlas.num_images, atlas.area_accum,
+			 cached ? "cached" : "packed");
+
+		log_atlas_upload_stats(stats);
+
+		return stats;
+	}
+
+#ifndef GL_ATLAS_NO_GL
+	static ga_inline atlas_upload_stats_t gen_atlas_layers(atlas_t& atlas,
+		layout_cache_t* layout_cache = nullptr)
+	{
+		atlas_build_opts_t opts;
+		opts.layout_cache = layout_cache;
+
+		return gen_atlas_layers(atlas, opts);
+	}
+#endif
+
+	// The format an image with bpp bytes per pixel is stored in. Only
+	// RGBA images that are fully opaque lose their alpha channel.
+	static ga_inline atlas_pixel_format_t atlas_image_format(
+		const uint8_t* pixels, int dx, int dy, int bpp,
+		bool opaque_layers = true, bool rgb565 = false)
+	{
+		if (bpp == 1)
+			return ATLAS_PIXEL_L8;
+
+		if (bpp == 2)
+			return ATLAS_PIXEL_LA8;
+
+		if (!opaque_layers || (bpp != 3 && bpp != 4) || (bpp == 4
+			&& !is_opaque_rgba(pixels, (size_t) dx * (size_t) dy)))
+			return ATLAS_PIXEL_RGBA8;
+
+		return rgb565 ? ATLAS_PIXEL_RGB565 : ATLAS_PIXEL_RGB8;
+	}
+
+	// Converts count pixels of bpp bytes each to format, which has to be
+	// RGBA8 or atlas_image_format's pick for them.
+	static ga_inline void convert_atlas_pixels(uint8_t* dest,
+		atlas_pixel_format_t format, const uint8_t* src, size_t count, int bpp)
+	{
+		if (format == ATLAS_PIXEL_RGB565) {
+			convert_to_rgb565(dest, src, count, bpp);
+		} else if (format == ATLAS_PIXEL_RGBA8 && bpp == 3) {
+			convert_rgb_to_rgba(dest, src, count, 1);
+		} else if (format == ATLAS_PIXEL_RGB8 && bpp == 4) {
+			convert_rgba_to_rgb(dest, src, count);
+		} else if ((size_t) bpp == pixel_format_bytes(format)) {
+			memcpy(dest, src, count * bpp);
+		}
+	}
+
+	// Converts a decoded image to the layout the atlas stores (see
+	// atlas_image_format), with the rows in OpenGL's bottom-up order.
+	static ga_inline std::vector<uint8_t> convert_atlas_image(
+		const uint8_t* buffer, int dx, int dy, int bpp,
+		atlas_pixel_format_t& format)
+	{
+		format = atlas_image_format(buffer, dx, dy, bpp);
+
+		size_t row_bytes = (size_t) dx * pixel_format_bytes(format);
+
+		std::vector<uint8_t> image_data(row_bytes * dy, 0);
+
+		convert_atlas_pixels(&image_data[0], format, buffer,
+			(size_t) dx * (size_t) dy, bpp);
+
+		// Reverse image rows, since stb_image treats
+		// origin as upper left and OpenGL doesn't.
+		flip_rows(&image_data[0], row_bytes, dy);
+
+		return image_data;
+	}
+
+	// image_data must already have gone through convert_atlas_image.
+	static ga_inline void push_converted_atlas_image(atlas_t& atlas,
+		std::vector<uint8_t> image_data, int dx, int dy,
+		atlas_pixel_format_t format)
+	{
+		atlas.area_accum += dx * dy;
+
+		atlas.dims_x.push_back(dx);
+		atlas.dims_y.push_back(dy);
+		atlas.formats.push_back(format);
+
+		atlas.buffer_table.push_back(std::move(image_data));
+
+		atlas.num_images++;
+	}
+
+	static ga_inline void push_atlas_image(atlas_t& atlas,
+		uint8_t* buffer, int dx, int dy, int bpp)
+	{
+		if (bpp < 1 || bpp > DESIRED_BPP) {
+			gla_logf("ERROR: received image of would-be index %i" \
+			"that does not contain a supported bytes per pixel count."\
+			" Dimensions: %i x %i. BPP received: %i",
+			(int) atlas.num_images, dx, dy, bpp);
+		}
+
+		atlas_pixel_format_t format;
+		std::vector<uint8_t> image_data =
+			convert_atlas_image(buffer, dx, dy, bpp, format);
+
+		push_converted_atlas_image(atlas, std::move(image_data), dx, dy,
+			format);
+	}
+
+	// Produces the converted pixels for a single source file, going through
+	// the image cache when there is one. Returns false if the file isn't
+	// an image we can use.
+	struct image_source_t {
+		std::string name;	// what ends up in atlas_t::filenames
+		std::string path;	// unique identity, used for the image cache and logging
+
+		uint64_t size;
+		int64_t mtime;
+
+		int format;	// STBI_format_* guessed from the name while scanning
+
+		std::function<bool(std::vector<uint8_t>&)> read;
+	};
+
+	static ga_inline int image_format_from_name(const std::string& name)
+	{
+		static const struct {
+			const char* ext;
+			int format;
+		} exts[] = {
+			{ "jpg", STBI_format_jpeg }, { "jpeg", STBI_format_jpeg },
+			{ "png", STBI_format_png }, { "bmp", STBI_format_bmp },
+			{ "gif", STBI_format_gif }, { "psd", STBI_format_psd },
+			{ "pic", STBI_format_pic }, { "ppm", STBI_format_pnm },
+			{ "pgm", STBI_format_pnm }, { "hdr", STBI_format_hdr },
+			{ "tga", STBI_format_tga }
 		};
 
-		node_t* insert_node(node_t* node, uint16_t image)
-		{
-			if (node->region) {
-				node_t* n = insert_node(node->left_child, image);
+		size_t dot = name.rfind('.');
 
-				if (n) {
-					node->left_child = n;
-					return node;
-				}
+		if (dot == std::string::npos)
+			return STBI_format_unknown;
 
-				n = insert_node(node->right_child, image);
+		std::string ext = name.substr(dot + 1);
+		std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
 
-				if (n) {
-					node->right_child = n;
-					return node;
+		for (const auto& e: exts) {
+			if (ext == e.ext)
+				return e.format;
+		}
+
+		return STBI_format_unknown;
+	}
+
+	// The signature decides, since names can lie; TGAs don't have one, so
+	// for those the name has to do. An empty file is never an image, whatever
+	// it's called.
+	static ga_inline int detect_image_format(const image_source_t& src,
+		const std::vector<uint8_t>& contents)
+	{
+		if (contents.empty())
+			return STBI_format_unknown;
+
+		int format = stbi_detect_format(contents.data(), (int) contents.size());
+
+		if (format == STBI_format_unknown && src.format == STBI_format_tga)
+			format = STBI_format_tga;
+
+		return format;
+	}
+
+	static ga_inline bool load_source_image(const image_source_t& src,
+		const atlas_build_opts_t& opts, std::vector<uint8_t>& image_data,
+		int& dx, int& dy, atlas_pixel_format_t& format)
+	{
+		const std::string& filepath = src.path;
+		uint64_t size = src.size;
+		int64_t mtime = src.mtime;
+
+		image_cache_t* cache = opts.image_cache;
+		uint32_t variant = opts.decode_variant();
+
+		image_cache_entry_t cached;
+
+		if (cache && cache->find(filepath, size, mtime, variant, cached)
+			&& (!cached.bpp || cache->load_pixels(cached, image_data))) {
+			dx = cached.dim_x;
+			dy = cached.dim_y;
+			format = cached.format;
+			return cached.bpp != 0;
+		}
+
+		std::vector<uint8_t> contents;
+
+		if (!src.read(contents)) {
+			gla_logf("Warning: could not open %s. Skipping.", filepath.c_str());
+			return false;
+		}
+
+		uint64_t hash = hash_bytes(contents.data(), contents.size());
+
+		if (cache && cache->find_hash(filepath, size, mtime, hash, variant, cached)
+			&& (!cached.bpp || cache->load_pixels(cached, image_data))) {
+			dx = cached.dim_x;
+			dy = cached.dim_y;
+			format = cached.format;
+			return cached.bpp != 0;
+		}
+
+		// Files that aren't any format we know never reach stb_image, and
+		// the rest go straight to their format's loader.
+		int file_format = detect_image_format(src, contents);
+
+		if (file_format == STBI_format_unknown) {
+			gla_logf("Warning: %s is not a known image format. Skipping.",
+				filepath.c_str());
+
+			if (cache)
+				cache->store(filepath, size, mtime, hash, variant, nullptr,
+					0, 0, ATLAS_PIXEL_RGBA8);
+
+			return false;
+		}
+
+		// Everything stb_image allocates for this image, including its
+		// result, is released in one go when this goes out of scope.
+		decode_arena_scope_t arena_scope;
+
+		// Have stb_image produce the atlas layout (see convert_atlas_image)
+		// itself, so e.g. TGAs are swizzled, expanded and put in bottom-up
+		// order in a single pass.
+		stbi_load_params params;
+		memset(&params, 0, sizeof(params));
+		params.jpeg_scale = opts.jpeg_scale;
+		params.flip_vertically = 1;
+		params.format = file_format;
+
+		// Sources whose channels we'd keep are decoded as they are. The
+		// header can undersell the result (a PNG with a tRNS chunk gains an
+		// alpha channel), so the channel count that counts is the decoded one.
+		// Only the detected format's header is parsed for it.
+		int req_comp = DESIRED_BPP;
+		int info_x, info_y, info_comp;
+
+		bool info = stbi_info_from_memory_ex(contents.data(),
+			(int) contents.size(), &info_x, &info_y, &info_comp,
+			file_format) != 0;
+
+		if (info && (info_comp <= 2 ? opts.narrow_layers : opts.opaque_layers))
+			req_comp = 0;
+
+		// The resize target is always relative to the size opts.jpeg_scale
+		// gives; a JPEG may then be decoded smaller than that, as long as
+		// it stays at least twice the target, leaving the last step to the
+		// resampling filter rather than the DCT's crude block reduction.
+		int target_x = 0, target_y = 0;
+
+		if (opts.resizes() && info && file_format == STBI_format_jpeg) {
+			int js = std::max((int) opts.jpeg_scale, 1);
+
+			opts.resized_dims((info_x + js - 1) / js, (info_y + js - 1) / js,
+				target_x, target_y);
+
+			for (int s = 8; s > js; s >>= 1) {
+				if ((info_x + s - 1) / s >= target_x * 2
+					&& (info_y + s - 1) / s >= target_y * 2) {
+					params.jpeg_scale = s;
+					break;
 				}
-			} else {
+			}
+		}
+
+		int bpp = 0;
+		stbi_uc* stbi_buffer = stbi_load_from_memory_ex(contents.data(),
+			(int) contents.size(), &dx, &dy, &bpp, req_comp, &params);
+
+		if (!stbi_buffer) {
+			gla_logf("Warning: could not open %s. Skipping.", filepath.c_str());
+		} else if (bpp < 1 || bpp > DESIRED_BPP) {
+			gla_logf("Warning: found invalid bpp value of %i for %s. Skipping.",
+				 bpp, filepath.c_str());
+
+			stbi_image_free(stbi_buffer);
+			stbi_buffer = nullptr;
+		}
+
+		if (!stbi_buffer) {
+			if (cache)
+				cache->store(filepath, size, mtime, hash, variant, nullptr,
+					0, 0, ATLAS_PIXEL_RGBA8);
+
+			return false;
+		}
+
+		int decoded_bpp = req_comp ? req_comp : bpp;
+
+		const uint8_t* pixels = stbi_buffer;
+		std::vector<uint8_t> resized;
+
+		if (opts.resizes()) {
+			if (!target_x)
+				opts.resized_dims(dx, dy, target_x, target_y);
+
+			if (target_x != dx || target_y != dy) {
+				resized.resize((size_t) target_x * (size_t) target_y
+					* decoded_bpp);
+
+				resize_image(&resized[0], target_x, target_y, stbi_buffer,
+					dx, dy, decoded_bpp, opts.resize_filter);
+
+				pixels = &resized[0];
+				dx = target_x;
+				dy = target_y;
+			}
+		}
+
+		size_t count = (size_t) dx * (size_t) dy;
+
+		format = atlas_image_format(pixels, dx, dy, decoded_bpp,
+			opts.opaque_layers, opts.rgb565);
+
+		if (pixel_format_bytes(format) == (size_t) decoded_bpp) {
+			image_data.assign(pixels, pixels + count * decoded_bpp);
+		} else {
+			image_data.resize(count * pixel_format_bytes(format));
+			convert_atlas_pixels(&image_data[0], format, pixels, count,
+				decoded_bpp);
+		}
+
+		stbi_image_free(stbi_buffer);
+
+		if (cache)
+			cache->store(filepath, size, mtime, hash, variant, &image_data[0],
+				(uint16_t) dx, (uint16_t) dy, format);
+
+		return true;
+	}
+
+	// Decodes every source on the pool and pushes the ones that loaded,
+	// in source order, independent of which worker finished first.
+	static ga_inline void load_image_sources(
+		atlas_t& atlas,
+		const std::vector<image_source_t>& sources,
+		const atlas_build_opts_t& opts,
+		worker_pool_t& pool)
+	{
+		struct result_t {
+			std::vector<uint8_t> image_data;
+			int dx, dy;
+			atlas_pixel_format_t format;
+			bool loaded;
+		};
+
+		std::vector<result_t> results(sources.size());
+
+		install_stbi_parallel_for();
+
+		pool.parallel_for(sources.size(), [&](size_t i) {
+			result_t& r = results[i];
+
+			r.loaded = load_source_image(sources[i], opts,
+				r.image_data, r.dx, r.dy, r.format);
+		});
+
+		for (size_t i = 0; i < sources.size(); ++i) {
+			if (!results[i].loaded)
+				continue;
+
+			atlas.filenames.push_back(sources[i].name);
+
+			push_converted_atlas_image(atlas, std::move(results[i].image_data),
+				results[i].dx, results[i].dy, results[i].format);
+		}
+	}
+
+	// The CPU half of make_atlas_from_dir: scans dirpath and fills atlas
+	// with the converted images, decoding on the given pool. Doesn't touch GL
+	// unless atlas already owns textures. Returns false if the directory
+	// couldn't be opened, in which case atlas is left alone.
+	static ga_inline bool load_atlas_images(
+		atlas_t& atlas,
+		std::string dirpath,
+		const atlas_build_opts_t& opts,
+		worker_pool_t& pool)
+	{
+		if (dirpath.empty() || dirpath.back() != '/')
+			dirpath.append(1, '/');
+
+		DIR* dir = opendir(dirpath.c_str());
+		struct dirent* ent = NULL;
+
+		if (!dir) {
+			gla_logf("Could not open %s", dirpath.c_str());
+			return false;
+		}
+
+		assert(DESIRED_BPP == 4
+			&& "Code is only meant to work with textures using desired bpp of 4!");
 
-				if (node->image >= 0)
-					return nullptr;
+		atlas.free_memory();
 
-				glm::ivec2 image_dims(atlas.dims_x[image], atlas.dims_y[image]);
+		std::vector<image_source_t> sources;
 
-				if (node->dims.x < image_dims.x || node->dims.y < image_dims.y)
-					return nullptr;
+		while (!!(ent = readdir(dir))) {
+			image_source_t src;
+			src.name = ent->d_name;
+			src.path = dirpath + src.name;
 
-				if (node->dims.x == image_dims.x
-					&& node->dims.y == image_dims.y) {
+			struct stat st;
+			if (stat(src.path.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+				continue;
 
-					node->image = image;
+			src.size = (uint64_t) st.st_size;
+			src.mtime = file_mtime_ns(st);
+			src.format = image_format_from_name(src.name);
 
-					if ((node->origin.x + image_dims.x) > layer_dims.x)
-						layer_dims.x = node->origin.x + image_dims.x;
+			std::string path = src.path;
+			src.read = [path](std::vector<uint8_t>& out) -> bool {
+				return read_file(path, out);
+			};
 
-					if ((node->origin.y + image_dims.y) > layer_dims.y)
-						layer_dims.y = node->origin.y + image_dims.y;
+			sources.push_back(std::move(src));
+		}
 
-					atlas.write_origins(node->image, node->origin.x,
-						node->origin.y);
+		closedir(dir);
 
-					return node;
-				}
+		load_image_sources(atlas, sources, opts, pool);
 
-				node->region = true;
+		if (opts.image_cache) {
+			opts.image_cache->prune(dirpath);
+			opts.image_cache->save();
+		}
 
-				uint16_t dx = node->dims.x - image_dims.x;
-				uint16_t dy = node->dims.y - image_dims.y;
+		return true;
+	}
 
-				node->left_child = new node_t();
-				node->right_child = new node_t();
+	// Same as load_atlas_images, for the files directly inside folder
+	// (e.g. "textures/base_wall/") of a zip/pk3 archive. An empty folder
+	// means the archive's root. Entries are inflated on the pool as part of
+	// decoding them.
+	static ga_inline bool load_atlas_archive_images(
+		atlas_t& atlas,
+		const std::string& archive_path,
+		std::string folder,
+		const atlas_build_opts_t& opts,
+		worker_pool_t& pool)
+	{
+		if (!folder.empty() && folder.back() != '/')
+			folder.append(1, '/');
 
-				// Is the partition line vertical?
-				if (dx > dy) {
-					node->left_child->dims.x = image_dims.x;
-					node->left_child->dims.y = node->dims.y;
-					node->left_child->origin = node->origin;
+		std::shared_ptr<zip_archive_t> archive(new zip_archive_t());
 
-					node->right_child->dims.x = dx;
-					node->right_child->dims.y = node->dims.y;
-					node->right_child->origin = node->origin;
+		if (!archive->open(archive_path)) {
+			gla_logf("Could not open %s", archive_path.c_str());
+			return false;
+		}
 
-					node->right_child->origin.x += image_dims.x;
+		atlas.free_memory();
 
-				// Nope, it's horizontal
-				} else {
-					node->left_child->dims.x = node->dims.x;
-					node->left_child->dims.y = image_dims.y;
-					node->left_child->origin = node->origin;
+		// Cache identities look like "pak0.pk3:textures/base_wall/foo.tga"
+		std::string key_prefix = archive_path + ":" + folder;
 
-					node->right_child->dims.x = node->dims.x;
-					node->right_child->dims.y = dy;
-					node->right_child->origin = node->origin;
+		std::vector<image_source_t> sources;
 
-					node->right_child->origin.y += image_dims.y;
-				}
+		for (const zip_entry_t& e: archive->files()) {
+			if (e.name.compare(0, folder.size(), folder) != 0
+				|| e.name.find('/', folder.size()) != std::string::npos)
+				continue;
 
-				// The only way we're able to make it here
-				// is if node's dimensions are >= the image's dimensions.
-				// If they're exactly equal, then node would have already been
-				// set and this call won't happen.
-				// Otherwise, the left child's values are set to values
-				// which have already been examined for size, or are
-				// set to one of the image's dimension values.
+			image_source_t src;
+			src.name = e.name.substr(folder.size());
+			src.path = key_prefix + src.name;
+			src.size = e.uncompressed_size;
+			// Only ever compared for equality. DOS times have a 2 second
+			// resolution, so the CRC is what tells a rewritten entry apart.
+			src.mtime = (int64_t) ((uint64_t) e.dos_time << 32 | e.crc32);
 
-				node->left_child = insert_node(node->left_child, image);
+			src.format = image_format_from_name(src.name);
 
-				return node;
-			}
+			const zip_entry_t* entry = &e;
+			src.read = [archive, entry](std::vector<uint8_t>& out) -> bool {
+				return archive->extract(*entry, out);
+			};
 
-			return nullptr;
+			sources.push_back(std::move(src));
 		}
 
-		bool insert(uint16_t image)
-		{
-			node_t* res = insert_node(root.get(), image);
+		load_image_sources(atlas, sources, opts, pool);
 
-			return !!res;
+		if (opts.image_cache) {
+			opts.image_cache->prune(key_prefix);
+			opts.image_cache->save();
 		}
 
-	public:
+		return true;
+	}
 
-		const glm::ivec3& dims(void) const
-		{
-			return layer_dims;
+	static ga_inline atlas_upload_stats_t make_atlas_from_dir(
+		atlas_t& atlas,
+		std::string dirpath,
+		const atlas_build_opts_t& opts GL_ATLAS_DEFAULT_OPTS)
+	{
+		if (!load_atlas_images(atlas, dirpath, opts, default_worker_pool())) {
+			atlas_error_exit();
+			return atlas_upload_stats_t();
 		}
 
-		gen_layer_bsp(atlas_type_t& atlas_, image_fill_map_t& image_check)
-			:   atlas(atlas_),
-				root(new node_t(), node_t::destroy)
-		{
-			// Setup some upper bounds for the width/height values
-			{
-				GLint max_dims;
-				GL_H( glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_dims) );
+		return gen_atlas_layers(atlas, opts);
+	}
 
-				uint32_t root_area_accumf =
-					next_power2((uint32_t) glm::sqrt((float) atlas.area_accum));
+	static ga_inline atlas_upload_stats_t make_atlas_from_archive(
+		atlas_t& atlas,
+		const std::string& archive_path,
+		const std::string& folder,
+		const atlas_build_opts_t& opts GL_ATLAS_DEFAULT_OPTS)
+	{
+		if (!load_atlas_archive_images(atlas, archive_path, folder, opts,
+			default_worker_pool())) {
+			atlas_error_exit();
+			return atlas_upload_stats_t();
+		}
 
-				if ((uint32_t) max_dims > root_area_accumf)
-					max_dims = (GLint) root_area_accumf;
+		return gen_atlas_layers(atlas, opts);
+	}
 
-				root->dims = glm::ivec2(max_dims, max_dims);
-			}
+	//------------------------------------------------------------------------------------
+	// dynamic atlases
+	//
+	// For images whose pixels change after the build (video thumbnails, painted
+	// decals): the new pixels go into buffer_table with update_atlas_image, or
+	// are written there directly and flagged with mark_atlas_image_dirty, and
+	// flush_atlas_dirty_rects uploads whatever changed, once per frame or so.
+	//
+	// Each layer's dirty rects are merged as they're marked (see
+	// atlas_t::mark_dirty), so a flush makes one write per merged rect, with
+	// the gutter and alignment slack of any image edge it covers extruded again
+	// on the way. Only level 0 is written: the mip levels of a mipmapped atlas
+	// keep the old pixels until it's rebuilt, and block compressed layers can't
+	// be updated at all.
+	//------------------------------------------------------------------------------------
 
-			std::vector<uint16_t> sorted(image_check.size(), 0);
+	// Marks w by h texels at (x, y) of an image, in buffer_table's bottom-up
+	// row order, as changed. Returns false, marking nothing, if the image's
+	// layer is block compressed.
+	static ga_inline bool mark_atlas_image_dirty(atlas_t& atlas,
+		uint16_t image, uint16_t x, uint16_t y, uint16_t w, uint16_t h)
+	{
+		uint8_t layer = atlas.layer(image);
 
-			uint16_t i = 0;
+		if (pixel_format_compressed(atlas.layer_formats[layer])) {
+			gla_logf("Warning: image %u is in a block compressed layer and "
+				"can't be updated", (unsigned) image);
+			return false;
+		}
 
-			for (auto image: image_check)
-				sorted[i++] = image.first;
+		assert(x + w <= atlas.dims_x[image] && y + h <= atlas.dims_y[image]);
 
-			std::sort(sorted.begin(), sorted.end(), [this](uint16_t a,
-				uint16_t b) -> bool {
-				if (atlas.dims_x[a] == atlas.dims_x[b]) {
-					return atlas.dims_y[a] > atlas.dims_y[b];
-				}
-				return atlas.dims_x[a] > atlas.dims_x[b];
-			});
+		uint16_t x0 = atlas.origin_x(image) + x;
+		uint16_t y0 = atlas.origin_y(image) + y;
+		uint16_t x1 = x0 + w;
+		uint16_t y1 = y0 + h;
 
-			for (uint16_t image: sorted) {
-				if (insert(image)) {
-					image_check[image] = 1;
-					layer_dims[2] += 1;
-				}
-			}
-		}
-	};
+		// Texels at the image's edges are extruded across its cell.
+		if (x == 0)
+			x0 = atlas.cell_x(image);
 
-	//------------------------------------------------------------------------------------
-	// minor texture utils
-	//------------------------------------------------------------------------------------
-	static ga_inline void alloc_blank_texture(size_t width, size_t height,
-									uint32_t clear_val)
-	{
-		std::vector<uint32_t> blank(width * height, clear_val);
-		GL_H( glTexImage2D(GL_TEXTURE_2D,
-						   0,
-						   GL_ATLAS_INTERNAL_TEX_FORMAT,
-						   (GLsizei) width,
-						   (GLsizei) height,
-						   0,
-						   GL_ATLAS_TEX_FORMAT,
-						   GL_UNSIGNED_BYTE,
-						   &blank[0]) );
-	}
+		if (y == 0)
+			y0 = atlas.cell_y(image);
 
+		if (x + w == atlas.dims_x[image])
+			x1 = atlas.cell_x(image) + atlas.cell_width(image);
 
-	static ga_inline void convert_rgb_to_rgba(uint8_t* dest,
-		const uint8_t* src, size_t dim_x, size_t dim_y)
+		if (y + h == atlas.dims_y[image])
+			y1 = atlas.cell_y(image) + atlas.cell_height(image);
+
+		atlas.mark_dirty(layer, atlas_rect_t { x0, y0, (uint16_t) (x1 - x0),
+			(uint16_t) (y1 - y0) });
+
+		return true;
+	}
+
+	static ga_inline bool mark_atlas_image_dirty(atlas_t& atlas,
+		uint16_t image)
 	{
-		for (size_t y = 0; y < dim_y; ++y) {
-			for (size_t x = 0; x < dim_x; ++x) {
-				size_t i = y * dim_x + x;
-				dest[i * 4 + 0] = src[i * 3 + 0];
-				dest[i * 4 + 1] = src[i * 3 + 1];
-				dest[i * 4 + 2] = src[i * 3 + 2];
-				dest[i * 4 + 3] = 255;
-			}
-		}
+		return mark_atlas_image_dirty(atlas, image, 0, 0, atlas.dims_x[image],
+			atlas.dims_y[image]);
 	}
 
-	static ga_inline uint32_t pack_rgba(uint8_t* rgba)
+	// Copies tightly packed rows in the image's format (atlas_t::formats),
+	// bottom-up like buffer_table, over w by h texels at (x, y) of it and
+	// marks them dirty.
+	static ga_inline bool update_atlas_image(atlas_t& atlas, uint16_t image,
+		const void* pixels, uint16_t x, uint16_t y, uint16_t w, uint16_t h)
 	{
-		return (((uint32_t)rgba[0]) << 0)
-		| (((uint32_t)rgba[1]) << 8)
-		| (((uint32_t)rgba[2]) << 16)
-		| (((uint32_t)rgba[3]) << 24);
+		if (!mark_atlas_image_dirty(atlas, image, x, y, w, h))
+			return false;
+
+		size_t bpp = pixel_format_bytes(atlas.formats[image]);
+		size_t pitch = (size_t) atlas.dims_x[image] * bpp;
+		size_t row_bytes = (size_t) w * bpp;
+
+		uint8_t* dest = &atlas.buffer_table[image][y * pitch + x * bpp];
+
+		for (uint16_t y1 = 0; y1 < h; ++y1)
+			memcpy(dest + y1 * pitch, (const uint8_t*) pixels + y1 * row_bytes,
+				row_bytes);
+
+		return true;
 	}
 
-	static ga_inline void unpack_rgba(uint8_t* dest, uint32_t src)
+	static ga_inline bool update_atlas_image(atlas_t& atlas, uint16_t image,
+		const void* pixels)
 	{
-		dest[0] = (src >> 0) & 0xFF;
-		dest[1] = (src >> 8) & 0xFF;
-		dest[2] = (src >> 16) & 0xFF;
-		dest[3] = (src >> 24) & 0xFF;
+		return update_atlas_image(atlas, image, pixels, 0, 0,
+			atlas.dims_x[image], atlas.dims_y[image]);
 	}
 
-	static ga_inline void flip_rows_rgba(uint8_t* image_data,
-		size_t dim_x, size_t dim_y)
+	// Fills dest, tightly packed, with the texels of r as the layer holds
+	// them: images with their cells extruded, gaps zeroed.
+	static ga_inline void compose_atlas_rect(const atlas_t& atlas,
+		const std::vector<uint16_t>& images, atlas_rect_t r, size_t bpp,
+		uint8_t* dest)
 	{
-		size_t half_dy = dim_y >> 1;
-		for (size_t y = 0; y < half_dy; ++y) {
-			for (size_t x = 0; x < dim_x; ++x) {
-				size_t top_x = (y * dim_x + x) * 4;
-				size_t bot_x = ((dim_y - y - 1) * dim_x + x) * 4;
-				uint32_t top = pack_rgba(&image_data[top_x]);
+		size_t pitch = (size_t) r.w * bpp;
 
-				unpack_rgba(&image_data[top_x],
-							pack_rgba(&image_data[bot_x]));
+		memset(dest, 0, pitch * r.h);
 
-				unpack_rgba(&image_data[bot_x], top);
+		for (uint16_t i: images) {
+			int cx = atlas.cell_x(i), cy = atlas.cell_y(i);
+			int x0 = std::max(cx, (int) r.x);
+			int y0 = std::max(cy, (int) r.y);
+			int x1 = std::min(cx + atlas.cell_width(i), r.x + r.w);
+			int y1 = std::min(cy + atlas.cell_height(i), r.y + r.h);
+
+			if (x0 >= x1 || y0 >= y1)
+				continue;
+
+			int ox = atlas.origin_x(i), oy = atlas.origin_y(i);
+			int dx = atlas.dims_x[i], dy = atlas.dims_y[i];
+
+			// The part of [x0, x1) over the image itself; left of it repeats
+			// its first column, right of it its last.
+			int ix0 = std::min(std::max(x0, ox), ox + dx);
+			int ix1 = std::max(std::min(x1, ox + dx), ix0);
+
+			const uint8_t* src = &atlas.buffer_table[i][0];
+
+			for (int y = y0; y < y1; ++y) {
+				int sy = std::min(std::max(y - oy, 0), dy - 1);
+				const uint8_t* row = src + (size_t) sy * dx * bpp;
+				uint8_t* out = dest + (size_t) (y - r.y) * pitch;
+
+				for (int x = x0; x < ix0; ++x)
+					memcpy(out + (x - r.x) * bpp, row, bpp);
+
+				memcpy(out + (ix0 - r.x) * bpp, row + (ix0 - ox) * bpp,
+					(ix1 - ix0) * bpp);
+
+				for (int x = ix1; x < x1; ++x)
+					memcpy(out + (x - r.x) * bpp, row + (dx - 1) * bpp, bpp);
 			}
 		}
 	}
 
-	//------------------------------------------------------------------------------------
-	// gen
-	//------------------------------------------------------------------------------------
-
-	static ga_inline void gen_atlas_layers(atlas_t& atlas)
+	// Uploads the atlas's dirty rects until the next would take the bytes
+	// written by this call past byte_budget. A rect too big for what's left
+	// of the budget has as many of its rows written as fit, and always at
+	// least one if nothing else has been. The backend's calls are counted
+	// into stats, if given. Returns true once nothing is dirty.
+	static ga_inline bool flush_atlas_dirty_rects(atlas_t& atlas,
+		size_t byte_budget = SIZE_MAX, atlas_upload_stats_t* stats = nullptr)
 	{
-		// Basic idea is to keep track of each image
-		// and the layer it belongs to; every image
-		// which has yet to be assigned to a layer
-		// remains in this map after a given iteration
-		image_fill_map_t global_unfill;
-		for (uint16_t i = 0; i < atlas.num_images; ++i) {
-			global_unfill[i];
-		}
+		upload_stats_scope_t counting(*atlas.backend, stats);
 
-		uint8_t layer = 0;
+		std::vector<uint8_t> scratch;
+		std::vector<uint16_t> images;
+		size_t spent = 0;
 
-		while (!global_unfill.empty()) {
-			image_fill_map_t local_fill;
+		for (uint8_t layer = 0; layer < atlas.dirty_rects.size(); ++layer) {
+			std::vector<atlas_rect_t>& rects = atlas.dirty_rects[layer];
 
-			local_fill.insert(global_unfill.begin(),
-							  global_unfill.end());
+			if (rects.empty())
+				continue;
 
-			// gen_layer_bsp allocates a fair amount of memory
-			// internally, so it's best to just wrap it in an
-			// inner block since we have plenty of processing to do
-			// afterward
-			uint16_t w, h;
-			{
-				gen_layer_bsp placed(atlas, local_fill);
+			atlas_pixel_format_t format = atlas.layer_formats[layer];
+			size_t bpp = pixel_format_bytes(format);
 
-				const glm::ivec3& dims = placed.dims();
+			images.clear();
 
-				w = next_power2(dims[0]);
-				h = next_power2(dims[1]);
+			for (uint16_t i = 0; i < atlas.num_images; ++i) {
+				if (atlas.layer(i) == layer) {
+					assert(atlas.formats[i] == format);
+					images.push_back(i);
+				}
 			}
 
-			atlas.push_layer(w, h);
+			atlas.backend->begin_layer(format);
 
-			atlas.bind(layer);
+			while (!rects.empty()) {
+				atlas_rect_t& r = rects.back();
+				size_t row_bytes = (size_t) r.w * bpp;
 
-			for (auto& image: local_fill) {
-				if (image.second) {
-					atlas.set_layer(image.first, layer);
-					atlas.fill_atlas_image(image.first);
-					global_unfill.erase(image.first);
-				}
+				size_t rows = spent < byte_budget
+					? (byte_budget - spent) / row_bytes : 0;
+
+				if (!spent)
+					rows = std::max(rows, (size_t) 1);
+
+				if (!rows)
+					break;
+
+				atlas_rect_t part = r;
+				part.h = (uint16_t) std::min(rows, (size_t) r.h);
+
+				scratch.resize(row_bytes * part.h);
+				compose_atlas_rect(atlas, images, part, bpp, &scratch[0]);
+
+				atlas.write_rect(layer, part.x, part.y, part.w, part.h, format,
+					&scratch[0]);
+
+				spent += scratch.size();
+
+				r.y += part.h;
+				r.h -= part.h;
+
+				if (!r.h)
+					rects.pop_back();
 			}
 
-			atlas.release();
+			atlas.backend->end_layer();
 
-			layer++;
+			if (!rects.empty())
+				return false;
 		}
 
-		gla_logf("Total Images: %lu\nArea Accum: %lu",
-			 atlas.num_images, atlas.area_accum);
+		return true;
 	}
 
-	static ga_inline void push_atlas_image(atlas_t& atlas,
-		uint8_t* buffer, int dx, int dy, int bpp)
+	//------------------------------------------------------------------------------------
+	// asynchronous builds
+	//
+	// make_atlas_from_dir_async and make_atlas_from_archive_async run scanning,
+	// decoding, conversion and packing on the worker pool and hand back an
+	// atlas_build_t. The thread that owns the GL context calls pump() once per
+	// frame: nothing happens until the CPU stages are done, after which each
+	// call uploads up to max_layers layers. The target atlas is only replaced
+	// once every layer is uploaded, so it stays usable for the whole build.
+	//------------------------------------------------------------------------------------
+
+	enum atlas_build_status_t {
+		ATLAS_BUILD_PENDING = 0,	// CPU stages still running
+		ATLAS_BUILD_UPLOADING,		// layers are being uploaded by pump()
+		ATLAS_BUILD_DONE,			// target atlas has been replaced
+		ATLAS_BUILD_FAILED
+	};
+
+	class atlas_build_t
 	{
-		std::vector<uint8_t> image_data(dx * dy * DESIRED_BPP, 0);
+		atlas_t staged;
+		atlas_layout_t layout;
 
-		if (bpp == 3) {
-			convert_rgb_to_rgba(&image_data[0], buffer, dx, dy);
-		} else if (bpp == DESIRED_BPP) {
-			memcpy(&image_data[0], buffer, dx * dy * DESIRED_BPP);
-		} else {
-			gla_logf("ERROR: received image of would-be index %i" \
-			"that does not contain a supported bytes per pixel count."\
-			" Dimensions: %i x %i. BPP received: %i",
-			(int) atlas.num_images, dx, dy, bpp);
-		}
+		std::promise<bool> cpu_promise;
+		std::shared_future<bool> cpu_future;
 
-		atlas.area_accum += dx * dy;
+		uint8_t next_layer;
+		atlas_build_status_t status;
 
-		atlas.dims_x.push_back(dx);
-		atlas.dims_y.push_back(dy);
+		atlas_build_opts_t opts;
+		std::unique_ptr<upload_staging_t> staging;
 
-		// Reverse image rows, since stb_image treats
-		// origin as upper left and OpenGL doesn't.
-		flip_rows_rgba(&image_data[0], dx, dy);
+		atlas_upload_stats_t stats;
 
-		atlas.buffer_table.push_back(std::move(image_data));
+	public:
+		atlas_build_t(void)
+			:	cpu_future(cpu_promise.get_future().share()),
+				next_layer(0),
+				status(ATLAS_BUILD_PENDING),
+				stats()
+		{}
 
-		atlas.num_images++;
-	}
+		// Layers uploaded by pump() but never handed over are deleted with
+		// the build, so a half-pumped build has to be dropped on the GL thread.
 
-	static ga_inline void make_atlas_from_dir(
-		atlas_t& atlas,
-		std::string dirpath)
-	{
-		if (*(dirpath.end()) != '/')
-			dirpath.append(1, '/');
+		using loader_t = std::function<bool(atlas_t&)>;
 
-		DIR* dir = opendir(dirpath.c_str());
-		struct dirent* ent = NULL;
+		// loader fills the atlas it's given with converted images; it runs
+		// on a worker thread, so it mustn't touch GL. start itself is called
+		// on the GL thread, which the backend's array limit is asked on.
+		static std::shared_ptr<atlas_build_t> start(loader_t loader,
+			const atlas_build_opts_t& opts, GLint max_dims)
+		{
+			std::shared_ptr<atlas_build_t> build(new atlas_build_t());
+			build->opts = opts;
 
-		if (!dir) {
-			gla_logf("Could not open %s", dirpath.c_str());
-			atlas_error_exit();
-			return;
+			GLint max_slices = opts.max_slices();
+
+			default_worker_pool().submit(
+				[build, loader, opts, max_dims, max_slices](void) {
+				bool ok = loader(build->staged);
+
+				if (ok)
+					find_or_pack_layout(build->staged, max_dims, max_slices,
+						opts, build->layout);
+
+				build->cpu_promise.set_value(ok);
+			});
+
+			return build;
 		}
 
-		assert(DESIRED_BPP == 4
-			&& "Code is only meant to work with textures using desired bpp of 4!");
+		// Becomes ready once decoding and packing have finished; its value is
+		// false if the build failed.
+		std::shared_future<bool> cpu_stages(void) const
+		{
+			return cpu_future;
+		}
 
-		atlas.free_memory();
+		bool ready(void) const
+		{
+			return cpu_future.wait_for(std::chrono::seconds(0))
+				== std::future_status::ready;
+		}
 
-		while (!!(ent = readdir(dir))) {
-			std::string filepath(dirpath);
-			filepath.append(ent->d_name);
+		// GL thread only.
+		atlas_build_status_t pump(atlas_t& atlas, size_t max_layers = SIZE_MAX)
+		{
+			if (status == ATLAS_BUILD_PENDING) {
+				if (!ready())
+					return status;
 
-			int dx, dy, bpp;
-			stbi_uc* stbi_buffer = stbi_load(filepath.c_str(), &dx, &dy, &bpp,
-											 STBI_default);
+				if (!cpu_future.get())
+					return status = ATLAS_BUILD_FAILED;
 
-			if (!stbi_buffer) {
-				gla_logf("Warning: could not open %s. Skipping.", filepath.c_str());
-				continue;
+				apply_atlas_layout(staged, layout);
+				staging.reset(new upload_staging_t(*opts.backend, opts.streams(),
+					stats));
+				status = ATLAS_BUILD_UPLOADING;
 			}
 
-			if (bpp != DESIRED_BPP && bpp != 3) {
-				gla_logf("Warning: found invalid bpp value of %i for %s. Skipping.",
-					 bpp, filepath.c_str());
-				continue;
-			}
+			if (status != ATLAS_BUILD_UPLOADING)
+				return status;
 
-			atlas.filenames.push_back(std::string(ent->d_name));
+			upload_stats_scope_t counting(*opts.backend, &stats);
 
-			push_atlas_image(atlas, stbi_buffer, dx, dy, bpp);
+			for (size_t n = 0; n < max_layers
+				&& next_layer < layout.widths.size(); ++n)
+				upload_atlas_layer(staged, layout, next_layer++, opts, *staging);
 
-			stbi_image_free(stbi_buffer);
+			if (next_layer < layout.widths.size())
+				return status;
+
+			staging.reset();
+
+			atlas.swap(staged);
+			staged.free_memory();
+
+			gla_logf("Total Images: %lu\nArea Accum: %lu",
+				 atlas.num_images, atlas.area_accum);
+
+			log_atlas_upload_stats(stats);
+
+			return status = ATLAS_BUILD_DONE;
 		}
 
-		closedir(dir);
+		// What the uploads have taken so far.
+		const atlas_upload_stats_t& upload_stats(void) const
+		{
+			return stats;
+		}
+	};
+
+	// Must be called on the GL thread, with the GL backend (for the max
+	// texture size query). The caches in opts have to outlive the build.
+	static ga_inline std::shared_ptr<atlas_build_t> make_atlas_from_dir_async(
+		std::string dirpath,
+		const atlas_build_opts_t& opts GL_ATLAS_DEFAULT_OPTS)
+	{
+		assert(opts.backend);
+
+		GLint max_dims = opts.backend->max_layer_size();
+
+		return atlas_build_t::start([dirpath, opts](atlas_t& atlas) -> bool {
+			return load_atlas_images(atlas, dirpath, opts, default_worker_pool());
+		}, opts, max_dims);
+	}
+
+	static ga_inline std::shared_ptr<atlas_build_t> make_atlas_from_archive_async(
+		std::string archive_path,
+		std::string folder,
+		const atlas_build_opts_t& opts GL_ATLAS_DEFAULT_OPTS)
+	{
+		assert(opts.backend);
+
+		GLint max_dims = opts.backend->max_layer_size();
 
-		gen_atlas_layers(atlas);
+		return atlas_build_t::start([archive_path, folder, opts](atlas_t& atlas) -> bool {
+			return load_atlas_archive_images(atlas, archive_path, folder, opts,
+				default_worker_pool());
+		}, opts, max_dims);
 	}
 
 } // namespace gla
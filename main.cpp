@@ -331,7 +331,26 @@ int main(int argc, const char * argv[])
 
     std::array<atlas_t, 2> atlasses;
 
-    auto lset_images = [&atlasses, &folders, &path, &folder_index](void)
+    // Folder switches build in the background; the previous atlas
+    // stays on screen until the new one has been fully uploaded.
+    std::shared_ptr<atlas_build_t> pending_build;
+
+    auto llog_images = [&atlasses](void)
+    {
+        GL_H( glActiveTexture(GL_TEXTURE0) );
+
+        std::stringstream ss;
+        uint16_t i = 0;
+        for (const std::string& fname: atlasses[0].filenames) {
+            ss << SS_INDEX(i) << fname << "\n";
+            ++i;
+        }
+
+        logf("Image Filenames:\n%s", ss.str().c_str());
+    };
+
+    auto lset_images = [&atlasses, &folders, &path, &folder_index,
+                        &pending_build, &llog_images](bool async)
     {
         if (folder_index < 0) {
             folder_index = folders.size() - 1;
@@ -341,21 +360,36 @@ int main(int argc, const char * argv[])
 
         path = "./textures/" + folders[folder_index];
 
-        make_atlas_from_dir(atlasses[0], path);
-
-        GL_H( glActiveTexture(GL_TEXTURE0) );
+        if (async) {
+            pending_build = make_atlas_from_dir_async(path);
+        } else {
+            make_atlas_from_dir(atlasses[0], path);
+            llog_images();
+        }
+    };
 
-        std::stringstream ss;
-        uint16_t i = 0;
-        for (const std::string& fname: atlasses[0].filenames) {
-            ss << SS_INDEX(i) << fname << "\n";
-            ++i;
+    auto lpump_images = [&atlasses, &pending_build, &display_layer,
+                         &llog_images](void)
+    {
+        if (!pending_build)
+            return;
+
+        // One layer per frame keeps the upload cost of a switch spread out
+        switch (pending_build->pump(atlasses[0], 1)) {
+            case ATLAS_BUILD_DONE:
+                display_layer = 0;
+                llog_images();
+                break;
+            case ATLAS_BUILD_FAILED:
+                break;
+            default:
+                return;
         }
 
-        logf("Image Filenames:\n%s", ss.str().c_str());
+        pending_build.reset();
     };
 
-    lset_images();
+    lset_images(false);
 
     while (!KEY_PRESS(GLFW_KEY_ESCAPE)
            && !glfwWindowShouldClose(window)
@@ -375,13 +409,15 @@ int main(int argc, const char * argv[])
         glfwSwapBuffers(window);
         glfwPollEvents();
 
+        lpump_images();
+
         if (KEY_PRESS(GLFW_KEY_LEFT_BRACKET)) {
             folder_index--;
-            lset_images();
+            lset_images(true);
         }
         else if (KEY_PRESS(GLFW_KEY_RIGHT_BRACKET)) {
             folder_index++;
-            lset_images();
+            lset_images(true);
         }
 
         if (KEY_PRESS(GLFW_KEY_UP))
@@ -448,6 +484,8 @@ fin:
     GL_H( glBindVertexArray(0) );
     GL_H( glDeleteVertexArrays(1, &vao) );
 
+    pending_build.reset();
+
     for (atlas_t& atlas: atlasses)
         atlas.free_memory();
 
@@ -405,6 +405,22 @@ enum
     STBI_rgb_alpha  = 4
 };
 
+// image formats, see stbi_detect_format and stbi_load_params::format
+enum
+{
+    STBI_format_unknown = 0,
+    
+    STBI_format_jpeg,
+    STBI_format_png,
+    STBI_format_bmp,
+    STBI_format_gif,
+    STBI_format_psd,
+    STBI_format_pic,
+    STBI_format_pnm,
+    STBI_format_hdr,
+    STBI_format_tga
+};
+
 typedef unsigned char stbi_uc;
 
 #ifdef __cplusplus
@@ -437,6 +453,24 @@ extern "C" {
     STBIDEF stbi_uc *stbi_load_from_memory   (stbi_uc           const *buffer, int len   , int *x, int *y, int *comp, int req_comp);
     STBIDEF stbi_uc *stbi_load_from_callbacks(stbi_io_callbacks const *clbk  , void *user, int *x, int *y, int *comp, int req_comp);
     
+    // per-call options for the _ex loaders; zero-initialize and set what you need
+    typedef struct
+    {
+        int jpeg_scale; // 0/1 for full size, or 2, 4 or 8 to decode JPEGs at that
+                        // fraction of their size (rounded up) in the DCT domain
+        int flip_vertically; // like stbi_set_flip_vertically_on_load, for this call only;
+                             // TGAs are decoded in that order rather than flipped after
+        int format;     // an STBI_format_* to go straight to that loader, skipping the
+                        // other formats' tests; if its own test fails, every format is
+                        // tried as usual
+    } stbi_load_params;
+    
+    STBIDEF stbi_uc *stbi_load_from_memory_ex(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp, stbi_load_params const *params);
+    
+    // identify a format from the signature in its first bytes, or return
+    // STBI_format_unknown; TGA has no signature, so it's never reported
+    STBIDEF int      stbi_detect_format(stbi_uc const *buffer, int len);
+    
 #ifndef STBI_NO_STDIO
     STBIDEF stbi_uc *stbi_load_from_file  (FILE *f,                  int *x, int *y, int *comp, int req_comp);
     // for stbi_load_from_file, file pointer is left pointing immediately after image
@@ -482,6 +516,10 @@ extern "C" {
     STBIDEF int      stbi_info_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp);
     STBIDEF int      stbi_info_from_callbacks(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *comp);
     
+    // same, asking only format's parser (an STBI_format_*) unless it fails,
+    // like stbi_load_params::format
+    STBIDEF int      stbi_info_from_memory_ex(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int format);
+    
 #ifndef STBI_NO_STDIO
     STBIDEF int      stbi_info            (char const *filename,     int *x, int *y, int *comp);
     STBIDEF int      stbi_info_from_file  (FILE *f,                  int *x, int *y, int *comp);
@@ -502,6 +540,14 @@ extern "C" {
     // flip the image vertically, so the first pixel in the output array is the bottom left
     STBIDEF void stbi_set_flip_vertically_on_load(int flag_true_if_should_flip);
     
+    // let large decodes split their work across threads. fn must call
+    // task(arg, i) exactly once for every i in [0, count), in any order and
+    // possibly concurrently, and return only once all of the calls are done.
+    // currently used for baseline JPEGs with restart markers loaded from
+    // memory. pass NULL to go back to decoding on the calling thread.
+    typedef void stbi_parallel_for_func(void *user, int count, void (*task)(void *arg, int index), void *arg);
+    STBIDEF void stbi_set_parallel_for(stbi_parallel_for_func *fn, void *user);
+    
     // ZLIB client - used by PNG, available for other purposes
     
     STBIDEF char *stbi_zlib_decode_malloc_guesssize(const char *buffer, int len, int initial_size, int *outlen);
@@ -597,12 +643,14 @@ typedef unsigned short stbi__uint16;
 typedef   signed short stbi__int16;
 typedef unsigned int   stbi__uint32;
 typedef   signed int   stbi__int32;
+typedef unsigned __int64 stbi__uint64;
 #else
 #include <stdint.h>
 typedef uint16_t stbi__uint16;
 typedef int16_t  stbi__int16;
 typedef uint32_t stbi__uint32;
 typedef int32_t  stbi__int32;
+typedef uint64_t stbi__uint64;
 #endif
 
 // should produce compiler error if size is wrong
@@ -707,6 +755,32 @@ static int stbi__sse2_available()
     int info3 = stbi__cpuid3();
     return ((info3 >> 26) & 1) != 0;
 }
+
+#if _MSC_VER >= 1500 // VS2008 ships the SSSE3 intrinsics
+#define STBI__SSSE3
+#define STBI__TARGET_SSSE3
+static int stbi__ssse3_available()
+{
+    int info[4];
+    __cpuid(info,1);
+    return ((info[2] >> 9) & 1) != 0;
+}
+#endif
+
+#if _MSC_VER >= 1800 // VS2013 ships the AVX2 intrinsics
+#define STBI__AVX2
+#define STBI__TARGET_AVX2
+static int stbi__avx2_available()
+{
+    int info[4];
+    __cpuid(info,1);
+    // the OS also has to save the ymm registers (OSXSAVE set, XCR0 bits 1-2)
+    if (((info[2] >> 27) & 1) == 0 || ((info[2] >> 28) & 1) == 0) return 0;
+    if ((_xgetbv(0) & 6) != 6) return 0;
+    __cpuidex(info,7,0);
+    return ((info[1] >> 5) & 1) != 0;
+}
+#endif
 #else // assume GCC-style if not VC++
 #define STBI_SIMD_ALIGN(type, name) type name __attribute__((aligned(16)))
 
@@ -721,6 +795,42 @@ static int stbi__sse2_available()
     return 0;
 #endif
 }
+
+// SSSE3 kernels are compiled per function with the target attribute, so they
+// don't need -mssse3 and are only called after checking the CPU at runtime
+#if defined(__SSSE3__) || defined(__clang__) || (defined(__GNUC__) && (__GNUC__ * 100 + __GNUC_MINOR__) >= 409)
+#define STBI__SSSE3
+#define STBI__TARGET_SSSE3 __attribute__((target("ssse3")))
+static int stbi__ssse3_available()
+{
+#if defined(__SSSE3__)
+    return 1;
+#else
+    return __builtin_cpu_supports("ssse3");
+#endif
+}
+#endif
+
+// same for AVX2; __builtin_cpu_supports also checks that the OS saves ymm
+#if defined(__AVX2__) || defined(__clang__) || (defined(__GNUC__) && (__GNUC__ * 100 + __GNUC_MINOR__) >= 409)
+#define STBI__AVX2
+#define STBI__TARGET_AVX2 __attribute__((target("avx2")))
+static int stbi__avx2_available()
+{
+#if defined(__AVX2__)
+    return 1;
+#else
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+#endif
+
+#ifdef STBI__SSSE3
+#include <tmmintrin.h>
+#endif
+#ifdef STBI__AVX2
+#include <immintrin.h>
 #endif
 #endif
 
@@ -759,6 +869,13 @@ typedef struct
     
     stbi_uc *img_buffer, *img_buffer_end;
     stbi_uc *img_buffer_original, *img_buffer_original_end;
+    
+    int jpeg_scale_shift; // from stbi_load_params::jpeg_scale
+    
+    int flip_vertically;  // the caller wants the rows bottom-up...
+    int flipped;          // ...and the loader already produced them that way
+    
+    int format;           // from stbi_load_params::format
 } stbi__context;
 
 
@@ -769,6 +886,9 @@ static void stbi__start_mem(stbi__context *s, stbi_uc const *buffer, int len)
 {
     s->io.read = NULL;
     s->read_from_callbacks = 0;
+    s->jpeg_scale_shift = 0;
+    s->flip_vertically = s->flipped = 0;
+    s->format = STBI_format_unknown;
     s->img_buffer = s->img_buffer_original = (stbi_uc *) buffer;
     s->img_buffer_end = s->img_buffer_original_end = (stbi_uc *) buffer+len;
 }
@@ -780,6 +900,9 @@ static void stbi__start_callbacks(stbi__context *s, stbi_io_callbacks *c, void *
     s->io_user_data = user;
     s->buflen = sizeof(s->buffer_start);
     s->read_from_callbacks = 1;
+    s->jpeg_scale_shift = 0;
+    s->flip_vertically = s->flipped = 0;
+    s->format = STBI_format_unknown;
     s->img_buffer_original = s->buffer_start;
     stbi__refill_buffer(s);
     s->img_buffer_original_end = s->img_buffer_end;
@@ -935,8 +1058,68 @@ STBIDEF void stbi_set_flip_vertically_on_load(int flag_true_if_should_flip)
     stbi__vertically_flip_on_load = flag_true_if_should_flip;
 }
 
+static stbi_parallel_for_func *stbi__parallel_for = NULL;
+static void *stbi__parallel_for_user = NULL;
+
+STBIDEF void stbi_set_parallel_for(stbi_parallel_for_func *fn, void *user)
+{
+    stbi__parallel_for = fn;
+    stbi__parallel_for_user = user;
+}
+
+// loads the image with a given format's loader if that format's test passes,
+// otherwise returns NULL and sets *tested to 0
+static unsigned char *stbi__load_format(stbi__context *s, int format, int *x, int *y, int *comp, int req_comp, int *tested)
+{
+    *tested = 1;
+    switch (format) {
+#ifndef STBI_NO_JPEG
+        case STBI_format_jpeg: if (stbi__jpeg_test(s)) return stbi__jpeg_load(s,x,y,comp,req_comp); break;
+#endif
+#ifndef STBI_NO_PNG
+        case STBI_format_png:  if (stbi__png_test(s))  return stbi__png_load(s,x,y,comp,req_comp);  break;
+#endif
+#ifndef STBI_NO_BMP
+        case STBI_format_bmp:  if (stbi__bmp_test(s))  return stbi__bmp_load(s,x,y,comp,req_comp);  break;
+#endif
+#ifndef STBI_NO_GIF
+        case STBI_format_gif:  if (stbi__gif_test(s))  return stbi__gif_load(s,x,y,comp,req_comp);  break;
+#endif
+#ifndef STBI_NO_PSD
+        case STBI_format_psd:  if (stbi__psd_test(s))  return stbi__psd_load(s,x,y,comp,req_comp);  break;
+#endif
+#ifndef STBI_NO_PIC
+        case STBI_format_pic:  if (stbi__pic_test(s))  return stbi__pic_load(s,x,y,comp,req_comp);  break;
+#endif
+#ifndef STBI_NO_PNM
+        case STBI_format_pnm:  if (stbi__pnm_test(s))  return stbi__pnm_load(s,x,y,comp,req_comp);  break;
+#endif
+#ifndef STBI_NO_HDR
+        case STBI_format_hdr:
+            if (stbi__hdr_test(s)) {
+                float *hdr = stbi__hdr_load(s, x,y,comp,req_comp);
+                return stbi__hdr_to_ldr(hdr, *x, *y, req_comp ? req_comp : *comp);
+            }
+            break;
+#endif
+#ifndef STBI_NO_TGA
+        case STBI_format_tga:  if (stbi__tga_test(s))  return stbi__tga_load(s,x,y,comp,req_comp);  break;
+#endif
+        default: break;
+    }
+    *tested = 0;
+    return NULL;
+}
+
 static unsigned char *stbi__load_main(stbi__context *s, int *x, int *y, int *comp, int req_comp)
 {
+    // with a format hint, that's the only test we need to run
+    if (s->format != STBI_format_unknown) {
+        int tested;
+        unsigned char *result = stbi__load_format(s, s->format, x,y,comp,req_comp, &tested);
+        if (tested) return result;
+    }
+    
 #ifndef STBI_NO_JPEG
     if (stbi__jpeg_test(s)) return stbi__jpeg_load(s,x,y,comp,req_comp);
 #endif
@@ -977,22 +1160,30 @@ static unsigned char *stbi__load_main(stbi__context *s, int *x, int *y, int *com
 
 static unsigned char *stbi__load_flip(stbi__context *s, int *x, int *y, int *comp, int req_comp)
 {
-    unsigned char *result = stbi__load_main(s, x, y, comp, req_comp);
+    unsigned char *result;
     
-    if (stbi__vertically_flip_on_load && result != NULL) {
-        int w = *x, h = *y;
-        int depth = req_comp ? req_comp : *comp;
-        int row,col,z;
-        stbi_uc temp;
+    if (stbi__vertically_flip_on_load) s->flip_vertically = 1;
+    result = stbi__load_main(s, x, y, comp, req_comp);
+    
+    if (s->flip_vertically && !s->flipped && result != NULL) {
+        int h = *y;
+        size_t bytes_per_row = (size_t) *x * (req_comp ? req_comp : *comp);
+        int row;
+        stbi_uc temp[2048];
         
-        // @OPTIMIZE: use a bigger temp buffer and memcpy multiple pixels at once
+        // swap whole rows, a temp buffer's worth at a time
         for (row = 0; row < (h>>1); row++) {
-            for (col = 0; col < w; col++) {
-                for (z = 0; z < depth; z++) {
-                    temp = result[(row * w + col) * depth + z];
-                    result[(row * w + col) * depth + z] = result[((h - row - 1) * w + col) * depth + z];
-                    result[((h - row - 1) * w + col) * depth + z] = temp;
-                }
+            stbi_uc *row0 = result + row * bytes_per_row;
+            stbi_uc *row1 = result + (h - row - 1) * bytes_per_row;
+            size_t bytes_left = bytes_per_row;
+            while (bytes_left) {
+                size_t bytes_copy = (bytes_left < sizeof(temp)) ? bytes_left : sizeof(temp);
+                memcpy(temp, row0, bytes_copy);
+                memcpy(row0, row1, bytes_copy);
+                memcpy(row1, temp, bytes_copy);
+                row0 += bytes_copy;
+                row1 += bytes_copy;
+                bytes_left -= bytes_copy;
             }
         }
     }
@@ -1069,6 +1260,35 @@ STBIDEF stbi_uc *stbi_load_from_memory(stbi_uc const *buffer, int len, int *x, i
     return stbi__load_flip(&s,x,y,comp,req_comp);
 }
 
+STBIDEF stbi_uc *stbi_load_from_memory_ex(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp, stbi_load_params const *params)
+{
+    stbi__context s;
+    stbi__start_mem(&s,buffer,len);
+    if (params) {
+        if      (params->jpeg_scale >= 8) s.jpeg_scale_shift = 3;
+        else if (params->jpeg_scale >= 4) s.jpeg_scale_shift = 2;
+        else if (params->jpeg_scale >= 2) s.jpeg_scale_shift = 1;
+        s.flip_vertically = params->flip_vertically != 0;
+        s.format = params->format;
+    }
+    return stbi__load_flip(&s,x,y,comp,req_comp);
+}
+
+STBIDEF int stbi_detect_format(stbi_uc const *buffer, int len)
+{
+    #define stbi__sig(str) (len >= (int) sizeof(str)-1 && memcmp(buffer, str, sizeof(str)-1) == 0)
+    if (stbi__sig("\xff\xd8\xff"))                           return STBI_format_jpeg;
+    if (stbi__sig("\x89PNG\r\n\x1a\n"))                      return STBI_format_png;
+    if (stbi__sig("BM"))                                     return STBI_format_bmp;
+    if (stbi__sig("GIF87a") || stbi__sig("GIF89a"))          return STBI_format_gif;
+    if (stbi__sig("8BPS"))                                   return STBI_format_psd;
+    if (stbi__sig("\x53\x80\xf6\x34"))                       return STBI_format_pic;
+    if (stbi__sig("P5") || stbi__sig("P6"))                  return STBI_format_pnm;
+    if (stbi__sig("#?RADIANCE\n") || stbi__sig("#?RGBE\n"))  return STBI_format_hdr;
+    #undef stbi__sig
+    return STBI_format_unknown;
+}
+
 STBIDEF stbi_uc *stbi_load_from_callbacks(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *comp, int req_comp)
 {
     stbi__context s;
@@ -1512,8 +1732,11 @@ typedef struct
     int scan_n, order[4];
     int restart_interval, todo;
     
+    int scale_shift; // blocks come out (8 >> scale_shift) pixels wide
+    
     // kernels
     void (*idct_block_kernel)(stbi_uc *out, int out_stride, short data[64]);
+    void (*idct_block2_kernel)(stbi_uc *out, int out_stride, short data[128]); // two side-by-side blocks, or NULL
     void (*YCbCr_to_RGB_kernel)(stbi_uc *out, const stbi_uc *y, const stbi_uc *pcb, const stbi_uc *pcr, int count, int step);
     stbi_uc *(*resample_row_hv_2_kernel)(stbi_uc *out, stbi_uc *in_near, stbi_uc *in_far, int w, int hs);
 } stbi__jpeg;
@@ -2025,6 +2248,64 @@ static void stbi__idct_block(stbi_uc *out, int out_stride, short data[64])
     }
 }
 
+// reduced IDCTs for scaled decodes: an NxN inverse DCT of the block's
+// top-left NxN coefficients, scaled so a flat block keeps its value. the
+// result is the block downsampled by 8/N, filtered in the frequency domain.
+//
+// t[x*n+u] is c(u) * cos((2x+1)u*pi/2n) in 4.12 fixed point
+static void stbi__idct_scaled(stbi_uc *out, int out_stride, short data[64], int n, int const *t)
+{
+    int i,j,k,tmp[16];
+    // columns; the intermediate is kept at 2 fractional bits, and clamped
+    // so that a corrupt block can't overflow the second pass
+    for (j=0; j < n; ++j) {
+        for (i=0; i < n; ++i) {
+            int sum = 0;
+            for (k=0; k < n; ++k)
+                sum += t[j*n+k] * data[k*8+i];
+            sum = (sum + 512) >> 10;
+            tmp[j*n+i] = sum < -65536 ? -65536 : sum > 65536 ? 65536 : sum;
+        }
+    }
+    // rows, dropping the 1/4 normalization, the fixed point and the level
+    // shift in one go
+    for (j=0; j < n; ++j, out += out_stride) {
+        for (i=0; i < n; ++i) {
+            int sum = 0;
+            for (k=0; k < n; ++k)
+                sum += t[i*n+k] * tmp[j*n+k];
+            out[i] = stbi__clamp((sum + (1 << 15) + (128 << 16)) >> 16);
+        }
+    }
+}
+
+static void stbi__idct_4x4(stbi_uc *out, int out_stride, short data[64])
+{
+    static int const t[16] = {
+        2896,  3784,  2896,  1567,
+        2896,  1567, -2896, -3784,
+        2896, -1567, -2896,  3784,
+        2896, -3784,  2896, -1567,
+    };
+    stbi__idct_scaled(out, out_stride, data, 4, t);
+}
+
+static void stbi__idct_2x2(stbi_uc *out, int out_stride, short data[64])
+{
+    static int const t[4] = {
+        2896,  2896,
+        2896, -2896,
+    };
+    stbi__idct_scaled(out, out_stride, data, 2, t);
+}
+
+static void stbi__idct_1x1(stbi_uc *out, int out_stride, short data[64])
+{
+    // a block's mean is its DC term / 8
+    STBI_NOTUSED(out_stride);
+    out[0] = stbi__clamp(((data[0] + 4) >> 3) + 128);
+}
+
 #ifdef STBI_SSE2
 // sse2 integer IDCT. not the fastest possible implementation but it
 // produces bit-identical results to the generic C version so it's
@@ -2204,6 +2485,182 @@ dct_bfly32o(row3,row4, x3,x4,bias,shift); \
 #undef dct_pass
 }
 
+#ifdef STBI__AVX2
+// avx2 version of the above for two horizontally adjacent blocks at once:
+// block 0 (data[0..63]) runs in the low 128-bit lane, block 1 (data[64..127])
+// in the high one. every step the sse2 version uses works within lanes, so
+// this is the same computation and stays bit-identical.
+static STBI__TARGET_AVX2 void stbi__idct_simd2_avx2(stbi_uc *out, int out_stride, short data[128])
+{
+    __m256i row0, row1, row2, row3, row4, row5, row6, row7;
+    __m256i tmp;
+    
+#define dct_const(x,y)  _mm256_setr_epi16((x),(y),(x),(y),(x),(y),(x),(y),(x),(y),(x),(y),(x),(y),(x),(y))
+    
+#define dct_rot(out0,out1, x,y,c0,c1) \
+__m256i c0##lo = _mm256_unpacklo_epi16((x),(y)); \
+__m256i c0##hi = _mm256_unpackhi_epi16((x),(y)); \
+__m256i out0##_l = _mm256_madd_epi16(c0##lo, c0); \
+__m256i out0##_h = _mm256_madd_epi16(c0##hi, c0); \
+__m256i out1##_l = _mm256_madd_epi16(c0##lo, c1); \
+__m256i out1##_h = _mm256_madd_epi16(c0##hi, c1)
+    
+#define dct_widen(out, in) \
+__m256i out##_l = _mm256_srai_epi32(_mm256_unpacklo_epi16(_mm256_setzero_si256(), (in)), 4); \
+__m256i out##_h = _mm256_srai_epi32(_mm256_unpackhi_epi16(_mm256_setzero_si256(), (in)), 4)
+    
+#define dct_wadd(out, a, b) \
+__m256i out##_l = _mm256_add_epi32(a##_l, b##_l); \
+__m256i out##_h = _mm256_add_epi32(a##_h, b##_h)
+    
+#define dct_wsub(out, a, b) \
+__m256i out##_l = _mm256_sub_epi32(a##_l, b##_l); \
+__m256i out##_h = _mm256_sub_epi32(a##_h, b##_h)
+    
+#define dct_bfly32o(out0, out1, a,b,bias,s) \
+{ \
+__m256i abiased_l = _mm256_add_epi32(a##_l, bias); \
+__m256i abiased_h = _mm256_add_epi32(a##_h, bias); \
+dct_wadd(sum, abiased, b); \
+dct_wsub(dif, abiased, b); \
+out0 = _mm256_packs_epi32(_mm256_srai_epi32(sum_l, s), _mm256_srai_epi32(sum_h, s)); \
+out1 = _mm256_packs_epi32(_mm256_srai_epi32(dif_l, s), _mm256_srai_epi32(dif_h, s)); \
+}
+    
+#define dct_interleave8(a, b) \
+tmp = a; \
+a = _mm256_unpacklo_epi8(a, b); \
+b = _mm256_unpackhi_epi8(tmp, b)
+    
+#define dct_interleave16(a, b) \
+tmp = a; \
+a = _mm256_unpacklo_epi16(a, b); \
+b = _mm256_unpackhi_epi16(tmp, b)
+    
+#define dct_pass(bias,shift) \
+{ \
+/* even part */ \
+dct_rot(t2e,t3e, row2,row6, rot0_0,rot0_1); \
+__m256i sum04 = _mm256_add_epi16(row0, row4); \
+__m256i dif04 = _mm256_sub_epi16(row0, row4); \
+dct_widen(t0e, sum04); \
+dct_widen(t1e, dif04); \
+dct_wadd(x0, t0e, t3e); \
+dct_wsub(x3, t0e, t3e); \
+dct_wadd(x1, t1e, t2e); \
+dct_wsub(x2, t1e, t2e); \
+/* odd part */ \
+dct_rot(y0o,y2o, row7,row3, rot2_0,rot2_1); \
+dct_rot(y1o,y3o, row5,row1, rot3_0,rot3_1); \
+__m256i sum17 = _mm256_add_epi16(row1, row7); \
+__m256i sum35 = _mm256_add_epi16(row3, row5); \
+dct_rot(y4o,y5o, sum17,sum35, rot1_0,rot1_1); \
+dct_wadd(x4, y0o, y4o); \
+dct_wadd(x5, y1o, y5o); \
+dct_wadd(x6, y2o, y5o); \
+dct_wadd(x7, y3o, y4o); \
+dct_bfly32o(row0,row7, x0,x7,bias,shift); \
+dct_bfly32o(row1,row6, x1,x6,bias,shift); \
+dct_bfly32o(row2,row5, x2,x5,bias,shift); \
+dct_bfly32o(row3,row4, x3,x4,bias,shift); \
+}
+    
+    // row r of block 0 in the low lane, row r of block 1 in the high lane
+#define dct_load(r) \
+_mm256_inserti128_si256(_mm256_castsi128_si256(_mm_load_si128((const __m128i *) (data + (r)*8))), \
+                        _mm_load_si128((const __m128i *) (data + 64 + (r)*8)), 1)
+    
+    // p holds rows r and r+1 of both blocks as qwords (b0r, b0r+1, b1r, b1r+1);
+    // reorder to (b0r, b1r, b0r+1, b1r+1) and store 16 bytes per output row
+#define dct_store2(p) \
+tmp = _mm256_permute4x64_epi64(p, 0xd8); \
+_mm_storeu_si128((__m128i *) out, _mm256_castsi256_si128(tmp)); out += out_stride; \
+_mm_storeu_si128((__m128i *) out, _mm256_extracti128_si256(tmp, 1)); out += out_stride
+    
+    __m256i rot0_0 = dct_const(stbi__f2f(0.5411961f), stbi__f2f(0.5411961f) + stbi__f2f(-1.847759065f));
+    __m256i rot0_1 = dct_const(stbi__f2f(0.5411961f) + stbi__f2f( 0.765366865f), stbi__f2f(0.5411961f));
+    __m256i rot1_0 = dct_const(stbi__f2f(1.175875602f) + stbi__f2f(-0.899976223f), stbi__f2f(1.175875602f));
+    __m256i rot1_1 = dct_const(stbi__f2f(1.175875602f), stbi__f2f(1.175875602f) + stbi__f2f(-2.562915447f));
+    __m256i rot2_0 = dct_const(stbi__f2f(-1.961570560f) + stbi__f2f( 0.298631336f), stbi__f2f(-1.961570560f));
+    __m256i rot2_1 = dct_const(stbi__f2f(-1.961570560f), stbi__f2f(-1.961570560f) + stbi__f2f( 3.072711026f));
+    __m256i rot3_0 = dct_const(stbi__f2f(-0.390180644f) + stbi__f2f( 2.053119869f), stbi__f2f(-0.390180644f));
+    __m256i rot3_1 = dct_const(stbi__f2f(-0.390180644f), stbi__f2f(-0.390180644f) + stbi__f2f( 1.501321110f));
+    
+    __m256i bias_0 = _mm256_set1_epi32(512);
+    __m256i bias_1 = _mm256_set1_epi32(65536 + (128<<17));
+    
+    // load
+    row0 = dct_load(0);
+    row1 = dct_load(1);
+    row2 = dct_load(2);
+    row3 = dct_load(3);
+    row4 = dct_load(4);
+    row5 = dct_load(5);
+    row6 = dct_load(6);
+    row7 = dct_load(7);
+    
+    // column pass
+    dct_pass(bias_0, 10);
+    
+    {
+        // 16bit 8x8 transpose, per lane
+        dct_interleave16(row0, row4);
+        dct_interleave16(row1, row5);
+        dct_interleave16(row2, row6);
+        dct_interleave16(row3, row7);
+        
+        dct_interleave16(row0, row2);
+        dct_interleave16(row1, row3);
+        dct_interleave16(row4, row6);
+        dct_interleave16(row5, row7);
+        
+        dct_interleave16(row0, row1);
+        dct_interleave16(row2, row3);
+        dct_interleave16(row4, row5);
+        dct_interleave16(row6, row7);
+    }
+    
+    // row pass
+    dct_pass(bias_1, 17);
+    
+    {
+        // pack
+        __m256i p0 = _mm256_packus_epi16(row0, row1);
+        __m256i p1 = _mm256_packus_epi16(row2, row3);
+        __m256i p2 = _mm256_packus_epi16(row4, row5);
+        __m256i p3 = _mm256_packus_epi16(row6, row7);
+        
+        // 8bit 8x8 transpose, per lane
+        dct_interleave8(p0, p2);
+        dct_interleave8(p1, p3);
+        
+        dct_interleave8(p0, p1);
+        dct_interleave8(p2, p3);
+        
+        dct_interleave8(p0, p2);
+        dct_interleave8(p1, p3);
+        
+        // store
+        dct_store2(p0);
+        dct_store2(p2);
+        dct_store2(p1);
+        dct_store2(p3);
+    }
+    
+#undef dct_const
+#undef dct_rot
+#undef dct_widen
+#undef dct_wadd
+#undef dct_wsub
+#undef dct_bfly32o
+#undef dct_interleave8
+#undef dct_interleave16
+#undef dct_pass
+#undef dct_load
+#undef dct_store2
+}
+#endif // STBI__AVX2
+
 #endif // STBI_SSE2
 
 #ifdef STBI_NEON
@@ -2414,6 +2871,29 @@ dct_bfly32o(row3,row4, x3,x4,shiftop,shift); \
 
 #endif // STBI_NEON
 
+// IDCT block (bx,by) of component n into its place in the component's plane;
+// planes and strides are already scaled down for scaled decodes
+stbi_inline static void stbi__jpeg_idct(stbi__jpeg *z, int n, int bx, int by, short data[64])
+{
+    int sh = z->scale_shift;
+    int stride = z->img_comp[n].w2 >> sh;
+    z->idct_block_kernel(z->img_comp[n].data + stride*((by*8) >> sh) + ((bx*8) >> sh), stride, data);
+}
+
+// same for blocks (bx,by) and (bx+1,by), whose coefficients are data[0..63]
+// and data[64..127]
+stbi_inline static void stbi__jpeg_idct2(stbi__jpeg *z, int n, int bx, int by, short data[128])
+{
+    if (z->idct_block2_kernel) {
+        // only set for full-size decodes
+        int stride = z->img_comp[n].w2;
+        z->idct_block2_kernel(z->img_comp[n].data + stride*by*8 + bx*8, stride, data);
+    } else {
+        stbi__jpeg_idct(z, n, bx, by, data);
+        stbi__jpeg_idct(z, n, bx+1, by, data+64);
+    }
+}
+
 #define STBI__MARKER_none  0xff
 // if there's a pending marker from the entropy stream, return that
 // otherwise, fetch from the stream and get a marker. if there's no
@@ -2448,13 +2928,178 @@ static void stbi__jpeg_reset(stbi__jpeg *j)
     // since we don't even allow 1<<30 pixels
 }
 
+// restart-interval parallel decoding
+//
+// in a baseline scan, every restart interval starts with a fresh bit reader
+// and zeroed DC predictions, so once the RST markers have been found, the
+// intervals can be entropy-decoded (and IDCT'd) independently. each job gets
+// its own copy of the decoder, reading from a memory context that ends just
+// after the segment's closing marker, so it stops exactly where the serial
+// decoder would.
+
+// smallest image worth splitting across threads
+#define STBI__JPEG_PARALLEL_MIN_PIXELS  (512*512)
+
+// most jobs handed to stbi__parallel_for at once; each one copies the decoder
+#define STBI__JPEG_PARALLEL_MAX_JOBS    64
+
+static int stbi__jpeg_parallel_ok(stbi__jpeg *z)
+{
+    return stbi__parallel_for != NULL
+        && z->s->img_x * z->s->img_y >= STBI__JPEG_PARALLEL_MIN_PIXELS;
+}
+
+// decode and IDCT MCUs [first, first+count) of the current baseline scan
+static int stbi__jpeg_decode_mcus(stbi__jpeg *z, int first, int count)
+{
+    int m;
+    STBI_SIMD_ALIGN(short, data[128]);
+    if (z->scan_n == 1) {
+        int n = z->order[0];
+        int w = (z->img_comp[n].x+7) >> 3;
+        int ha = z->img_comp[n].ha;
+        for (m=first; m < first+count; ++m) {
+            int i = m % w, j = m / w;
+            if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+            if (i+1 < w && m+1 < first+count) {
+                if (!stbi__jpeg_decode_block(z, data+64, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+                stbi__jpeg_idct2(z, n, i, j, data);
+                ++m;
+            } else
+                stbi__jpeg_idct(z, n, i, j, data);
+        }
+    } else {
+        int k,x,y;
+        for (m=first; m < first+count; ++m) {
+            int i = m % z->img_mcu_x, j = m / z->img_mcu_x;
+            for (k=0; k < z->scan_n; ++k) {
+                int n = z->order[k];
+                int ha = z->img_comp[n].ha;
+                for (y=0; y < z->img_comp[n].v; ++y) {
+                    for (x=0; x < z->img_comp[n].h; x += 2) {
+                        int x2 = i*z->img_comp[n].h + x;
+                        int y2 = j*z->img_comp[n].v + y;
+                        if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+                        if (x+1 < z->img_comp[n].h) {
+                            if (!stbi__jpeg_decode_block(z, data+64, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+                            stbi__jpeg_idct2(z, n, x2, y2, data);
+                        } else
+                            stbi__jpeg_idct(z, n, x2, y2, data);
+                    }
+                }
+            }
+        }
+    }
+    return 1;
+}
+
+typedef struct
+{
+    stbi__jpeg *z;
+    stbi_uc **seg;      // seg[k] is where interval k's data starts
+    stbi_uc **seg_end;  // seg_end[k] is just past the marker that closes it
+    int num_segs, segs_per_job, num_mcus;
+    volatile int failed;
+} stbi__jpeg_segments;
+
+static void stbi__jpeg_decode_segments_job(void *arg, int job)
+{
+    stbi__jpeg_segments *p = (stbi__jpeg_segments *) arg;
+    stbi__context s;
+    stbi__jpeg *z = (stbi__jpeg *) stbi__malloc(sizeof(stbi__jpeg));
+    int k, first = job * p->segs_per_job;
+    int last = first + p->segs_per_job < p->num_segs ? first + p->segs_per_job : p->num_segs;
+    if (!z) { p->failed = 1; return; }
+    memcpy(z, p->z, sizeof(*z));
+    z->s = &s;
+    for (k=first; k < last && !p->failed; ++k) {
+        int m = k * p->z->restart_interval;
+        int count = p->num_mcus - m < p->z->restart_interval ? p->num_mcus - m : p->z->restart_interval;
+        stbi__start_mem(&s, p->seg[k], (int) (p->seg_end[k] - p->seg[k]));
+        stbi__jpeg_reset(z);
+        if (!stbi__jpeg_decode_mcus(z, m, count))
+            p->failed = 1;
+    }
+    STBI_FREE(z);
+}
+
+// returns -1 if the scan can't be split (no restart markers, streamed input,
+// small image, or markers that don't line up), leaving the stream untouched
+static int stbi__parse_entropy_coded_data_parallel(stbi__jpeg *z)
+{
+    stbi__jpeg_segments p;
+    stbi_uc *c, *end = z->s->img_buffer_end;
+    int num_mcus, num_segs, num_jobs, k = 1;
+    
+    // the segments are found by scanning ahead, so the whole file has to be
+    // in memory
+    if (!z->restart_interval || z->s->read_from_callbacks || !stbi__jpeg_parallel_ok(z))
+        return -1;
+    
+    if (z->scan_n == 1) {
+        int n = z->order[0];
+        num_mcus = ((z->img_comp[n].x+7) >> 3) * ((z->img_comp[n].y+7) >> 3);
+    } else {
+        num_mcus = z->img_mcu_x * z->img_mcu_y;
+    }
+    num_segs = (num_mcus + z->restart_interval - 1) / z->restart_interval;
+    if (num_segs < 2)
+        return -1;
+    
+    p.seg = (stbi_uc **) stbi__malloc(sizeof(stbi_uc *) * 2 * num_segs);
+    if (!p.seg) return -1;
+    p.seg_end = p.seg + num_segs;
+    p.seg[0] = z->s->img_buffer;
+    
+    // find the RST markers; FF 00 is a stuffed data byte, and runs of FF are
+    // fill bytes in front of a marker
+    for (c = z->s->img_buffer; ; ++c) {
+        c = (stbi_uc *) memchr(c, 0xff, end - c);
+        if (!c || c+1 >= end) break;
+        if (c[1] == 0x00 || c[1] == 0xff) continue;
+        if (!STBI__RESTART(c[1]) || k == num_segs) break;
+        if (c[1] != 0xd0 + ((k-1) & 7)) break;
+        p.seg_end[k-1] = c+2;
+        p.seg[k++] = c+2;
+        ++c;
+    }
+    
+    if (!c || c+1 >= end || k != num_segs || STBI__RESTART(c[1])) {
+        STBI_FREE(p.seg);
+        return -1;
+    }
+    p.seg_end[k-1] = c+2;
+    
+    p.z = z;
+    p.num_segs = num_segs;
+    p.num_mcus = num_mcus;
+    p.failed = 0;
+    num_jobs = num_segs < STBI__JPEG_PARALLEL_MAX_JOBS ? num_segs : STBI__JPEG_PARALLEL_MAX_JOBS;
+    p.segs_per_job = (num_segs + num_jobs - 1) / num_jobs;
+    num_jobs = (num_segs + p.segs_per_job - 1) / p.segs_per_job;
+    
+    stbi__parallel_for(stbi__parallel_for_user, num_jobs, stbi__jpeg_decode_segments_job, &p);
+    STBI_FREE(p.seg);
+    
+    // leave the stream where the serial decoder would: past the marker that
+    // ended the scan, with the marker pending
+    stbi__jpeg_reset(z);
+    z->marker = c[1];
+    z->s->img_buffer = c+2;
+    
+    if (p.failed) return stbi__err("bad huffman code","Corrupt JPEG");
+    return 1;
+}
+
 static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
 {
     stbi__jpeg_reset(z);
     if (!z->progressive) {
+        int r = stbi__parse_entropy_coded_data_parallel(z);
+        if (r >= 0) return r;
         if (z->scan_n == 1) {
             int i,j;
-            STBI_SIMD_ALIGN(short, data[64]);
+            STBI_SIMD_ALIGN(short, data[128]);
             int n = z->order[0];
             // non-interleaved data, we just need to process one block at a time,
             // in trivial scanline order
@@ -2466,7 +3111,14 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
                 for (i=0; i < w; ++i) {
                     int ha = z->img_comp[n].ha;
                     if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
-                    z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data);
+                    // take two blocks at a time when that can't cross a restart
+                    if (i+1 < w && z->todo > 1) {
+                        if (!stbi__jpeg_decode_block(z, data+64, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+                        stbi__jpeg_idct2(z, n, i, j, data);
+                        ++i;
+                        --z->todo;
+                    } else
+                        stbi__jpeg_idct(z, n, i, j, data);
                     // every data block is an MCU, so countdown the restart interval
                     if (--z->todo <= 0) {
                         if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
@@ -2480,7 +3132,7 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
             return 1;
         } else { // interleaved
             int i,j,k,x,y;
-            STBI_SIMD_ALIGN(short, data[64]);
+            STBI_SIMD_ALIGN(short, data[128]);
             for (j=0; j < z->img_mcu_y; ++j) {
                 for (i=0; i < z->img_mcu_x; ++i) {
                     // scan an interleaved mcu... process scan_n components in order
@@ -2489,12 +3141,16 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
                         // scan out an mcu's worth of this component; that's just determined
                         // by the basic H and V specified for the component
                         for (y=0; y < z->img_comp[n].v; ++y) {
-                            for (x=0; x < z->img_comp[n].h; ++x) {
-                                int x2 = (i*z->img_comp[n].h + x)*8;
-                                int y2 = (j*z->img_comp[n].v + y)*8;
+                            for (x=0; x < z->img_comp[n].h; x += 2) {
+                                int x2 = i*z->img_comp[n].h + x;
+                                int y2 = j*z->img_comp[n].v + y;
                                 int ha = z->img_comp[n].ha;
                                 if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
-                                z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*y2+x2, z->img_comp[n].w2, data);
+                                if (x+1 < z->img_comp[n].h) {
+                                    if (!stbi__jpeg_decode_block(z, data+64, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+                                    stbi__jpeg_idct2(z, n, x2, y2, data);
+                                } else
+                                    stbi__jpeg_idct(z, n, x2, y2, data);
                             }
                         }
                     }
@@ -2591,7 +3247,13 @@ static void stbi__jpeg_finish(stbi__jpeg *z)
                 for (i=0; i < w; ++i) {
                     short *data = z->img_comp[n].coeff + 64 * (i + j * z->img_comp[n].coeff_w);
                     stbi__jpeg_dequantize(data, z->dequant[z->img_comp[n].tq]);
-                    z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data);
+                    // block i+1's coefficients follow block i's
+                    if (i+1 < w) {
+                        stbi__jpeg_dequantize(data+64, z->dequant[z->img_comp[n].tq]);
+                        stbi__jpeg_idct2(z, n, i, j, data);
+                        ++i;
+                    } else
+                        stbi__jpeg_idct(z, n, i, j, data);
                 }
             }
         }
@@ -2763,7 +3425,7 @@ static int stbi__process_frame_header(stbi__jpeg *z, int scan)
         // discard the extra data until colorspace conversion
         z->img_comp[i].w2 = z->img_mcu_x * z->img_comp[i].h * 8;
         z->img_comp[i].h2 = z->img_mcu_y * z->img_comp[i].v * 8;
-        z->img_comp[i].raw_data = stbi__malloc(z->img_comp[i].w2 * z->img_comp[i].h2+15);
+        z->img_comp[i].raw_data = stbi__malloc((z->img_comp[i].w2 >> z->scale_shift) * (z->img_comp[i].h2 >> z->scale_shift)+15);
         
         if (z->img_comp[i].raw_data == NULL) {
             for(--i; i >= 0; --i) {
@@ -3055,6 +3717,73 @@ static stbi_uc *stbi__resample_row_hv_2_simd(stbi_uc *out, stbi_uc *in_near, stb
 }
 #endif
 
+#ifdef STBI__AVX2
+// avx2 version of the above, 16 input pixels per iteration
+static STBI__TARGET_AVX2 stbi_uc *stbi__resample_row_hv_2_avx2(stbi_uc *out, stbi_uc *in_near, stbi_uc *in_far, int w, int hs)
+{
+    int i=0,t0,t1;
+    __m256i bias = _mm256_set1_epi16(8);
+    
+    if (w == 1) {
+        out[0] = out[1] = stbi__div4(3*in_near[0] + in_far[0] + 2);
+        return out;
+    }
+    
+    t1 = 3*in_near[0] + in_far[0];
+    for (; i < ((w-1) & ~15); i += 16) {
+        // vertical pass, 3*x + y = 4*x + (y - x)
+        __m256i farw  = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *) (in_far + i)));
+        __m256i nearw = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i *) (in_near + i)));
+        __m256i diff  = _mm256_sub_epi16(farw, nearw);
+        __m256i nears = _mm256_slli_epi16(nearw, 2);
+        __m256i curr  = _mm256_add_epi16(nears, diff);
+        
+        // "prev"/"next" are curr shifted by one pixel across the whole
+        // register; the byte shifts only work within lanes, so the word
+        // crossing the lane boundary comes in through permute2x128
+        __m256i prv0 = _mm256_alignr_epi8(curr, _mm256_permute2x128_si256(curr, curr, 0x08), 14);
+        __m256i nxt0 = _mm256_alignr_epi8(_mm256_permute2x128_si256(curr, curr, 0x81), curr, 2);
+        __m256i prev = _mm256_insert_epi16(prv0, t1, 0);
+        __m256i next = _mm256_insert_epi16(nxt0, 3*in_near[i+16] + in_far[i+16], 15);
+        
+        // horizontal pass, same polyphase filter as the sse2 version
+        __m256i curs = _mm256_slli_epi16(curr, 2);
+        __m256i prvd = _mm256_sub_epi16(prev, curr);
+        __m256i nxtd = _mm256_sub_epi16(next, curr);
+        __m256i curb = _mm256_add_epi16(curs, bias);
+        __m256i even = _mm256_add_epi16(prvd, curb);
+        __m256i odd  = _mm256_add_epi16(nxtd, curb);
+        
+        // interleave and undo scaling; per lane, unpacklo/hi give pixels
+        // 0-3/4-7 and 8-11/12-15, so the packed result is already in order
+        __m256i int0 = _mm256_unpacklo_epi16(even, odd);
+        __m256i int1 = _mm256_unpackhi_epi16(even, odd);
+        __m256i de0  = _mm256_srli_epi16(int0, 4);
+        __m256i de1  = _mm256_srli_epi16(int1, 4);
+        
+        _mm256_storeu_si256((__m256i *) (out + i*2), _mm256_packus_epi16(de0, de1));
+        
+        t1 = 3*in_near[i+15] + in_far[i+15];
+    }
+    
+    t0 = t1;
+    t1 = 3*in_near[i] + in_far[i];
+    out[i*2] = stbi__div16(3*t1 + t0 + 8);
+    
+    for (++i; i < w; ++i) {
+        t0 = t1;
+        t1 = 3*in_near[i]+in_far[i];
+        out[i*2-1] = stbi__div16(3*t0 + t1 + 8);
+        out[i*2  ] = stbi__div16(3*t1 + t0 + 8);
+    }
+    out[w*2-1] = stbi__div4(t1+2);
+    
+    STBI_NOTUSED(hs);
+    
+    return out;
+}
+#endif
+
 static stbi_uc *stbi__resample_row_generic(stbi_uc *out, stbi_uc *in_near, stbi_uc *in_far, int w, int hs)
 {
     // resample with nearest-neighbor
@@ -3259,10 +3988,74 @@ static void stbi__YCbCr_to_RGB_simd(stbi_uc *out, stbi_uc const *y, stbi_uc cons
 }
 #endif
 
+#ifdef STBI__AVX2
+// avx2 version of the sse2 step == 4 path above, 16 pixels per iteration;
+// whatever is left goes through the regular simd kernel
+static STBI__TARGET_AVX2 void stbi__YCbCr_to_RGB_avx2(stbi_uc *out, stbi_uc const *y, stbi_uc const *pcb, stbi_uc const *pcr, int count, int step)
+{
+    int i = 0;
+    
+    if (step == 4) {
+        __m128i signflip  = _mm_set1_epi8(-0x80);
+        __m256i cr_const0 = _mm256_set1_epi16(   (short) ( 1.40200f*4096.0f+0.5f));
+        __m256i cr_const1 = _mm256_set1_epi16( - (short) ( 0.71414f*4096.0f+0.5f));
+        __m256i cb_const0 = _mm256_set1_epi16( - (short) ( 0.34414f*4096.0f+0.5f));
+        __m256i cb_const1 = _mm256_set1_epi16(   (short) ( 1.77200f*4096.0f+0.5f));
+        __m256i y_bias = _mm256_set1_epi16(128);
+        __m256i xw = _mm256_set1_epi16(255); // alpha channel
+        
+        for (; i+15 < count; i += 16) {
+            // load
+            __m128i y_bytes = _mm_loadu_si128((__m128i *) (y+i));
+            __m128i cr_biased = _mm_xor_si128(_mm_loadu_si128((__m128i *) (pcr+i)), signflip); // -128
+            __m128i cb_biased = _mm_xor_si128(_mm_loadu_si128((__m128i *) (pcb+i)), signflip); // -128
+            
+            // widen to short, giving the same y*256+128 and cr<<8, cb<<8
+            // values the sse2 version gets from its byte unpacks
+            __m256i yw  = _mm256_or_si256(_mm256_slli_epi16(_mm256_cvtepu8_epi16(y_bytes), 8), y_bias);
+            __m256i crw = _mm256_slli_epi16(_mm256_cvtepu8_epi16(cr_biased), 8);
+            __m256i cbw = _mm256_slli_epi16(_mm256_cvtepu8_epi16(cb_biased), 8);
+            
+            // color transform
+            __m256i yws = _mm256_srli_epi16(yw, 4);
+            __m256i cr0 = _mm256_mulhi_epi16(cr_const0, crw);
+            __m256i cb0 = _mm256_mulhi_epi16(cb_const0, cbw);
+            __m256i cb1 = _mm256_mulhi_epi16(cbw, cb_const1);
+            __m256i cr1 = _mm256_mulhi_epi16(crw, cr_const1);
+            __m256i rws = _mm256_add_epi16(cr0, yws);
+            __m256i gwt = _mm256_add_epi16(cb0, yws);
+            __m256i bws = _mm256_add_epi16(yws, cb1);
+            __m256i gws = _mm256_add_epi16(gwt, cr1);
+            
+            // descale
+            __m256i rw = _mm256_srai_epi16(rws, 4);
+            __m256i bw = _mm256_srai_epi16(bws, 4);
+            __m256i gw = _mm256_srai_epi16(gws, 4);
+            
+            // back to byte and interleave channels, per lane
+            __m256i brb = _mm256_packus_epi16(rw, bw);
+            __m256i gxb = _mm256_packus_epi16(gw, xw);
+            __m256i t0 = _mm256_unpacklo_epi8(brb, gxb);
+            __m256i t1 = _mm256_unpackhi_epi8(brb, gxb);
+            __m256i o0 = _mm256_unpacklo_epi16(t0, t1); // pixels 0-3, 8-11
+            __m256i o1 = _mm256_unpackhi_epi16(t0, t1); // pixels 4-7, 12-15
+            
+            // store
+            _mm256_storeu_si256((__m256i *) (out + 0), _mm256_permute2x128_si256(o0, o1, 0x20));
+            _mm256_storeu_si256((__m256i *) (out + 32), _mm256_permute2x128_si256(o0, o1, 0x31));
+            out += 64;
+        }
+    }
+    
+    stbi__YCbCr_to_RGB_simd(out, y+i, pcb+i, pcr+i, count-i, step);
+}
+#endif
+
 // set up the kernels
 static void stbi__setup_jpeg(stbi__jpeg *j)
 {
     j->idct_block_kernel = stbi__idct_block;
+    j->idct_block2_kernel = NULL;
     j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_row;
     j->resample_row_hv_2_kernel = stbi__resample_row_hv_2;
     
@@ -3273,6 +4066,15 @@ static void stbi__setup_jpeg(stbi__jpeg *j)
         j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_simd;
 #endif
         j->resample_row_hv_2_kernel = stbi__resample_row_hv_2_simd;
+#ifdef STBI__AVX2
+        if (stbi__avx2_available()) {
+            j->idct_block2_kernel = stbi__idct_simd2_avx2;
+#ifndef STBI_JPEG_OLD
+            j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_avx2;
+#endif
+            j->resample_row_hv_2_kernel = stbi__resample_row_hv_2_avx2;
+        }
+#endif
     }
 #endif
     
@@ -3283,6 +4085,29 @@ static void stbi__setup_jpeg(stbi__jpeg *j)
 #endif
     j->resample_row_hv_2_kernel = stbi__resample_row_hv_2_simd;
 #endif
+    
+    // scaled decodes swap in a reduced IDCT
+    j->scale_shift = j->s->jpeg_scale_shift;
+    if (j->scale_shift) j->idct_block2_kernel = NULL;
+    if      (j->scale_shift == 1) j->idct_block_kernel = stbi__idct_4x4;
+    else if (j->scale_shift == 2) j->idct_block_kernel = stbi__idct_2x2;
+    else if (j->scale_shift == 3) j->idct_block_kernel = stbi__idct_1x1;
+}
+
+// once a scaled decode is done, switch the image and component sizes over to
+// the scaled planes so resampling and color conversion work on those
+static void stbi__jpeg_apply_scale(stbi__jpeg *z)
+{
+    int i, sh = z->scale_shift, round = (1 << sh) - 1;
+    if (!sh) return;
+    z->s->img_x = (z->s->img_x + round) >> sh;
+    z->s->img_y = (z->s->img_y + round) >> sh;
+    for (i=0; i < z->s->img_n; ++i) {
+        z->img_comp[i].x = (z->img_comp[i].x + round) >> sh;
+        z->img_comp[i].y = (z->img_comp[i].y + round) >> sh;
+        z->img_comp[i].w2 >>= sh;
+        z->img_comp[i].h2 >>= sh;
+    }
 }
 
 // clean up the temporary component buffers
@@ -3309,13 +4134,137 @@ static void stbi__cleanup_jpeg(stbi__jpeg *j)
 
 typedef struct
 {
-    resample_row_func resample;
-    stbi_uc *line0,*line1;
-    int hs,vs;   // expansion factor in each axis
-    int w_lores; // horizontal pixels pre-expansion
-    int ystep;   // how far through vertical expansion we are
-    int ypos;    // which pre-expansion row we're on
-} stbi__resample;
+    resample_row_func resample;
+    stbi_uc *line0,*line1;
+    int hs,vs;   // expansion factor in each axis
+    int w_lores; // horizontal pixels pre-expansion
+    int ystep;   // how far through vertical expansion we are
+    int ypos;    // which pre-expansion row we're on
+} stbi__resample;
+
+static void stbi__resample_advance(stbi__resample *r, int comp_y, int comp_w2)
+{
+    if (++r->ystep >= r->vs) {
+        r->ystep = 0;
+        r->line0 = r->line1;
+        if (++r->ypos < comp_y)
+            r->line1 += comp_w2;
+    }
+}
+
+// resample and color-convert output rows [j0, j1) into output, with linebuf[k]
+// as each component's scratch row; res holds the state as of row 0
+static void stbi__jpeg_convert_rows(stbi__jpeg *z, stbi__resample const *res_comp, stbi_uc **linebuf, stbi_uc *output, stbi_uc *scratch, int n, int decode_n, unsigned int j0, unsigned int j1)
+{
+    stbi__resample res[4];
+    unsigned int i,j;
+    int k;
+    
+    for (k=0; k < decode_n; ++k) {
+        res[k] = res_comp[k];
+        for (j=0; j < j0; ++j)
+            stbi__resample_advance(&res[k], z->img_comp[k].y, z->img_comp[k].w2);
+    }
+    
+    for (j=j0; j < j1; ++j) {
+        // the 3-channel paths store a 4th byte past each pixel, so when this
+        // isn't the last row of the image, the final row goes through scratch
+        // to keep that byte out of the row another job is writing
+        stbi_uc *row = output + n * z->s->img_x * j;
+        stbi_uc *dst = (scratch && j+1 == j1 && j1 < z->s->img_y) ? scratch : row;
+        stbi_uc *out = dst;
+        stbi_uc *coutput[4];
+        for (k=0; k < decode_n; ++k) {
+            stbi__resample *r = &res[k];
+            int y_bot = r->ystep >= (r->vs >> 1);
+            coutput[k] = r->resample(linebuf[k],
+                                     y_bot ? r->line1 : r->line0,
+                                     y_bot ? r->line0 : r->line1,
+                                     r->w_lores, r->hs);
+            stbi__resample_advance(r, z->img_comp[k].y, z->img_comp[k].w2);
+        }
+        if (n >= 3) {
+            stbi_uc *y = coutput[0];
+            if (z->s->img_n == 3) {
+                if (z->rgb == 3) {
+                    for (i=0; i < z->s->img_x; ++i) {
+                        out[0] = y[i];
+                        out[1] = coutput[1][i];
+                        out[2] = coutput[2][i];
+                        out[3] = 255;
+                        out += n;
+                    }
+                } else {
+                    z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
+                }
+            } else
+                for (i=0; i < z->s->img_x; ++i) {
+                    out[0] = out[1] = out[2] = y[i];
+                    out[3] = 255; // not used if n==3
+                    out += n;
+                }
+        } else {
+            stbi_uc *y = coutput[0];
+            if (n == 1)
+                for (i=0; i < z->s->img_x; ++i) out[i] = y[i];
+            else
+                for (i=0; i < z->s->img_x; ++i) *out++ = y[i], *out++ = 255;
+        }
+        if (dst != row)
+            memcpy(row, dst, n * z->s->img_x);
+    }
+}
+
+// rows each conversion job covers at the least
+#define STBI__JPEG_CONVERT_MIN_ROWS  16
+
+typedef struct
+{
+    stbi__jpeg *z;
+    stbi__resample const *res_comp;
+    stbi_uc *output;
+    int n, decode_n, rows_per_job;
+    volatile int failed;
+} stbi__jpeg_convert;
+
+static void stbi__jpeg_convert_job(void *arg, int job)
+{
+    stbi__jpeg_convert *p = (stbi__jpeg_convert *) arg;
+    stbi__jpeg *z = p->z;
+    unsigned int j0 = job * p->rows_per_job;
+    unsigned int j1 = j0 + p->rows_per_job < z->s->img_y ? j0 + p->rows_per_job : z->s->img_y;
+    stbi_uc *linebuf[4];
+    int k;
+    
+    // one scratch row per component, plus one output row
+    stbi_uc *buf = (stbi_uc *) stbi__malloc((p->decode_n + p->n) * (z->s->img_x + 3));
+    if (!buf) { p->failed = 1; return; }
+    for (k=0; k < p->decode_n; ++k)
+        linebuf[k] = buf + k * (z->s->img_x + 3);
+    
+    stbi__jpeg_convert_rows(z, p->res_comp, linebuf, p->output, buf + p->decode_n * (z->s->img_x + 3), p->n, p->decode_n, j0, j1);
+    STBI_FREE(buf);
+}
+
+// runs stbi__jpeg_convert_rows over bands of rows on stbi__parallel_for
+static int stbi__jpeg_convert_parallel(stbi__jpeg *z, stbi__resample const *res_comp, stbi_uc *output, int n, int decode_n)
+{
+    stbi__jpeg_convert p;
+    int num_jobs = z->s->img_y / STBI__JPEG_CONVERT_MIN_ROWS;
+    if (num_jobs > STBI__JPEG_PARALLEL_MAX_JOBS) num_jobs = STBI__JPEG_PARALLEL_MAX_JOBS;
+    
+    p.z = z;
+    p.res_comp = res_comp;
+    p.output = output;
+    p.n = n;
+    p.decode_n = decode_n;
+    p.rows_per_job = (z->s->img_y + num_jobs - 1) / num_jobs;
+    p.failed = 0;
+    num_jobs = (z->s->img_y + p.rows_per_job - 1) / p.rows_per_job;
+    
+    stbi__parallel_for(stbi__parallel_for_user, num_jobs, stbi__jpeg_convert_job, &p);
+    return !p.failed;
+}
 
 static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp, int req_comp)
 {
@@ -3327,6 +4276,7 @@ static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp
     
     // load a jpeg image from whichever source, but leave in YCbCr format
     if (!stbi__decode_jpeg_image(z)) { stbi__cleanup_jpeg(z); return NULL; }
+    stbi__jpeg_apply_scale(z);
     
     // determine actual number of components to generate
     n = req_comp ? req_comp : z->s->img_n;
@@ -3339,7 +4289,6 @@ static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp
     // resample and color-convert
     {
         int k;
-        unsigned int i,j;
         stbi_uc *output;
         stbi_uc *coutput[4];
         
@@ -3367,54 +4316,21 @@ static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp
             else                               r->resample = stbi__resample_row_generic;
         }
         
-        // can't error after this so, this is safe
+        // 3-channel rows store a byte past their last pixel, hence the +1
         output = (stbi_uc *) stbi__malloc(n * z->s->img_x * z->s->img_y + 1);
         if (!output) { stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
         
         // now go ahead and resample
-        for (j=0; j < z->s->img_y; ++j) {
-            stbi_uc *out = output + n * z->s->img_x * j;
-            for (k=0; k < decode_n; ++k) {
-                stbi__resample *r = &res_comp[k];
-                int y_bot = r->ystep >= (r->vs >> 1);
-                coutput[k] = r->resample(z->img_comp[k].linebuf,
-                                         y_bot ? r->line1 : r->line0,
-                                         y_bot ? r->line0 : r->line1,
-                                         r->w_lores, r->hs);
-                if (++r->ystep >= r->vs) {
-                    r->ystep = 0;
-                    r->line0 = r->line1;
-                    if (++r->ypos < z->img_comp[k].y)
-                        r->line1 += z->img_comp[k].w2;
-                }
-            }
-            if (n >= 3) {
-                stbi_uc *y = coutput[0];
-                if (z->s->img_n == 3) {
-                    if (z->rgb == 3) {
-                        for (i=0; i < z->s->img_x; ++i) {
-                            out[0] = y[i];
-                            out[1] = coutput[1][i];
-                            out[2] = coutput[2][i];
-                            out[3] = 255;
-                            out += n;
-                        }
-                    } else {
-                        z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
-                    }
-                } else
-                    for (i=0; i < z->s->img_x; ++i) {
-                        out[0] = out[1] = out[2] = y[i];
-                        out[3] = 255; // not used if n==3
-                        out += n;
-                    }
-            } else {
-                stbi_uc *y = coutput[0];
-                if (n == 1)
-                    for (i=0; i < z->s->img_x; ++i) out[i] = y[i];
-                else
-                    for (i=0; i < z->s->img_x; ++i) *out++ = y[i], *out++ = 255;
+        if (stbi__jpeg_parallel_ok(z) && z->s->img_y >= 2*STBI__JPEG_CONVERT_MIN_ROWS) {
+            if (!stbi__jpeg_convert_parallel(z, res_comp, output, n, decode_n)) {
+                STBI_FREE(output);
+                stbi__cleanup_jpeg(z);
+                return stbi__errpuc("outofmem", "Out of memory");
             }
+        } else {
+            for (k=0; k < decode_n; ++k)
+                coutput[k] = z->img_comp[k].linebuf;
+            stbi__jpeg_convert_rows(z, res_comp, coutput, output, NULL, n, decode_n, 0, z->s->img_y);
         }
         stbi__cleanup_jpeg(z);
         *out_x = z->s->img_x;
@@ -3482,6 +4398,10 @@ static int stbi__jpeg_info(stbi__context *s, int *x, int *y, int *comp)
 #define STBI__ZFAST_BITS  9 // accelerate all cases in default tables
 #define STBI__ZFAST_MASK  ((1 << STBI__ZFAST_BITS) - 1)
 
+// literal pairs: two literals whose codes fit in this many bits together
+#define STBI__ZPAIR_BITS  11
+#define STBI__ZPAIR_MASK  ((1 << STBI__ZPAIR_BITS) - 1)
+
 // zlib-style huffman encoding
 // (jpegs packs from left, zlib from right, so can't share code)
 typedef struct
@@ -3576,6 +4496,10 @@ typedef struct
     int   z_expandable;
     
     stbi__zhuffman z_length, z_distance;
+    
+    // (total_bits << 16) | (second << 8) | first, or 0 if the code at this
+    // index doesn't start with two literals; rebuilt for each block
+    stbi__uint32 zpair[1 << STBI__ZPAIR_BITS];
 } stbi__zbuf;
 
 stbi_inline static stbi_uc stbi__zget8(stbi__zbuf *z)
@@ -3603,12 +4527,14 @@ stbi_inline static unsigned int stbi__zreceive(stbi__zbuf *z, int n)
     return k;
 }
 
-static int stbi__zhuffman_decode_slowpath(stbi__zbuf *a, stbi__zhuffman *z)
+// decodes a code longer than STBI__ZFAST_BITS from the low 16 bits of code,
+// storing its size in *size
+static int stbi__zhuffman_decode_long(stbi__zhuffman *z, unsigned int code, int *size)
 {
     int b,s,k;
     // not resolved by fast table, so compute it the slow way
     // use jpeg approach, which requires MSbits at top
-    k = stbi__bit_reverse(a->code_buffer, 16);
+    k = stbi__bit_reverse(code & 0xffff, 16);
     for (s=STBI__ZFAST_BITS+1; ; ++s)
         if (k < z->maxcode[s])
             break;
@@ -3616,9 +4542,18 @@ static int stbi__zhuffman_decode_slowpath(stbi__zbuf *a, stbi__zhuffman *z)
     // code size is s, so:
     b = (k >> (16-s)) - z->firstcode[s] + z->firstsymbol[s];
     STBI_ASSERT(z->size[b] == s);
+    *size = s;
+    return z->value[b];
+}
+
+static int stbi__zhuffman_decode_slowpath(stbi__zbuf *a, stbi__zhuffman *z)
+{
+    int s;
+    int v = stbi__zhuffman_decode_long(z, a->code_buffer, &s);
+    if (v < 0) return -1;
     a->code_buffer >>= s;
     a->num_bits -= s;
-    return z->value[b];
+    return v;
 }
 
 stbi_inline static int stbi__zhuffman_decode(stbi__zbuf *a, stbi__zhuffman *z)
@@ -3668,11 +4603,167 @@ static int stbi__zdist_base[32] = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,
 static int stbi__zdist_extra[32] =
 { 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13};
 
+// fast inflate
+//
+// While there's plenty of input and output left, blocks are decoded from a
+// local 64-bit bit buffer that is refilled a word at a time, which always
+// holds enough bits for a whole length/distance pair (at most 48). Runs of
+// literals are decoded two at a time through zpair, and matches are copied
+// eight bytes at a time, overshooting into the margin kept at the end of the
+// output. Near either end of the buffers, the byte-wise loop in
+// stbi__parse_huffman_block takes over.
+
+#define STBI__ZFAST_IN_MARGIN   8          // bytes read by one refill
+#define STBI__ZFAST_OUT_MARGIN  (258 + 8)  // longest match plus copy overshoot
+
+static void stbi__zbuild_pairs(stbi__zbuf *a)
+{
+    stbi__uint16 *fast = a->z_length.fast;
+    int i;
+    for (i=0; i < (1 << STBI__ZPAIR_BITS); ++i) {
+        int b1 = fast[i & STBI__ZFAST_MASK], b2, s1, s2;
+        a->zpair[i] = 0;
+        if (!b1 || (b1 & 511) >= 256) continue;
+        s1 = b1 >> 9;
+        b2 = fast[(i >> s1) & STBI__ZFAST_MASK];
+        if (!b2 || (b2 & 511) >= 256) continue;
+        s2 = b2 >> 9;
+        if (s1 + s2 > STBI__ZPAIR_BITS) continue;
+        a->zpair[i] = (stbi__uint32) (((s1 + s2) << 16) | ((b2 & 255) << 8) | (b1 & 255));
+    }
+}
+
+stbi_inline static stbi__uint64 stbi__zload64(stbi_uc const *p)
+{
+    return  (stbi__uint64) p[0]        | ((stbi__uint64) p[1] <<  8) |
+           ((stbi__uint64) p[2] << 16) | ((stbi__uint64) p[3] << 24) |
+           ((stbi__uint64) p[4] << 32) | ((stbi__uint64) p[5] << 40) |
+           ((stbi__uint64) p[6] << 48) | ((stbi__uint64) p[7] << 56);
+}
+
+// returns 1 at the end of the block, 0 on error, and -1 when it ran out of
+// margin, with the stream state written back into a in every case
+static int stbi__parse_huffman_block_fast(stbi__zbuf *a)
+{
+    stbi_uc *in = a->zbuffer;
+    stbi_uc *in_end = a->zbuffer_end - STBI__ZFAST_IN_MARGIN;
+    char *zout = a->zout;
+    char *zout_end = a->zout_end - STBI__ZFAST_OUT_MARGIN;
+    stbi__uint64 bits = a->code_buffer;
+    int num_bits = a->num_bits, result = -1;
+    
+    // a->code_buffer only ever has real input bytes in it here: zget8 only
+    // makes up zeros past the end of the input, and we're well short of it
+    while (in <= in_end && zout <= zout_end) {
+        stbi__uint32 pair;
+        int z, s, len, dist;
+        stbi_uc *p;
+        
+        // branchless refill to 56..63 bits; bytes that don't fit whole are
+        // reloaded next time, and the bits OR'd in again are the same
+        bits |= stbi__zload64(in) << num_bits;
+        in += (63 - num_bits) >> 3;
+        num_bits |= 56;
+        
+        pair = a->zpair[bits & STBI__ZPAIR_MASK];
+        if (pair) {
+            zout[0] = (char) (pair & 255);
+            zout[1] = (char) ((pair >> 8) & 255);
+            zout += 2;
+            s = (int) (pair >> 16);
+            bits >>= s;
+            num_bits -= s;
+            continue;
+        }
+        
+        z = a->z_length.fast[bits & STBI__ZFAST_MASK];
+        if (z) {
+            s = z >> 9;
+            z &= 511;
+        } else {
+            z = stbi__zhuffman_decode_long(&a->z_length, (unsigned int) bits, &s);
+            if (z < 0) { result = stbi__err("bad huffman code","Corrupt PNG"); break; }
+        }
+        bits >>= s;
+        num_bits -= s;
+        
+        if (z < 256) {
+            *zout++ = (char) z;
+            continue;
+        }
+        if (z == 256) {
+            result = 1;
+            break;
+        }
+        
+        z -= 257;
+        len = stbi__zlength_base[z];
+        if (stbi__zlength_extra[z]) {
+            s = stbi__zlength_extra[z];
+            len += (int) (bits & ((1 << s) - 1));
+            bits >>= s;
+            num_bits -= s;
+        }
+        
+        z = a->z_distance.fast[bits & STBI__ZFAST_MASK];
+        if (z) {
+            s = z >> 9;
+            z &= 511;
+        } else {
+            z = stbi__zhuffman_decode_long(&a->z_distance, (unsigned int) bits, &s);
+            if (z < 0) { result = stbi__err("bad huffman code","Corrupt PNG"); break; }
+        }
+        bits >>= s;
+        num_bits -= s;
+        dist = stbi__zdist_base[z];
+        if (stbi__zdist_extra[z]) {
+            s = stbi__zdist_extra[z];
+            dist += (int) (bits & ((1 << s) - 1));
+            bits >>= s;
+            num_bits -= s;
+        }
+        
+        if (zout - a->zout_start < dist) { result = stbi__err("bad dist","Corrupt PNG"); break; }
+        p = (stbi_uc *) (zout - dist);
+        if (dist >= 8) {
+            // each 8-byte chunk is read before the next one overwrites anything
+            char *end = zout + len;
+            do {
+                memcpy(zout, p, 8);
+                zout += 8;
+                p += 8;
+            } while (zout < end);
+            zout = end;
+        } else if (dist == 1) { // run of one byte; common in images.
+            memset(zout, *p, len);
+            zout += len;
+        } else {
+            if (len) { do *zout++ = *p++; while (--len); }
+        }
+    }
+    
+    // hand back whole bytes still sitting in the bit buffer
+    a->zbuffer = in - (num_bits >> 3);
+    a->num_bits = num_bits & 7;
+    a->code_buffer = (stbi__uint32) (bits & ((1u << a->num_bits) - 1));
+    a->zout = zout;
+    return result;
+}
+
 static int stbi__parse_huffman_block(stbi__zbuf *a)
 {
     char *zout = a->zout;
     for(;;) {
-        int z = stbi__zhuffman_decode(a, &a->z_length);
+        int z;
+        if (a->zbuffer_end - a->zbuffer >= STBI__ZFAST_IN_MARGIN
+            && a->zout_end - zout >= STBI__ZFAST_OUT_MARGIN) {
+            int r;
+            a->zout = zout;
+            r = stbi__parse_huffman_block_fast(a);
+            zout = a->zout;
+            if (r >= 0) return r;
+        }
+        z = stbi__zhuffman_decode(a, &a->z_length);
         if (z < 256) {
             if (z < 0) return stbi__err("bad huffman code","Corrupt PNG"); // error in huffman codes
             if (zout >= a->zout_end) {
@@ -3834,6 +4925,7 @@ static int stbi__parse_zlib(stbi__zbuf *a, int parse_header)
             } else {
                 if (!stbi__compute_huffman_codes(a)) return 0;
             }
+            stbi__zbuild_pairs(a);
             if (!stbi__parse_huffman_block(a)) return 0;
         }
     } while (!final);
@@ -3965,6 +5057,9 @@ typedef struct
     stbi__context *s;
     stbi_uc *idata, *expanded, *out;
     int depth;
+    
+    // kernels
+    int (*unfilter_row_kernel)(int filter, stbi_uc *cur, stbi_uc const *raw, stbi_uc const *prior, int nk, int filter_bytes);
 } stbi__png;
 
 
@@ -3999,6 +5094,309 @@ static int stbi__paeth(int a, int b, int c)
     return c;
 }
 
+// SIMD row unfilters
+//
+// These take the same arguments as the scalar loops in stbi__create_png_image_raw:
+// the first pixel of the row has already been handled, so cur[-filter_bytes] is
+// the previous output pixel and prior[-filter_bytes] the one above it. Only
+// 3- and 4-byte pixels get the per-pixel kernels (Up is byte-wise, so it takes
+// anything); the kernel returns 0 for rows it doesn't handle, which fall back
+// to the scalar loops.
+//
+// Pixels are loaded and stored exactly filter_bytes wide, so nothing is read
+// past the end of the decompressed data or written past the end of the row.
+// They're put together byte by byte in a register: a memcpy of a runtime size
+// is a libc call per pixel, and even a 3-byte one goes through the stack and
+// stalls the 4-byte reload.
+
+#ifdef STBI_SSE2
+stbi_inline static __m128i stbi__png_load_px(stbi_uc const *p, int n)
+{
+    int v = p[0] | (p[1] << 8) | (p[2] << 16);
+    if (n == 4) v |= p[3] << 24;
+    return _mm_cvtsi32_si128(v);
+}
+
+stbi_inline static void stbi__png_store_px(stbi_uc *p, __m128i v, int n)
+{
+    int x = _mm_cvtsi128_si32(v);
+    p[0] = (stbi_uc) x;
+    p[1] = (stbi_uc) (x >> 8);
+    p[2] = (stbi_uc) (x >> 16);
+    if (n == 4) p[3] = (stbi_uc) (x >> 24);
+}
+
+static void stbi__png_up_row_sse2(stbi_uc *cur, stbi_uc const *raw, stbi_uc const *prior, int nk)
+{
+    int k = 0;
+    for (; k+16 <= nk; k += 16) {
+        __m128i x = _mm_loadu_si128((__m128i const *) (raw+k));
+        __m128i b = _mm_loadu_si128((__m128i const *) (prior+k));
+        _mm_storeu_si128((__m128i *) (cur+k), _mm_add_epi8(x, b));
+    }
+    for (; k < nk; ++k)
+        cur[k] = STBI__BYTECAST(raw[k] + prior[k]);
+}
+
+stbi_inline static void stbi__png_sub_row_sse2(stbi_uc *cur, stbi_uc const *raw, int nk, int n)
+{
+    __m128i a = stbi__png_load_px(cur - n, n);
+    int k = 0;
+    if (n == 4) {
+        // prefix sum over four pixels at a time, carrying the last one
+        a = _mm_shuffle_epi32(a, 0x00);
+        for (; k+16 <= nk; k += 16) {
+            __m128i x = _mm_loadu_si128((__m128i const *) (raw+k));
+            x = _mm_add_epi8(x, _mm_slli_si128(x, 4));
+            x = _mm_add_epi8(x, _mm_slli_si128(x, 8));
+            x = _mm_add_epi8(x, a);
+            _mm_storeu_si128((__m128i *) (cur+k), x);
+            a = _mm_shuffle_epi32(x, 0xff);
+        }
+    }
+    for (; k < nk; k += n) {
+        a = _mm_add_epi8(a, stbi__png_load_px(raw+k, n));
+        stbi__png_store_px(cur+k, a, n);
+    }
+}
+
+// prior is NULL for the first row
+stbi_inline static void stbi__png_avg_row_sse2(stbi_uc *cur, stbi_uc const *raw, stbi_uc const *prior, int nk, int n)
+{
+    // pavgb rounds up, (a+b)>>1 rounds down; they differ exactly when a+b is odd
+    __m128i one = _mm_set1_epi8(1);
+    __m128i b = _mm_setzero_si128();
+    __m128i a = stbi__png_load_px(cur - n, n);
+    int k;
+    for (k=0; k < nk; k += n) {
+        __m128i avg;
+        if (prior) b = stbi__png_load_px(prior+k, n);
+        avg = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+        a = _mm_add_epi8(stbi__png_load_px(raw+k, n), avg);
+        stbi__png_store_px(cur+k, a, n);
+    }
+}
+
+stbi_inline static __m128i stbi__abs_epi16_sse2(__m128i x)
+{
+    return _mm_max_epi16(x, _mm_sub_epi16(_mm_setzero_si128(), x));
+}
+
+// Paeth in 16-bit lanes; p = a+b-c gives pa = |b-c|, pb = |a-c|, pc = |a+b-2c|,
+// and the selects keep stbi__paeth's tie order of a, then b, then c
+#define STBI__PNG_PAETH_ROW(name, target, abs_epi16)                                   \
+target static void name(stbi_uc *cur, stbi_uc const *raw, stbi_uc const *prior, int nk, int n) \
+{                                                                                      \
+    __m128i zero = _mm_setzero_si128();                                                \
+    __m128i a = _mm_unpacklo_epi8(stbi__png_load_px(cur - n, n), zero);                \
+    __m128i c = _mm_unpacklo_epi8(stbi__png_load_px(prior - n, n), zero);              \
+    int k;                                                                             \
+    for (k=0; k < nk; k += n) {                                                        \
+        __m128i b = _mm_unpacklo_epi8(stbi__png_load_px(prior+k, n), zero);            \
+        __m128i pa = abs_epi16(_mm_sub_epi16(b, c));                                   \
+        __m128i pb = abs_epi16(_mm_sub_epi16(a, c));                                   \
+        __m128i pc = abs_epi16(_mm_sub_epi16(_mm_add_epi16(a, b), _mm_add_epi16(c, c))); \
+        __m128i smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));                   \
+        __m128i use_a = _mm_cmpeq_epi16(pa, smallest);                                 \
+        __m128i use_b = _mm_cmpeq_epi16(pb, smallest);                                 \
+        __m128i pred = _mm_or_si128(_mm_and_si128(use_b, b), _mm_andnot_si128(use_b, c)); \
+        __m128i x;                                                                     \
+        pred = _mm_or_si128(_mm_and_si128(use_a, a), _mm_andnot_si128(use_a, pred));   \
+        x = _mm_add_epi8(stbi__png_load_px(raw+k, n), _mm_packus_epi16(pred, pred));   \
+        stbi__png_store_px(cur+k, x, n);                                               \
+        a = _mm_unpacklo_epi8(x, zero);                                                \
+        c = b;                                                                         \
+    }                                                                                  \
+}
+
+STBI__PNG_PAETH_ROW(stbi__png_paeth_row_sse2, , stbi__abs_epi16_sse2)
+
+static int stbi__png_unfilter_row_sse2(int filter, stbi_uc *cur, stbi_uc const *raw, stbi_uc const *prior, int nk, int filter_bytes)
+{
+    if (filter == STBI__F_up) {
+        stbi__png_up_row_sse2(cur, raw, prior, nk);
+        return 1;
+    }
+    
+    if (filter_bytes != 3 && filter_bytes != 4)
+        return 0;
+    
+    // paeth(a,0,0) is always a, so the first-row Paeth is just Sub
+    switch (filter) {
+        case STBI__F_sub:
+        case STBI__F_paeth_first:
+            if (filter_bytes == 4) stbi__png_sub_row_sse2(cur, raw, nk, 4);
+            else                   stbi__png_sub_row_sse2(cur, raw, nk, 3);
+            return 1;
+        case STBI__F_avg:
+            if (filter_bytes == 4) stbi__png_avg_row_sse2(cur, raw, prior, nk, 4);
+            else                   stbi__png_avg_row_sse2(cur, raw, prior, nk, 3);
+            return 1;
+        case STBI__F_avg_first:
+            if (filter_bytes == 4) stbi__png_avg_row_sse2(cur, raw, NULL, nk, 4);
+            else                   stbi__png_avg_row_sse2(cur, raw, NULL, nk, 3);
+            return 1;
+        case STBI__F_paeth:
+            stbi__png_paeth_row_sse2(cur, raw, prior, nk, filter_bytes);
+            return 1;
+    }
+    return 0;
+}
+
+#ifdef STBI__SSSE3
+STBI__PNG_PAETH_ROW(stbi__png_paeth_row_ssse3, STBI__TARGET_SSSE3, _mm_abs_epi16)
+
+static int stbi__png_unfilter_row_ssse3(int filter, stbi_uc *cur, stbi_uc const *raw, stbi_uc const *prior, int nk, int filter_bytes)
+{
+    if (filter == STBI__F_paeth && (filter_bytes == 3 || filter_bytes == 4)) {
+        stbi__png_paeth_row_ssse3(cur, raw, prior, nk, filter_bytes);
+        return 1;
+    }
+    return stbi__png_unfilter_row_sse2(filter, cur, raw, prior, nk, filter_bytes);
+}
+#endif
+#undef STBI__PNG_PAETH_ROW
+#endif // STBI_SSE2
+
+#ifdef STBI_NEON
+stbi_inline static uint8x8_t stbi__png_load_px_neon(stbi_uc const *p, int n)
+{
+    stbi__uint32 v = p[0] | (p[1] << 8) | ((stbi__uint32) p[2] << 16);
+    if (n == 4) v |= (stbi__uint32) p[3] << 24;
+    return vreinterpret_u8_u32(vdup_n_u32(v));
+}
+
+stbi_inline static void stbi__png_store_px_neon(stbi_uc *p, uint8x8_t v, int n)
+{
+    stbi__uint32 x = vget_lane_u32(vreinterpret_u32_u8(v), 0);
+    p[0] = (stbi_uc) x;
+    p[1] = (stbi_uc) (x >> 8);
+    p[2] = (stbi_uc) (x >> 16);
+    if (n == 4) p[3] = (stbi_uc) (x >> 24);
+}
+
+static void stbi__png_up_row_neon(stbi_uc *cur, stbi_uc const *raw, stbi_uc const *prior, int nk)
+{
+    int k = 0;
+    for (; k+16 <= nk; k += 16)
+        vst1q_u8(cur+k, vaddq_u8(vld1q_u8(raw+k), vld1q_u8(prior+k)));
+    for (; k < nk; ++k)
+        cur[k] = STBI__BYTECAST(raw[k] + prior[k]);
+}
+
+stbi_inline static void stbi__png_sub_row_neon(stbi_uc *cur, stbi_uc const *raw, int nk, int n)
+{
+    uint8x8_t a = stbi__png_load_px_neon(cur - n, n);
+    int k = 0;
+    if (n == 4) {
+        uint8x16_t zero = vdupq_n_u8(0);
+        uint8x16_t a4 = vreinterpretq_u8_u32(vdupq_n_u32(vget_lane_u32(vreinterpret_u32_u8(a), 0)));
+        for (; k+16 <= nk; k += 16) {
+            uint8x16_t x = vld1q_u8(raw+k);
+            x = vaddq_u8(x, vextq_u8(zero, x, 12));
+            x = vaddq_u8(x, vextq_u8(zero, x, 8));
+            x = vaddq_u8(x, a4);
+            vst1q_u8(cur+k, x);
+            a4 = vreinterpretq_u8_u32(vdupq_n_u32(vgetq_lane_u32(vreinterpretq_u32_u8(x), 3)));
+        }
+        a = vget_low_u8(a4);
+    }
+    for (; k < nk; k += n) {
+        a = vadd_u8(a, stbi__png_load_px_neon(raw+k, n));
+        stbi__png_store_px_neon(cur+k, a, n);
+    }
+}
+
+stbi_inline static void stbi__png_avg_row_neon(stbi_uc *cur, stbi_uc const *raw, stbi_uc const *prior, int nk, int n)
+{
+    uint8x8_t a = stbi__png_load_px_neon(cur - n, n);
+    int k;
+    if (!prior) {
+        for (k=0; k < nk; k += n) {
+            a = vadd_u8(stbi__png_load_px_neon(raw+k, n), vshr_n_u8(a, 1));
+            stbi__png_store_px_neon(cur+k, a, n);
+        }
+        return;
+    }
+    for (k=0; k < nk; k += n) {
+        // vhadd truncates, which is exactly the filter's (a+b)>>1
+        uint8x8_t b = stbi__png_load_px_neon(prior+k, n);
+        a = vadd_u8(stbi__png_load_px_neon(raw+k, n), vhadd_u8(a, b));
+        stbi__png_store_px_neon(cur+k, a, n);
+    }
+}
+
+static void stbi__png_paeth_row_neon(stbi_uc *cur, stbi_uc const *raw, stbi_uc const *prior, int nk, int n)
+{
+    uint8x8_t a = stbi__png_load_px_neon(cur - n, n);
+    uint8x8_t c = stbi__png_load_px_neon(prior - n, n);
+    int k;
+    for (k=0; k < nk; k += n) {
+        uint8x8_t b = stbi__png_load_px_neon(prior+k, n);
+        uint16x8_t pa = vabdl_u8(b, c);
+        uint16x8_t pb = vabdl_u8(a, c);
+        uint16x8_t pc = vabdq_u16(vaddl_u8(a, b), vaddl_u8(c, c));
+        uint8x8_t use_a = vmovn_u16(vandq_u16(vcleq_u16(pa, pb), vcleq_u16(pa, pc)));
+        uint8x8_t use_b = vmovn_u16(vcleq_u16(pb, pc));
+        uint8x8_t pred = vbsl_u8(use_a, a, vbsl_u8(use_b, b, c));
+        a = vadd_u8(stbi__png_load_px_neon(raw+k, n), pred);
+        stbi__png_store_px_neon(cur+k, a, n);
+        c = b;
+    }
+}
+
+static int stbi__png_unfilter_row_neon(int filter, stbi_uc *cur, stbi_uc const *raw, stbi_uc const *prior, int nk, int filter_bytes)
+{
+    if (filter == STBI__F_up) {
+        stbi__png_up_row_neon(cur, raw, prior, nk);
+        return 1;
+    }
+    
+    if (filter_bytes != 3 && filter_bytes != 4)
+        return 0;
+    
+    switch (filter) {
+        case STBI__F_sub:
+        case STBI__F_paeth_first:
+            if (filter_bytes == 4) stbi__png_sub_row_neon(cur, raw, nk, 4);
+            else                   stbi__png_sub_row_neon(cur, raw, nk, 3);
+            return 1;
+        case STBI__F_avg:
+            if (filter_bytes == 4) stbi__png_avg_row_neon(cur, raw, prior, nk, 4);
+            else                   stbi__png_avg_row_neon(cur, raw, prior, nk, 3);
+            return 1;
+        case STBI__F_avg_first:
+            if (filter_bytes == 4) stbi__png_avg_row_neon(cur, raw, NULL, nk, 4);
+            else                   stbi__png_avg_row_neon(cur, raw, NULL, nk, 3);
+            return 1;
+        case STBI__F_paeth:
+            stbi__png_paeth_row_neon(cur, raw, prior, nk, filter_bytes);
+            return 1;
+    }
+    return 0;
+}
+#endif // STBI_NEON
+
+// set up the kernels
+static void stbi__setup_png(stbi__png *p)
+{
+    p->unfilter_row_kernel = NULL; // scalar loops
+    
+#ifdef STBI_SSE2
+    if (stbi__sse2_available()) {
+        p->unfilter_row_kernel = stbi__png_unfilter_row_sse2;
+#ifdef STBI__SSSE3
+        if (stbi__ssse3_available())
+            p->unfilter_row_kernel = stbi__png_unfilter_row_ssse3;
+#endif
+    }
+#endif
+    
+#ifdef STBI_NEON
+    p->unfilter_row_kernel = stbi__png_unfilter_row_neon;
+#endif
+}
+
 static stbi_uc stbi__depth_scale_table[9] = { 0, 0xff, 0x55, 0, 0x11, 0,0,0, 0x01 };
 
 // create the png data from post-deflated data
@@ -4081,10 +5479,13 @@ static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 r
         // this is a little gross, so that we don't switch per-pixel or per-component
         if (depth < 8 || img_n == out_n) {
             int nk = (width - 1)*filter_bytes;
+            int done = 0;
+            if (depth >= 8 && filter != STBI__F_none && a->unfilter_row_kernel)
+                done = a->unfilter_row_kernel(filter, cur, raw, prior, nk, filter_bytes);
 #define CASE(f) \
 case f:     \
 for (k=0; k < nk; ++k)
-            switch (filter) {
+            if (!done) switch (filter) {
                     // "none" filter turns into a memcpy here; make that explicit.
                 case STBI__F_none:         memcpy(cur, raw, nk); break;
                     CASE(STBI__F_sub)          cur[k] = STBI__BYTECAST(raw[k] + cur[k-filter_bytes]); break;
@@ -4619,6 +6020,7 @@ static unsigned char *stbi__png_load(stbi__context *s, int *x, int *y, int *comp
 {
     stbi__png p;
     p.s = s;
+    stbi__setup_png(&p);
     return stbi__do_png(&p, x,y,comp,req_comp);
 }
 
@@ -4646,6 +6048,7 @@ static int stbi__png_info(stbi__context *s, int *x, int *y, int *comp)
 {
     stbi__png p;
     p.s = s;
+    stbi__setup_png(&p);
     return stbi__png_info_raw(&p, x, y, comp);
 }
 #endif
@@ -5096,6 +6499,106 @@ void stbi__tga_read_rgb16(stbi__context *s, stbi_uc* out)
     // so let's treat all 15 and 16bit TGAs as RGB with no alpha.
 }
 
+// converts n pixels of TGA data (BGR(A) when comp >= 3) to out_n components
+// in RGB(A) order; comp and out_n are both 1-2 (and equal) or both 3-4
+static void stbi__tga_convert_pixels(stbi_uc *dst, stbi_uc const *src, int n, int comp, int out_n)
+{
+    int i;
+    if (comp < 3) {
+        memcpy(dst, src, (size_t) n * comp);
+    } else if (comp == 4 && out_n == 4) {
+        for (i=0; i < n; ++i, src += 4, dst += 4) {
+            dst[0] = src[2]; dst[1] = src[1]; dst[2] = src[0]; dst[3] = src[3];
+        }
+    } else {
+        for (i=0; i < n; ++i, src += comp, dst += out_n) {
+            dst[0] = src[2]; dst[1] = src[1]; dst[2] = src[0];
+            if (out_n == 4) dst[3] = comp == 4 ? src[3] : 255;
+        }
+    }
+}
+
+#ifdef STBI__SSSE3
+// same as above, with pshufb doing the swizzle for the 3/4 -> 4 cases
+static STBI__TARGET_SSSE3 void stbi__tga_convert_pixels_ssse3(stbi_uc *dst, stbi_uc const *src, int n, int comp, int out_n)
+{
+    int i = 0;
+    if (out_n == 4 && comp == 4) {
+        __m128i shuf = _mm_setr_epi8(2,1,0,3, 6,5,4,7, 10,9,8,11, 14,13,12,15);
+        for (; i+4 <= n; i += 4)
+            _mm_storeu_si128((__m128i *) (dst + i*4), _mm_shuffle_epi8(_mm_loadu_si128((__m128i const *) (src + i*4)), shuf));
+    } else if (out_n == 4 && comp == 3) {
+        // 16-byte loads for 4 pixels' 12 bytes, so stop 2 pixels early
+        __m128i shuf  = _mm_setr_epi8(2,1,0,-1, 5,4,3,-1, 8,7,6,-1, 11,10,9,-1);
+        __m128i alpha = _mm_set1_epi32((int) 0xff000000);
+        for (; i+6 <= n; i += 4)
+            _mm_storeu_si128((__m128i *) (dst + i*4), _mm_or_si128(_mm_shuffle_epi8(_mm_loadu_si128((__m128i const *) (src + i*3)), shuf), alpha));
+    }
+    stbi__tga_convert_pixels(dst + i*out_n, src + i*comp, n - i, comp, out_n);
+}
+#endif
+
+// decode the pixels of a true-color or greyscale TGA, raw or RLE, straight
+// into their final place: RLE packets are expanded a row at a time, with runs
+// filled and raw packets copied in bulk, then the row is swizzled in one go
+// into the output row it belongs in for the file's origin and the requested
+// orientation, so no separate swap or flip pass is needed.
+static int stbi__tga_load_direct(stbi__context *s, stbi_uc *out, int w, int h, int comp, int out_n, int is_rle, int reverse_rows)
+{
+    void (*convert)(stbi_uc *dst, stbi_uc const *src, int n, int comp, int out_n) = stbi__tga_convert_pixels;
+    stbi_uc *src;
+    stbi_uc run_px[4];
+    int i, j, x, run_count = 0, run_repeat = 0;
+    
+#ifdef STBI__SSSE3
+    if (comp >= 3 && out_n == 4 && stbi__ssse3_available())
+        convert = stbi__tga_convert_pixels_ssse3;
+#endif
+    
+    src = (stbi_uc *) stbi__malloc((size_t) w * comp);
+    if (!src) return stbi__err("outofmem", "Out of memory");
+    
+    for (i=0; i < h; ++i) {
+        if (!is_rle) {
+            if (!stbi__getn(s, src, w * comp)) memset(src, 0, (size_t) w * comp);
+        } else {
+            // packets may run across rows, so their state carries over
+            for (x=0; x < w; ) {
+                stbi_uc *p = src + x*comp;
+                int k;
+                if (run_count == 0) {
+                    int cmd = stbi__get8(s);
+                    run_count = 1 + (cmd & 127);
+                    run_repeat = cmd >> 7;
+                    if (run_repeat)
+                        for (j=0; j < comp; ++j) run_px[j] = stbi__get8(s);
+                }
+                k = run_count < w - x ? run_count : w - x;
+                if (!run_repeat) {
+                    if (!stbi__getn(s, p, k * comp)) memset(p, 0, (size_t) k * comp);
+                } else if (comp == 1) {
+                    memset(p, run_px[0], k);
+                } else if (comp == 4) {
+                    stbi__uint32 v;
+                    memcpy(&v, run_px, 4);
+                    for (j=0; j < k; ++j) memcpy(p + j*4, &v, 4);
+                } else {
+                    for (j=0; j < k*comp; j += comp) {
+                        p[j] = run_px[0]; p[j+1] = run_px[1];
+                        if (comp == 3) p[j+2] = run_px[2];
+                    }
+                }
+                x += k;
+                run_count -= k;
+            }
+        }
+        convert(out + (size_t) (reverse_rows ? h - 1 - i : i) * w * out_n, src, w, comp, out_n);
+    }
+    
+    STBI_FREE(src);
+    return 1;
+}
+
 static stbi_uc *stbi__tga_load(stbi__context *s, int *x, int *y, int *comp, int req_comp)
 {
     //   read in the TGA header stuff
@@ -5111,7 +6614,7 @@ static stbi_uc *stbi__tga_load(stbi__context *s, int *x, int *y, int *comp, int
     int tga_width = stbi__get16le(s);
     int tga_height = stbi__get16le(s);
     int tga_bits_per_pixel = stbi__get8(s);
-    int tga_comp, tga_rgb16=0;
+    int tga_comp, tga_rgb16=0, tga_out_n;
     int tga_inverted = stbi__get8(s);
     // int tga_alpha_bits = tga_inverted & 15; // the 4 lowest bits - unused (useless?)
     //   image data
@@ -5143,18 +6646,25 @@ static stbi_uc *stbi__tga_load(stbi__context *s, int *x, int *y, int *comp, int
     *y = tga_height;
     if (comp) *comp = tga_comp;
     
-    tga_data = (unsigned char*)stbi__malloc( (size_t)tga_width * tga_height * tga_comp );
+    // true-color data can go straight to 3 or 4 components while swizzling
+    tga_out_n = tga_comp;
+    if (!tga_indexed && !tga_rgb16 && tga_comp >= 3 && (req_comp == 3 || req_comp == 4))
+        tga_out_n = req_comp;
+    
+    tga_data = (unsigned char*)stbi__malloc( (size_t)tga_width * tga_height * tga_out_n );
     if (!tga_data) return stbi__errpuc("outofmem", "Out of memory");
     
     // skip to the data's starting position (offset usually = 0)
     stbi__skip(s, tga_offset );
     
-    if ( !tga_indexed && !tga_is_RLE && !tga_rgb16 ) {
-        for (i=0; i < tga_height; ++i) {
-            int row = tga_inverted ? tga_height -i - 1 : i;
-            stbi_uc *tga_row = tga_data + row*tga_width*tga_comp;
-            stbi__getn(s, tga_row, tga_width * tga_comp);
+    if ( !tga_indexed && !tga_rgb16 ) {
+        // rows come out bottom-up already if that's what the caller wants
+        if (!stbi__tga_load_direct(s, tga_data, tga_width, tga_height, tga_comp, tga_out_n,
+                                   tga_is_RLE, tga_inverted != s->flip_vertically)) {
+            STBI_FREE(tga_data);
+            return NULL;
         }
+        s->flipped = s->flip_vertically;
     } else  {
         //   do I need to load a palette?
         if ( tga_indexed)
@@ -5237,8 +6747,8 @@ static stbi_uc *stbi__tga_load(stbi__context *s, int *x, int *y, int *comp, int
             //   in case we're in RLE mode, keep counting down
             --RLE_count;
         }
-        //   do I need to invert the image?
-        if ( tga_inverted )
+        //   do I need to invert the image? (taking the requested orientation into account)
+        if ( tga_inverted != s->flip_vertically )
         {
             for (j = 0; j*2 < tga_height; ++j)
             {
@@ -5254,29 +6764,30 @@ static stbi_uc *stbi__tga_load(stbi__context *s, int *x, int *y, int *comp, int
                 }
             }
         }
+        s->flipped = s->flip_vertically;
         //   clear my palette, if I had one
         if ( tga_palette != NULL )
         {
             STBI_FREE( tga_palette );
         }
-    }
-    
-    // swap RGB - if the source data was RGB16, it already is in the right order
-    if (tga_comp >= 3 && !tga_rgb16)
-    {
-        unsigned char* tga_pixel = tga_data;
-        for (i=0; i < tga_width * tga_height; ++i)
+        
+        // swap RGB - if the source data was RGB16, it already is in the right order
+        if (tga_comp >= 3 && !tga_rgb16)
         {
-            unsigned char temp = tga_pixel[0];
-            tga_pixel[0] = tga_pixel[2];
-            tga_pixel[2] = temp;
-            tga_pixel += tga_comp;
+            unsigned char* tga_pixel = tga_data;
+            for (i=0; i < tga_width * tga_height; ++i)
+            {
+                unsigned char temp = tga_pixel[0];
+                tga_pixel[0] = tga_pixel[2];
+                tga_pixel[2] = temp;
+                tga_pixel += tga_comp;
+            }
         }
     }
     
     // convert to target component count
-    if (req_comp && req_comp != tga_comp)
-        tga_data = stbi__convert_format(tga_data, tga_comp, req_comp, tga_width, tga_height);
+    if (req_comp && req_comp != tga_out_n)
+        tga_data = stbi__convert_format(tga_data, tga_out_n, req_comp, tga_width, tga_height);
     
     //   the things I do to get rid of an error message, and yet keep
     //   Microsoft's C compilers happy... [8^(
@@ -6582,6 +8093,50 @@ STBIDEF int stbi_info_from_memory(stbi_uc const *buffer, int len, int *x, int *y
     return stbi__info_main(&s,x,y,comp);
 }
 
+// runs a given format's info parser only; each one rewinds when it fails
+static int stbi__info_format(stbi__context *s, int format, int *x, int *y, int *comp)
+{
+    switch (format) {
+#ifndef STBI_NO_JPEG
+        case STBI_format_jpeg: return stbi__jpeg_info(s, x, y, comp);
+#endif
+#ifndef STBI_NO_PNG
+        case STBI_format_png:  return stbi__png_info(s, x, y, comp);
+#endif
+#ifndef STBI_NO_BMP
+        case STBI_format_bmp:  return stbi__bmp_info(s, x, y, comp);
+#endif
+#ifndef STBI_NO_GIF
+        case STBI_format_gif:  return stbi__gif_info(s, x, y, comp);
+#endif
+#ifndef STBI_NO_PSD
+        case STBI_format_psd:  return stbi__psd_info(s, x, y, comp);
+#endif
+#ifndef STBI_NO_PIC
+        case STBI_format_pic:  return stbi__pic_info(s, x, y, comp);
+#endif
+#ifndef STBI_NO_PNM
+        case STBI_format_pnm:  return stbi__pnm_info(s, x, y, comp);
+#endif
+#ifndef STBI_NO_HDR
+        case STBI_format_hdr:  return stbi__hdr_info(s, x, y, comp);
+#endif
+#ifndef STBI_NO_TGA
+        case STBI_format_tga:  return stbi__tga_info(s, x, y, comp);
+#endif
+        default: return 0;
+    }
+}
+
+STBIDEF int stbi_info_from_memory_ex(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int format)
+{
+    stbi__context s;
+    stbi__start_mem(&s,buffer,len);
+    if (stbi__info_format(&s, format, x, y, comp)) return 1;
+    stbi__rewind(&s);
+    return stbi__info_main(&s,x,y,comp);
+}
+
 STBIDEF int stbi_info_from_callbacks(stbi_io_callbacks const *c, void *user, int *x, int *y, int *comp)
 {
     stbi__context s;